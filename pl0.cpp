@@ -3,1125 +3,9664 @@
 #include<vector>
 #include<algorithm>
 #include<typeinfo>
+#include<new>
+#include<cstddef>
+#include<cstdlib>
+#include<cstdint>
+#include<type_traits>
+#include<utility>
+#include<variant>
+#include<string_view>
+#include<chrono>
+#include<array>
+#include<cstring>
+#include<limits>
+#include<fstream>
+#include<sstream>
+#include<thread>
+#include<mutex>
+#include<atomic>
+#include<deque>
+#include<memory>
+#include<filesystem>
+#include<charconv>
+#include<random>
+
+// The x86-64 JIT needs mmap; build with -DPL0_NO_JIT to leave it out.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__)) && !defined(PL0_NO_JIT)
+#define PL0_JIT 1
+#include<sys/mman.h>
+#endif
+
+// Source files are mapped rather than read where POSIX mmap exists; build with
+// -DPL0_NO_MMAP to stream every file through the lexer's window instead.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(PL0_NO_MMAP)
+#define PL0_MMAP 1
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<unistd.h>
+#endif
+
+// The lexer scans runs of blanks, identifier characters and digits 16 or 32
+// bytes at a time with SSE2 or AVX2, picked at run time; build with
+// -DPL0_NO_SIMD to keep only the scalar loops.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(PL0_NO_SIMD)
+#define PL0_SIMD 1
+#include<immintrin.h>
+#endif
+
+// Width and overflow behaviour of PL/0 integers, fixed at build time:
+// -DPL0_INT64 for 64-bit, -DPL0_CHECKED for 64-bit that raises "integer overflow"
+// instead of wrapping, -DPL0_INT128 for 128-bit (GNU dialect only, for the
+// standard library's __int128 support); 32-bit wrap-around otherwise.
+#if defined(PL0_INT128)
+#if defined(__STRICT_ANSI__)
+#error "PL0_INT128 needs -std=gnu++17"
+#endif
+#define PL0_VALUE_MODE "int128"
+#define PL0_VALUE_MODE_ID 3
+#elif defined(PL0_CHECKED)
+#define PL0_VALUE_MODE "checked int64"
+#define PL0_VALUE_MODE_ID 2
+#elif defined(PL0_INT64)
+#define PL0_VALUE_MODE "int64"
+#define PL0_VALUE_MODE_ID 1
+#else
+#define PL0_VALUE_MODE "int32"
+#define PL0_VALUE_MODE_ID 0
+#endif
 
 using namespace std;
 
-string TEST_PROGRAM = "var i, s;\
-begin\
-    i := 0; s := 0;\
-    while i < 5 do\
-    begin\
-        i := i + 1;\
-        s := s + i * i\
-    end\
-end.";
+// Runtime integer type of compiled PL/0 programs, and the unsigned type its
+// wrap-around arithmetic is done in.
+#if defined(PL0_INT128)
+typedef __int128 Value;
+typedef unsigned __int128 ValueBits;
+#elif defined(PL0_CHECKED) || defined(PL0_INT64)
+typedef int64_t Value;
+typedef uint64_t ValueBits;
+#else
+typedef int Value;
+typedef unsigned ValueBits;
+#endif
+
+#if defined(PL0_CHECKED)
+constexpr bool VALUE_CHECKED = true;
+#else
+constexpr bool VALUE_CHECKED = false;
+#endif
+
+#if defined(PL0_INT128)
+// Streams have no __int128 overloads.
+ostream& operator<<(ostream& cout, __int128 value)
+{
+    char digits[48];
+    char* end = digits + sizeof(digits);
+    char* p = end;
+    unsigned __int128 magnitude = value < 0 ? 0 - (unsigned __int128)value : value;
+    do
+    {
+        *--p = char('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0)
+    {
+        *--p = '-';
+    }
+    cout.write(p, end - p);
+    return cout;
+}
 
-bool isDIGIT(char ch)
+// Reads an optionally signed decimal, failing like the built-in overloads: 0 when
+// there are no digits, the nearest limit when the number is out of range.
+istream& operator>>(istream& cin, __int128& value)
 {
-    if (ch >= '0' && ch <= '9')
+    istream::sentry ok(cin);  // skips leading blanks
+    if (!ok)
     {
-        return true;
+        return cin;
     }
-    return false;
+    bool negative = false;
+    if (cin.peek() == '+' || cin.peek() == '-')
+    {
+        negative = cin.get() == '-';
+    }
+    const unsigned __int128 limit = (unsigned __int128)numeric_limits<__int128>::max() + negative;
+    unsigned __int128 magnitude = 0;
+    bool digits = false;
+    bool range = true;
+    for (int ch = cin.peek(); ch >= '0' && ch <= '9'; ch = cin.peek())
+    {
+        cin.get();
+        digits = true;
+        unsigned digit = ch - '0';
+        range = range && magnitude <= (limit - digit) / 10;
+        magnitude = range ? magnitude * 10 + digit : limit;
+    }
+    if (!digits || !range)
+    {
+        cin.setstate(ios::failbit);
+    }
+    value = !digits ? 0 : negative ? (__int128)(0 - magnitude) : (__int128)magnitude;
+    return cin;
 }
+#endif
+
+string TEST_PROGRAM = "var i, s; \
+begin \
+    i := 0; s := 0; \
+    while i < 5 do \
+    begin \
+        i := i + 1; \
+        s := s + i * i \
+    end \
+end.";
 
-bool isIDENT_FIRST(char ch)
+string TEST_PROGRAM2 = "var x, squ; \
+procedure square; \
+begin \
+   squ := x * x \
+end; \
+begin \
+   x := 1; \
+   while x <= 10 do \
+   begin \
+      call square; \
+      x := x + 1 \
+   end \
+end.";
+
+// A recursive procedure with a local: each activation keeps its own m, so f = 10! = 3628800.
+string TEST_PROGRAM3 = "var n, f; \
+procedure fact; \
+var m; \
+begin \
+   m := n; \
+   n := n - 1; \
+   if n > 0 then call fact; \
+   f := f * m \
+end; \
+begin \
+   n := 10; f := 1; \
+   call fact \
+end.";
+
+// Character classes of the lexer, looked up through a 256-entry table built at compile time.
+enum CharClass : uint8_t
 {
-    if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_')
+    CC_DIGIT = 1,
+    CC_IDENT_FIRST = 2,
+    CC_IDENT_REMAIN = 4,
+    CC_OP = 8,
+    CC_BLANK = 16,
+};
+
+constexpr array<uint8_t, 256> makeCharClassTable()
+{
+    array<uint8_t, 256> table{};
+    for (int ch = 0; ch < 256; ch++)
     {
-        return true;
+        uint8_t cls = 0;
+        if (ch >= '0' && ch <= '9')
+        {
+            cls |= CC_DIGIT | CC_IDENT_REMAIN;
+        }
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_')
+        {
+            cls |= CC_IDENT_FIRST | CC_IDENT_REMAIN;
+        }
+        for (char op : string_view("=#+-*/,.;()"))
+        {
+            if (ch == op)
+            {
+                cls |= CC_OP;
+            }
+        }
+        if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\v' || ch == '\f')
+        {
+            cls |= CC_BLANK;
+        }
+        table[ch] = cls;
     }
-    return false;
+    return table;
+}
+
+constexpr array<uint8_t, 256> CHAR_CLASS = makeCharClassTable();
+
+inline bool isDIGIT(char ch)
+{
+    return CHAR_CLASS[static_cast<unsigned char>(ch)] & CC_DIGIT;
+}
+
+inline bool isIDENT_FIRST(char ch)
+{
+    return CHAR_CLASS[static_cast<unsigned char>(ch)] & CC_IDENT_FIRST;
+}
+
+inline bool isIDENT_REMAIN(char ch)
+{
+    return CHAR_CLASS[static_cast<unsigned char>(ch)] & CC_IDENT_REMAIN;
+}
+
+inline bool isOP(char ch)
+{
+    return CHAR_CLASS[static_cast<unsigned char>(ch)] & CC_OP;
 }
 
-bool isIDENT_REMAIN(char ch)
+inline bool isBLANK(char ch)
 {
-    if (isIDENT_FIRST(ch) || (ch >= '0' && ch <= '9'))
+    return CHAR_CLASS[static_cast<unsigned char>(ch)] & CC_BLANK;
+}
+
+// Instruction set the lexer scans runs of one character class with.
+enum class ScanIsa
+{
+    Scalar,
+    Sse2,
+    Avx2,
+};
+
+const char* scanIsaName(ScanIsa isa)
+{
+    switch (isa)
     {
-        return true;
+    case ScanIsa::Scalar: return "scalar";
+    case ScanIsa::Sse2: return "sse2";
+    case ScanIsa::Avx2: return "avx2";
     }
-    return false;
+    return "?";
 }
 
-bool isOP(char ch)
+// The widest instruction set this CPU runs.
+ScanIsa bestScanIsa()
 {
-    string ops = "=#+-*/,.;()";
-    if (find(ops.begin(), ops.end(), ch) != ops.end())
+#ifdef PL0_SIMD
+    return __builtin_cpu_supports("avx2") ? ScanIsa::Avx2 : ScanIsa::Sse2;
+#else
+    return ScanIsa::Scalar;
+#endif
+}
+
+// Used by every Lexer; benchmarks lower it to compare the paths.
+ScanIsa scanIsa = bestScanIsa();
+
+// Length of the run of CLASS characters at k in p[0, n), given that p[0, k) is one.
+template<uint8_t CLASS>
+size_t scalarSpan(const char* p, size_t k, size_t n)
+{
+    while (k < n && (CHAR_CLASS[static_cast<unsigned char>(p[k])] & CLASS))
     {
-        return true;
+        k++;
     }
-    return false;
+    return k;
 }
 
-int stringToInt(string str)
+#ifdef PL0_SIMD
+// 0xFF in each byte of c that is in CLASS (CC_BLANK, CC_DIGIT or CC_IDENT_REMAIN),
+// 0 elsewhere. Bytes above 0x7F compare as negative and so match no class.
+template<uint8_t CLASS>
+inline __m128i classLanes(__m128i c)
 {
-    int ans = 0;
-    int n = str.size();
-    for (int i = 0; i < n; i++)
+    static_assert(CLASS == CC_BLANK || CLASS == CC_DIGIT || CLASS == CC_IDENT_REMAIN, "no vector test for this class");
+    if constexpr (CLASS == CC_BLANK)
     {
-        ans = ans * 10 + str[i] - '0';
+        __m128i control = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('\t' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('\r' + 1)));
+        return _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')), control);
     }
-    return ans;
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    if constexpr (CLASS == CC_DIGIT)
+    {
+        return digit;
+    }
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    return _mm_or_si128(_mm_or_si128(digit, alpha), _mm_cmpeq_epi8(c, _mm_set1_epi8('_')));
 }
 
-string intToString(int i)
+template<uint8_t CLASS>
+__attribute__((target("avx2"))) inline __m256i classLanes(__m256i c)
 {
-    string ans = "";
-    while (i)
+    static_assert(CLASS == CC_BLANK || CLASS == CC_DIGIT || CLASS == CC_IDENT_REMAIN, "no vector test for this class");
+    if constexpr (CLASS == CC_BLANK)
     {
-        ans += i % 10 + '0';
-        i /= 10;
+        __m256i control = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('\t' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), c));
+        return _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')), control);
     }
-    reverse(ans.begin(), ans.end());
-    return ans;
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    if constexpr (CLASS == CC_DIGIT)
+    {
+        return digit;
+    }
+    __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+    return _mm256_or_si256(_mm256_or_si256(digit, alpha), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_')));
 }
 
-string KEYWORD_SET[] =
+// Vector loads never reach past p + n, which may be the end of a mapping.
+template<uint8_t CLASS>
+size_t sse2Span(const char* p, size_t k, size_t n)
 {
-    "const",
-    "var",
-    "procedure",
-    "call",
-    "begin",
-    "end",
-    "if",
-    "then",
-    "while",
-    "do",
-    "odd",
-};
+    for (; k + 16 <= n; k += 16)
+    {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + k));
+        unsigned outside = ~_mm_movemask_epi8(classLanes<CLASS>(c)) & 0xFFFF;
+        if (outside != 0)
+        {
+            return k + __builtin_ctz(outside);
+        }
+    }
+    return scalarSpan<CLASS>(p, k, n);
+}
 
+template<uint8_t CLASS>
+__attribute__((target("avx2"))) size_t avx2Span(const char* p, size_t k, size_t n)
+{
+    for (; k + 32 <= n; k += 32)
+    {
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + k));
+        unsigned outside = ~unsigned(_mm256_movemask_epi8(classLanes<CLASS>(c)));
+        if (outside != 0)
+        {
+            return k + __builtin_ctz(outside);
+        }
+    }
+    return sse2Span<CLASS>(p, k, n);
+}
+#endif
 
-// class TokenKind
-// {
-// public:
-//     static const int Op = 0;
-//     int Num = 1;
-//     int Name = 2;
-//     int KeyWord = 3;
-//     int Eof = 4;
-// };
+// Length of the run of CLASS characters that starts p[0, n). Most runs in source
+// text are a few bytes long, so the first SHORT_RUN bytes are looked at one by one
+// and only a longer run is handed to the vector loop.
+template<uint8_t CLASS>
+inline size_t classSpan(const char* p, size_t n)
+{
+    const size_t SHORT_RUN = 8;
+    size_t k = 0;
+    for (; k < SHORT_RUN; k++)
+    {
+        if (k == n || !(CHAR_CLASS[static_cast<unsigned char>(p[k])] & CLASS))
+        {
+            return k;
+        }
+    }
+#ifdef PL0_SIMD
+    if (scanIsa == ScanIsa::Avx2)
+    {
+        return avx2Span<CLASS>(p, k, n);
+    }
+    if (scanIsa == ScanIsa::Sse2)
+    {
+        return sse2Span<CLASS>(p, k, n);
+    }
+#endif
+    return scalarSpan<CLASS>(p, k, n);
+}
 
-unordered_map<string, int> TokenKindStringToInt
+// SWAR: eight ASCII digits packed into a word, the first in the lowest byte, to
+// their value in three multiplies, combining digit pairs, then quads, then halves.
+inline uint32_t eightDigits(uint64_t chunk)
 {
-    {"Op", 0},
-    {"Num", 1},
-    {"Name", 2},
-    {"KeyWord", 3},
-    {"Eof", 4}
-};
+    chunk = (chunk & 0x0F0F0F0F0F0F0F0F) * 2561 >> 8;
+    chunk = (chunk & 0x00FF00FF00FF00FF) * 6553601 >> 16;
+    return uint32_t((chunk & 0x0000FFFF0000FFFF) * 42949672960001 >> 32);
+}
 
-unordered_map<int, string> TokenKindIntToString
+inline uint64_t swarLoad(const char* p)
 {
-    {0, "Op"},
-    {1, "Num"},
-    {2, "Name"},
-    {3, "KeyWord"},
-    {4, "Eof"}
-};
+    uint64_t chunk;
+    memcpy(&chunk, p, 8);
+    return chunk;
+}
 
-class Token
+// The 1 to 8 digits at p, reading eight bytes from p. Shifting out the bytes past
+// the digits leaves zero bytes in front of them, which read as leading zeros.
+inline uint32_t swarDigits(const char* p, size_t n)
 {
-public:
-    int ty;
-    int valInt;
-    string valString;
+    return eightDigits(swarLoad(p) << (8 * (8 - n)));
+}
 
-    Token(int ty, int valInt, string valString)
+// Parses a run of decimal digits. Returns false when the number does not fit in
+// a Value; literals short enough never to overflow skip the checks, and up to 16
+// digits are converted eight at a time when `slack` bytes behind str may be read.
+bool stringToValue(string_view str, Value* out, size_t slack = 0)
+{
+    const size_t SAFE_DIGITS = numeric_limits<Value>::digits10;
+    Value ans = 0;
+    size_t n = str.size();
+    if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && n <= SAFE_DIGITS && n <= 16 && n + slack >= 8)
     {
-        this->ty = ty;
-        this->valInt = valInt;
-        this->valString = valString;
+        uint64_t value = n <= 8 ? swarDigits(str.data(), n)
+                                : swarDigits(str.data(), n - 8) * uint64_t(100000000) + eightDigits(swarLoad(str.data() + n - 8));
+        *out = static_cast<Value>(value);
+        return true;
     }
-};
-
-ostream& operator<<(ostream& cout, const Token token)
-{
-    if (token.ty == 1)
+    if (n <= SAFE_DIGITS)
     {
-        cout << "[type: " << TokenKindIntToString[token.ty] << " val: " << token.valInt << "]";
+        for (size_t i = 0; i < n; i++)
+        {
+            ans = ans * 10 + (str[i] - '0');
+        }
+        *out = ans;
+        return true;
     }
-    else
+    for (size_t i = 0; i < n; i++)
+    {
+        if (__builtin_mul_overflow(ans, 10, &ans) || __builtin_add_overflow(ans, str[i] - '0', &ans))
+        {
+            return false;
+        }
+    }
+    *out = ans;
+    return true;
+}
+
+string intToString(int i)
+{
+    string ans = "";
+    while (i)
     {
-        cout << "[type: " << TokenKindIntToString[token.ty] << " val: " << token.valString << "]";
+        ans += i % 10 + '0';
+        i /= 10;
     }
-    return cout;
+    reverse(ans.begin(), ans.end());
+    return ans;
 }
 
-class Lexer
+// Bump allocator owning every AST node of one compilation.
+// Nodes are carved out of large chunks; non-trivially destructible nodes
+// register a finalizer so that reset() / ~Arena() can still run destructors.
+class Arena
 {
 public:
-    int i;
-    string s;
+    static const size_t CHUNK_SIZE = 64 * 1024;
 
-    Lexer(string src)
+    Arena(size_t chunkSize = CHUNK_SIZE)
     {
-        this->i = 0;
-        this->s = src;
+        this->chunkSize = chunkSize;
+        this->chunks = nullptr;
+        this->ptr = nullptr;
+        this->end = nullptr;
+        this->finalizers = nullptr;
+        this->bytesUsed = 0;
+        this->bytesReserved = 0;
+        this->nodeCount = 0;
+        this->chunkCount = 0;
     }
 
-    bool eof()
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena()
     {
-        return this->i >= this->s.size();
+        this->reset();
+        this->release();
     }
 
-    void _skip_blank()
+    void* allocate(size_t size, size_t align)
     {
-        while (!this->eof() && this->s[this->i] == ' ')
+        uintptr_t p = (reinterpret_cast<uintptr_t>(this->ptr) + align - 1) & ~(uintptr_t)(align - 1);
+
+        if (this->ptr == nullptr || p + size > reinterpret_cast<uintptr_t>(this->end))
         {
-            this->i++;
+            this->grow(size + align);
+            p = (reinterpret_cast<uintptr_t>(this->ptr) + align - 1) & ~(uintptr_t)(align - 1);
         }
+
+        this->bytesUsed += p + size - reinterpret_cast<uintptr_t>(this->ptr);
+        this->ptr = reinterpret_cast<char*>(p + size);
+        return reinterpret_cast<void*>(p);
     }
 
-    Token next()
+    template<typename T, typename... Args>
+    T* make(Args&&... args)
     {
-        string val = "";
-        this->_skip_blank();
+        T* obj = new (this->allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
 
-        if (this->eof())
+        if (!is_trivially_destructible<T>::value)
         {
-            return Token(TokenKindStringToInt["Eof"], 0, "");
+            Finalizer* fin = new (this->allocate(sizeof(Finalizer), alignof(Finalizer))) Finalizer;
+            fin->destroy = &Arena::destroy<T>;
+            fin->obj = obj;
+            fin->next = this->finalizers;
+            this->finalizers = fin;
         }
 
-        else if (isDIGIT(this->s[this->i]))
+        this->nodeCount++;
+        return obj;
+    }
+
+    // Runs pending destructors and rewinds to the first chunk; the memory is kept for reuse.
+    void reset()
+    {
+        for (Finalizer* fin = this->finalizers; fin != nullptr; fin = fin->next)
         {
-            while (isDIGIT(this->s[this->i]))
-            {
-                val += this->s[this->i];
-                this->i++;
-            }
-            int num = stringToInt(val);
-            return Token(TokenKindStringToInt["Num"], num, "");
+            fin->destroy(fin->obj);
         }
+        this->finalizers = nullptr;
 
-        else if (isIDENT_FIRST(this->s[this->i]))
+        while (this->chunks != nullptr && this->chunks->next != nullptr)
         {
-            while (isIDENT_REMAIN(this->s[this->i]))
-            {
-                val += this->s[this->i];
-                this->i++;
-            }
-
-            if (find(begin(KEYWORD_SET), end(KEYWORD_SET), val) != end(KEYWORD_SET))
-            {
-                return Token(TokenKindStringToInt["KeyWord"], 0, val);
-            }
-            else
-            {
-                return Token(TokenKindStringToInt["Name"], 0, val);
-            }
+            Chunk* next = this->chunks->next;
+            this->bytesReserved -= this->chunks->size;
+            this->chunkCount--;
+            free(this->chunks);
+            this->chunks = next;
         }
 
-        else if (isOP(this->s[this->i]))
+        if (this->chunks != nullptr)
         {
-            char ch = this->s[this->i];
-            this->i++;
-            return Token(TokenKindStringToInt["Op"], 0, string(1, ch));
+            this->ptr = this->chunks->data();
+            this->end = this->ptr + this->chunks->size;
         }
 
-        else if (this->s[this->i] == ':')
-        {
-            this->i++;
+        this->bytesUsed = 0;
+        this->nodeCount = 0;
+    }
 
-            if (this->eof() || this->s[this->i] != '=')
-            {
-                throw "'=' expected";
-            }
+    size_t bytes() const { return this->bytesUsed; }
+    size_t reserved() const { return this->bytesReserved; }
+    size_t nodes() const { return this->nodeCount; }
+    size_t chunksInUse() const { return this->chunkCount; }
 
-            this->i++;
-            return Token(TokenKindStringToInt["Op"], 0, ":=");
-        }
+private:
+    struct Chunk
+    {
+        Chunk* next;
+        size_t size;
+        char* data() { return reinterpret_cast<char*>(this + 1); }
+    };
 
-        else if (this->s[this->i] == '>' || this->s[this->i] == '<')
-        {
-            char ch = this->s[this->i];
-            this->i++;
+    struct Finalizer
+    {
+        void (*destroy)(void*);
+        void* obj;
+        Finalizer* next;
+    };
+
+    size_t chunkSize;
+    Chunk* chunks;
+    char* ptr;
+    char* end;
+    Finalizer* finalizers;
+    size_t bytesUsed;
+    size_t bytesReserved;
+    size_t nodeCount;
+    size_t chunkCount;
+
+    template<typename T>
+    static void destroy(void* obj)
+    {
+        static_cast<T*>(obj)->~T();
+    }
 
-            if (!this->eof() && this->s[this->i] == '=')
-            {
-                this->i++;
-                string str = "";
-                str.push_back(ch);
-                str.push_back('=');
-                return Token(TokenKindStringToInt["Op"], 0, str);
-            }
-        }
+    void grow(size_t minSize)
+    {
+        size_t size = max(this->chunkSize, minSize);
+        Chunk* chunk = static_cast<Chunk*>(malloc(sizeof(Chunk) + size));
 
-        /*else if (this->s[this->i] == '\n')
+        if (chunk == nullptr)
         {
-            this->i++;
-            return this->next();
-        }*/
+            throw bad_alloc();
+        }
 
-        else
+        chunk->next = this->chunks;
+        chunk->size = size;
+        this->chunks = chunk;
+        this->ptr = chunk->data();
+        this->end = this->ptr + size;
+        this->bytesReserved += size;
+        this->chunkCount++;
+    }
+
+    void release()
+    {
+        while (this->chunks != nullptr)
         {
-            throw "invalid character";
+            Chunk* next = this->chunks->next;
+            free(this->chunks);
+            this->chunks = next;
         }
+        this->ptr = nullptr;
+        this->end = nullptr;
+        this->bytesReserved = 0;
+        this->chunkCount = 0;
     }
 };
 
-class Factor;
-class Term;
-class Expression;
-class Assign;
-class Begin;
-class OddCondition;
-class StdCondition;
-class Condition;
-class If;
-class While;
-class Statement;
-class Procedure;
-class Block;
-class Program;
+constexpr string_view KEYWORD_SET[] =
+{
+    "const",
+    "var",
+    "procedure",
+    "call",
+    "begin",
+    "end",
+    "if",
+    "then",
+    "while",
+    "do",
+    "odd",
+};
 
-ostream& operator<<(ostream& cout, const Factor factor);
-ostream& operator<<(ostream& cout, const Term term);
-ostream& operator<<(ostream& cout, const Expression expression);
-ostream& operator<<(ostream& cout, const Assign assign);
-ostream& operator<<(ostream& cout, const Begin begin);
-ostream& operator<<(ostream& cout, const OddCondition odd_condition);
-ostream& operator<<(ostream& cout, const StdCondition std_condition);
-ostream& operator<<(ostream& cout, const Condition condition);
-ostream& operator<<(ostream& cout, const If _if);
-ostream& operator<<(ostream& cout, const While _while);
-ostream& operator<<(ostream& cout, const Statement statement);
-ostream& operator<<(ostream& cout, const Procedure procedure);
-ostream& operator<<(ostream& cout, const Block block);
-ostream& operator<<(ostream& cout, const Program program);
+constexpr int KEYWORD_COUNT = sizeof(KEYWORD_SET) / sizeof(KEYWORD_SET[0]);
+constexpr int KEYWORD_TABLE_SIZE = 32;
 
-class Factor
+// Keywords are recognized with a perfect hash over (first char, last char, length).
+// The multiplier is searched for at compile time so that no two keywords collide.
+constexpr unsigned keywordHash(string_view s, unsigned seed)
 {
-public:
-    string valString;
-    int valInt;
-    Expression* valExpr;
-    Factor() {};
-    Factor(const Factor& factor)
+    return (static_cast<unsigned char>(s[0]) * seed + static_cast<unsigned char>(s[s.size() - 1]) * 7 + s.size()) % KEYWORD_TABLE_SIZE;
+}
+
+constexpr bool keywordSeedIsPerfect(unsigned seed)
+{
+    bool used[KEYWORD_TABLE_SIZE] = {};
+    for (int k = 0; k < KEYWORD_COUNT; k++)
     {
-        this->valString = factor.valString;
-        this->valInt = factor.valInt;
-        this->valExpr = factor.valExpr;
+        unsigned h = keywordHash(KEYWORD_SET[k], seed);
+        if (used[h])
+        {
+            return false;
+        }
+        used[h] = true;
     }
-    Factor(string valString, int valInt, Expression* ValExpr)
-    {
-        this->valString = valString;
-        this->valInt = valInt;
-        this->valExpr = valExpr;
+    return true;
+}
 
-        // this -> valExpr = new Expression;
-        // this -> valExpr -> mod = valExpr->mod;
-        // this -> valExpr -> lhs = new Term;
+constexpr unsigned findKeywordSeed()
+{
+    for (unsigned seed = 1; seed < 4096; seed++)
+    {
+        if (keywordSeedIsPerfect(seed))
+        {
+            return seed;
+        }
     }
-};
+    return 0;
+}
 
-class Term
+constexpr unsigned KEYWORD_SEED = findKeywordSeed();
+static_assert(KEYWORD_SEED != 0, "no perfect hash seed for KEYWORD_SET");
+
+constexpr array<int8_t, KEYWORD_TABLE_SIZE> makeKeywordTable()
 {
-public:
-    Factor* lhs;
-    vector<pair<string, Factor*>> rhs;
-    Term() {};
-    Term(const Term& term)
+    array<int8_t, KEYWORD_TABLE_SIZE> table{};
+    for (int h = 0; h < KEYWORD_TABLE_SIZE; h++)
     {
-        this->lhs = term.lhs;
-        this->rhs = term.rhs;
+        table[h] = -1;
     }
-    Term(Factor* lhs, vector<pair<string, Factor*>> rhs)
+    for (int k = 0; k < KEYWORD_COUNT; k++)
+    {
+        table[keywordHash(KEYWORD_SET[k], KEYWORD_SEED)] = k;
+    }
+    return table;
+}
+
+constexpr array<int8_t, KEYWORD_TABLE_SIZE> KEYWORD_TABLE = makeKeywordTable();
+
+// Returns the index of `s` in KEYWORD_SET, or -1 if it is not a keyword.
+inline int keywordIndex(string_view s)
+{
+    if (s.size() < 2 || s.size() > 9)
+    {
+        return -1;
+    }
+
+    int k = KEYWORD_TABLE[keywordHash(s, KEYWORD_SEED)];
+    if (k >= 0 && KEYWORD_SET[k] == s)
+    {
+        return k;
+    }
+    return -1;
+}
+
+
+
+enum class TokenKind : uint8_t
+{
+    None,
+    Eof,
+    Num,
+    Name,
+
+    // operators
+    Eq,
+    Ne,
+    Plus,
+    Minus,
+    Times,
+    Slash,
+    Comma,
+    Period,
+    Semicolon,
+    LParen,
+    RParen,
+    Becomes,
+    Lt,
+    Lte,
+    Gt,
+    Gte,
+
+    // keywords, in KEYWORD_SET order
+    Const,
+    Var,
+    Procedure,
+    Call,
+    Begin,
+    End,
+    If,
+    Then,
+    While,
+    Do,
+    Odd,
+};
+
+constexpr string_view TOKEN_KIND_NAMES[] =
+{
+    "",
+    "Eof",
+    "Num",
+    "Name",
+    "=", "#", "+", "-", "*", "/", ",", ".", ";", "(", ")", ":=", "<", "<=", ">", ">=",
+    "const", "var", "procedure", "call", "begin", "end", "if", "then", "while", "do", "odd",
+};
+
+static_assert(sizeof(TOKEN_KIND_NAMES) / sizeof(TOKEN_KIND_NAMES[0]) == static_cast<int>(TokenKind::Odd) + 1,
+              "TOKEN_KIND_NAMES out of sync with TokenKind");
+static_assert(TOKEN_KIND_NAMES[static_cast<int>(TokenKind::Const)] == KEYWORD_SET[0] &&
+              TOKEN_KIND_NAMES[static_cast<int>(TokenKind::Odd)] == KEYWORD_SET[KEYWORD_COUNT - 1],
+              "keyword token kinds must follow KEYWORD_SET order");
+
+constexpr string_view tokenKindName(TokenKind kind)
+{
+    return TOKEN_KIND_NAMES[static_cast<int>(kind)];
+}
+
+inline TokenKind keywordKind(int index)
+{
+    return static_cast<TokenKind>(static_cast<int>(TokenKind::Const) + index);
+}
+
+constexpr array<TokenKind, 256> makeOpKindTable()
+{
+    array<TokenKind, 256> table{};
+    for (int kind = static_cast<int>(TokenKind::Eq); kind <= static_cast<int>(TokenKind::RParen); kind++)
+    {
+        table[static_cast<unsigned char>(TOKEN_KIND_NAMES[kind][0])] = static_cast<TokenKind>(kind);
+    }
+    return table;
+}
+
+// Token kind of each single-character operator accepted by isOP.
+constexpr array<TokenKind, 256> OP_KIND = makeOpKindTable();
+
+ostream& operator<<(ostream& cout, const TokenKind kind)
+{
+    cout << tokenKindName(kind);
+    return cout;
+}
+
+// Interns identifiers so that the rest of the compiler deals in small integer ids.
+// Each distinct spelling is copied once into the table's own arena.
+class SymbolTable
+{
+public:
+    SymbolTable() {};
+    SymbolTable(const SymbolTable&) = delete;
+    SymbolTable& operator=(const SymbolTable&) = delete;
+
+    int intern(string_view name)
+    {
+        auto it = this->ids.find(name);
+        if (it != this->ids.end())
+        {
+            return it->second;
+        }
+
+        char* copy = static_cast<char*>(this->storage.allocate(name.size(), 1));
+        copy_n(name.data(), name.size(), copy);
+        string_view owned(copy, name.size());
+
+        int id = this->names.size();
+        this->names.push_back(owned);
+        this->ids.emplace(owned, id);
+        return id;
+    }
+
+    string_view name(int id) const
+    {
+        return this->names[id];
+    }
+
+    int size() const
+    {
+        return this->names.size();
+    }
+
+private:
+    Arena storage;
+    vector<string_view> names;
+    unordered_map<string_view, int> ids;
+};
+
+// A token is a slice [offset, offset + length) of the source buffer.
+// valInt holds the value of a Num token and the symbol id of a Name token.
+// Tokens carry no line or column; Lexer::location derives them from the offset.
+class Token
+{
+public:
+    TokenKind ty;
+    Value valInt;
+    uint32_t offset;
+    uint32_t length;
+
+    Token()
+    {
+        this->ty = TokenKind::None;
+        this->valInt = 0;
+        this->offset = 0;
+        this->length = 0;
+    }
+
+    Token(TokenKind ty, Value valInt, uint32_t offset, uint32_t length)
+    {
+        this->ty = ty;
+        this->valInt = valInt;
+        this->offset = offset;
+        this->length = length;
+    }
+};
+
+ostream& operator<<(ostream& cout, const Token token)
+{
+    cout << "[type: " << token.ty << " val: " << token.valInt << " at: " << token.offset << "+" << token.length << "]";
+    return cout;
+}
+
+// The lexer never copies an in-memory source: it only keeps a view of the caller's
+// buffer, which must outlive the lexer. A streamed source is read through a
+// fixed-size window instead; `s` is then the window and `base` the source offset
+// of s[0], so token offsets stay absolute while memory stays bounded.
+class Lexer
+{
+public:
+    static const size_t WINDOW = 64 << 10;
+
+    size_t i;  // window index of the next character
+    string_view s;
+    SymbolTable* symbols;
+    long long scanned;  // bytes consumed over all next() calls; equals length() when nothing is re-lexed
+    const char* error = nullptr;  // why the last None token, which covers the bad input, is not a token
+
+    Lexer(string_view src, SymbolTable* symbols)
+    {
+        this->i = 0;
+        this->s = src;
+        this->symbols = symbols;
+        this->scanned = 0;
+        this->in = nullptr;
+        this->base = 0;
+        this->start = 0;
+    }
+
+    Lexer(istream* in, SymbolTable* symbols, size_t window = WINDOW)
+    {
+        this->i = 0;
+        this->symbols = symbols;
+        this->scanned = 0;
+        this->in = in;
+        this->window.resize(window);
+        this->base = 0;
+        this->start = 0;
+    }
+
+    Lexer(const Lexer&) = delete;
+    Lexer& operator=(const Lexer&) = delete;
+
+    bool eof()
+    {
+        return this->i >= this->s.size() && !this->refill();
+    }
+
+    // The text of a token; for a streamed source only the current token is still
+    // in the window.
+    string_view text(const Token& tk)
+    {
+        return this->s.substr(tk.offset - this->base, tk.length);
+    }
+
+    // Blanks are dropped from the window as they are skipped, like a token.
+    void _skip_blank()
+    {
+        do
+        {
+            this->i += classSpan<CC_BLANK>(this->s.data() + this->i, this->s.size() - this->i);
+            this->start = this->i;
+        } while (this->i == this->s.size() && this->refill());
+    }
+
+    Token next()
+    {
+        size_t p = this->base + this->i;
+        Token tk = this->scan();
+        this->scanned += this->base + this->i - p;
+        return tk;
+    }
+
+    // Source bytes seen so far: the whole source once lexing reaches Eof.
+    size_t length() const
+    {
+        return this->base + this->s.size();
+    }
+
+    // Average number of times each source byte has been scanned so far.
+    double scanRatio()
+    {
+        return this->length() == 0 ? 1.0 : double(this->scanned) / this->length();
+    }
+
+    // Line and column, both counted from 1, of a source offset. The line-start
+    // index is extended only here and when the window slides, never per token, and
+    // is binary searched, so queries may come in any order; a streamed source
+    // can only answer for offsets it has already read.
+    pair<uint32_t, uint32_t> location(uint32_t offset)
+    {
+        this->indexLines(min(size_t(offset), this->length()));
+        size_t line = upper_bound(this->lineStarts.begin(), this->lineStarts.end(), offset) - this->lineStarts.begin();
+        return { uint32_t(line), offset - this->lineStarts[line - 1] + 1 };
+    }
+
+private:
+    istream* in;  // null for an in-memory source
+    vector<char> window;
+    size_t base;
+    size_t start;  // window index of the token being scanned, kept across refills
+    vector<uint32_t> lineStarts = { 0 };
+    size_t indexed = 0;  // lineStarts holds every line starting at or before this offset
+
+    void indexLines(size_t upTo)
+    {
+        for (size_t k = max(this->indexed, this->base); k < upTo; k++)
+        {
+            const char* nl = static_cast<const char*>(memchr(this->s.data() + (k - this->base), '\n', upTo - k));
+            if (nl == nullptr)
+            {
+                break;
+            }
+            k = this->base + (nl - this->s.data());
+            this->lineStarts.push_back(k + 1);
+        }
+        this->indexed = max(this->indexed, upTo);
+    }
+
+    // Slides the current token to the front of the window and reads more input
+    // behind it, doubling the window for a token longer than the window itself.
+    // Returns false at the end of the input.
+    bool refill()
+    {
+        if (this->in == nullptr || !*this->in)
+        {
+            return false;
+        }
+
+        this->indexLines(this->base + this->start);
+        size_t keep = this->s.size() - this->start;
+        if (keep == this->window.size())
+        {
+            this->window.resize(2 * this->window.size());
+        }
+        memmove(this->window.data(), this->window.data() + this->start, keep);
+        this->base += this->start;
+        this->i -= this->start;
+        this->start = 0;
+
+        this->in->read(this->window.data() + keep, this->window.size() - keep);
+        size_t got = this->in->gcount();
+        this->s = string_view(this->window.data(), keep + got);
+        if (this->length() > numeric_limits<uint32_t>::max())
+        {
+            throw string("source larger than 4 GiB");
+        }
+        return got > 0;
+    }
+
+    uint32_t offset() const
+    {
+        return this->base + this->start;
+    }
+
+    // Moves i past the run of CLASS characters at i, reading more input while the
+    // run reaches the end of the window.
+    template<uint8_t CLASS>
+    void skipRun()
+    {
+        do
+        {
+            this->i += classSpan<CLASS>(this->s.data() + this->i, this->s.size() - this->i);
+        } while (this->i == this->s.size() && this->refill());
+    }
+
+    Token scan()
+    {
+        this->start = this->i;
+        this->_skip_blank();
+
+        if (this->eof())
+        {
+            return Token(TokenKind::Eof, 0, this->offset(), 0);
+        }
+
+        else if (isDIGIT(this->s[this->i]))
+        {
+            this->skipRun<CC_DIGIT>();
+            Value num;
+            if (!stringToValue(this->s.substr(this->start, this->i - this->start), &num, this->s.size() - this->i))
+            {
+                return this->invalid("number too large");
+            }
+            return Token(TokenKind::Num, num, this->offset(), this->i - this->start);
+        }
+
+        else if (isIDENT_FIRST(this->s[this->i]))
+        {
+            this->skipRun<CC_IDENT_REMAIN>();
+
+            string_view val = this->s.substr(this->start, this->i - this->start);
+            int keyword = keywordIndex(val);
+            if (keyword >= 0)
+            {
+                return Token(keywordKind(keyword), 0, this->offset(), this->i - this->start);
+            }
+            else
+            {
+                return Token(TokenKind::Name, this->symbols->intern(val), this->offset(), this->i - this->start);
+            }
+        }
+
+        else if (isOP(this->s[this->i]))
+        {
+            char ch = this->s[this->i];
+            this->i++;
+            if (ch == '(' && !this->eof() && this->s[this->i] == '*')
+            {
+                this->i--;
+                return this->comment(false);
+            }
+            return Token(OP_KIND[static_cast<unsigned char>(ch)], 0, this->offset(), 1);
+        }
+
+        else if (this->s[this->i] == ':')
+        {
+            this->i++;
+
+            if (this->eof() || this->s[this->i] != '=')
+            {
+                return this->invalid("'=' expected");
+            }
+
+            this->i++;
+            return Token(TokenKind::Becomes, 0, this->offset(), 2);
+        }
+
+        else if (this->s[this->i] == '>' || this->s[this->i] == '<')
+        {
+            bool less = this->s[this->i] == '<';
+            this->i++;
+
+            if (!this->eof() && this->s[this->i] == '=')
+            {
+                this->i++;
+                return Token(less ? TokenKind::Lte : TokenKind::Gte, 0, this->offset(), 2);
+            }
+            return Token(less ? TokenKind::Lt : TokenKind::Gt, 0, this->offset(), 1);
+        }
+
+        else if (this->s[this->i] == '{')
+        {
+            return this->comment(true);
+        }
+
+        else
+        {
+            this->i++;
+            return this->invalid("invalid character");
+        }
+    }
+
+    // Skips the comment at i, `{ ... }` or `(* ... *)`, with any blanks and comments
+    // behind it, and scans the token that follows. Comments are rare enough to be
+    // dispatched from scan() rather than checked for after every blank.
+    Token comment(bool brace)
+    {
+        for (;;)
+        {
+            this->start = this->i;
+            uint32_t from = this->offset();
+            this->i += brace ? 1 : 2;
+            this->start = this->i;
+            for (;;)
+            {
+                if (this->eof())
+                {
+                    this->error = "unterminated comment";
+                    return Token(TokenKind::None, 0, from, this->base + this->i - from);
+                }
+                char ch = this->s[this->i];
+                this->i++;
+                this->start = this->i;
+                if (brace ? ch == '}' : ch == '*' && !this->eof() && this->s[this->i] == ')')
+                {
+                    break;
+                }
+            }
+            if (!brace)
+            {
+                this->i++;
+            }
+
+            this->start = this->i;
+            this->_skip_blank();
+            if (this->eof())
+            {
+                break;
+            }
+            if (this->s[this->i] == '{')
+            {
+                brace = true;
+                continue;
+            }
+            if (this->s[this->i] != '(')
+            {
+                break;
+            }
+            this->i++;
+            bool star = !this->eof() && this->s[this->i] == '*';
+            this->i--;
+            if (!star)
+            {
+                break;
+            }
+            brace = false;
+        }
+        return this->scan();
+    }
+
+    Token invalid(const char* message)
+    {
+        this->error = message;
+        return Token(TokenKind::None, 0, this->offset(), this->i - this->start);
+    }
+};
+
+// A source to compile: a file path, or "-" for stdin. Regular files are mapped
+// read-only so the lexer scans the page cache in place; pipes, devices and stdin
+// are streamed through the lexer's refill window. Either way the source is never
+// copied whole into memory.
+class SourceFile
+{
+public:
+    SourceFile(const string& path)
+    {
+        this->path = path;
+        this->data = nullptr;
+        this->size = 0;
+        this->isMapped = false;
+        this->in = nullptr;
+
+        if (path == "-")
+        {
+            this->in = &cin;
+            return;
+        }
+
+#ifdef PL0_MMAP
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw "cannot open " + path;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            if (uint64_t(st.st_size) > numeric_limits<uint32_t>::max())
+            {
+                close(fd);
+                throw path + ": source larger than 4 GiB";
+            }
+            this->size = st.st_size;
+            if (this->size > 0)
+            {
+                void* p = mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p == MAP_FAILED)
+                {
+                    close(fd);
+                    throw "cannot map " + path;
+                }
+                madvise(p, this->size, MADV_SEQUENTIAL);
+                this->data = static_cast<const char*>(p);
+            }
+            this->isMapped = true;
+        }
+        close(fd);
+        if (this->isMapped)
+        {
+            return;
+        }
+#endif
+
+        this->file.open(path, ios::binary);
+        if (!this->file)
+        {
+            throw "cannot open " + path;
+        }
+        this->in = &this->file;
+    }
+
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    ~SourceFile()
+    {
+#ifdef PL0_MMAP
+        if (this->data != nullptr)
+        {
+            munmap(const_cast<char*>(this->data), this->size);
+        }
+#endif
+    }
+
+    bool mapped() const { return this->isMapped; }
+    string_view view() const { return string_view(this->data, this->size); }
+    istream* stream() const { return this->in; }
+    const string& name() const { return this->path; }
+
+private:
+    string path;
+    const char* data;
+    size_t size;
+    bool isMapped;
+    istream* in;
+    ifstream file;
+};
+
+class Factor;
+class Term;
+class Expression;
+class Assign;
+class Begin;
+class OddCondition;
+class StdCondition;
+class Condition;
+class If;
+class While;
+class Statement;
+class Procedure;
+class Block;
+class Program;
+
+ostream& operator<<(ostream& cout, const Factor& factor);
+ostream& operator<<(ostream& cout, const Term& term);
+ostream& operator<<(ostream& cout, const Expression& expression);
+ostream& operator<<(ostream& cout, const Condition& condition);
+ostream& operator<<(ostream& cout, const Statement& statement);
+ostream& operator<<(ostream& cout, const Procedure& procedure);
+ostream& operator<<(ostream& cout, const Block& block);
+ostream& operator<<(ostream& cout, const Program& program);
+
+// A variable reference as assigned by Resolver: `slot` within the frame of the
+// enclosing block at lexical `depth` (0 is the main program), and `global`, a
+// number unique to the variable in the program, which the register backends and
+// the C emitter use to name it.
+struct VarRef
+{
+    int name;
+    uint32_t depth;
+    uint32_t slot;
+    uint32_t global;
+};
+
+enum class FactorKind
+{
+    Num,
+    Name,
+    Expr,
+    Var,
+};
+
+// A factor is exactly one of a literal, a name (symbol id), a parenthesized
+// expression, or, once resolved, a variable reference; the variant index doubles
+// as the FactorKind tag.
+class Factor
+{
+public:
+    variant<Value, int, Expression*, VarRef> value;
+
+    Factor() {};
+    Factor(const Factor& factor)
+    {
+        this->value = factor.value;
+    }
+    Factor(FactorKind kind, Value val)
+    {
+        if (kind == FactorKind::Num)
+        {
+            this->value.emplace<0>(val);
+        }
+        else
+        {
+            this->value.emplace<1>(static_cast<int>(val));
+        }
+    }
+    Factor(Expression* expr)
+    {
+        this->value.emplace<2>(expr);
+    }
+
+    FactorKind kind() const { return static_cast<FactorKind>(this->value.index()); }
+    Value num() const { return get<0>(this->value); }
+    int name() const { return get<1>(this->value); }
+    Expression* expr() const { return get<2>(this->value); }
+    const VarRef& var() const { return get<3>(this->value); }
+};
+
+class Term
+{
+public:
+    Factor* lhs;
+    vector<pair<TokenKind, Factor*>> rhs;
+    Term() {};
+    Term(const Term& term)
+    {
+        this->lhs = term.lhs;
+        this->rhs = term.rhs;
+    }
+    Term(Factor* lhs, vector<pair<TokenKind, Factor*>> rhs)
     {
         this->lhs = lhs;
         this->rhs = rhs;
     }
 };
 
-class Expression
+class Expression
+{
+public:
+    TokenKind mod;
+    Term* lhs;
+    vector<pair<TokenKind, Term*>> rhs;
+    Expression() {};
+    Expression(const Expression& expr)
+    {
+        this->mod = expr.mod;
+        this->lhs = expr.lhs;
+        this->rhs = expr.rhs;
+    }
+    Expression(TokenKind mod, Term* lhs, vector<pair<TokenKind, Term*>> rhs)
+    {
+        this->mod = mod;
+        this->lhs = lhs;
+        this->rhs = rhs;
+    }
+};
+
+class Const
+{
+public:
+    int name;
+    Value value;
+
+    Const();
+    Const(const Const& _const)
+    {
+        this->name = _const.name;
+        this->value = _const.value;
+    }
+    Const(int name, Value value)
+    {
+        this->name = name;
+        this->value = value;
+    }
+};
+
+class Assign
+{
+public:
+    int name;
+    Expression* expr;
+    VarRef target;  // set by Resolver
+
+    Assign() {};
+    Assign(const Assign& assign)
+    {
+        this->name = assign.name;
+        this->expr = assign.expr;
+        this->target = assign.target;
+    }
+    Assign(int name, Expression* expr)
+    {
+        this->name = name;
+        this->expr = expr;
+        this->target = VarRef{name, 0, 0, 0};
+    }
+};
+
+class Call
+{
+public:
+    int name;
+    int proc;  // index in Program::procs, set by Resolver
+    Call() {};
+    Call(const Call& call)
+    {
+        this->name = call.name;
+        this->proc = call.proc;
+    }
+    Call(int name)
+    {
+        this->name = name;
+        this->proc = -1;
+    }
+};
+
+class Begin
+{
+public:
+    vector<Statement*> body;
+
+    Begin() {};
+    Begin(const Begin& begin)
+    {
+        this->body = begin.body;
+    }
+    Begin(vector<Statement*> body)
+    {
+        this->body = body;
+    }
+};
+
+class OddCondition
+{
+public:
+    Expression* expr;
+    OddCondition() {};
+    OddCondition(const OddCondition& odd_cond)
+    {
+        this->expr = odd_cond.expr;
+    }
+    OddCondition(Expression* expr)
+    {
+        this->expr = expr;
+    }
+};
+
+class StdCondition
+{
+public:
+    TokenKind op;
+    Expression* lhs;
+    Expression* rhs;
+    StdCondition() {};
+    StdCondition(const StdCondition& std_cond)
+    {
+        this->op = std_cond.op;
+        this->lhs = std_cond.lhs;
+        this->rhs = std_cond.rhs;
+    }
+    StdCondition(TokenKind op, Expression* lhs, Expression* rhs)
+    {
+        this->op = op;
+        this->lhs = lhs;
+        this->rhs = rhs;
+    }
+};
+
+enum class ConditionKind
+{
+    Odd,
+    Std,
+};
+
+class Condition
+{
+public:
+    variant<OddCondition, StdCondition> cond;
+
+    Condition() {};
+    Condition(const Condition& cond)
+    {
+        this->cond = cond.cond;
+    }
+    Condition(OddCondition odd_cond)
+    {
+        this->cond = odd_cond;
+    }
+    Condition(StdCondition std_cond)
+    {
+        this->cond = std_cond;
+    }
+
+    ConditionKind kind() const { return static_cast<ConditionKind>(this->cond.index()); }
+    const OddCondition& odd() const { return get<OddCondition>(this->cond); }
+    const StdCondition& std() const { return get<StdCondition>(this->cond); }
+};
+
+class If
+{
+public:
+    Condition* cond;
+    Statement* then;
+    If() {};
+    If(const If& _if)
+    {
+        this->cond = _if.cond;
+        this->then = _if.then;
+    }
+    If(Condition* cond, Statement* then)
+    {
+        this->cond = cond;
+        this->then = then;
+    }
+};
+
+class While
+{
+public:
+    Condition* cond;
+    Statement* then;
+    While() {};
+    While(const While& _while)
+    {
+        this->cond = _while.cond;
+        this->then = _while.then;
+    }
+    While(Condition* cond, Statement* then)
+    {
+        this->cond = cond;
+        this->then = then;
+    }
+};
+
+enum class StatementKind
+{
+    Assign,
+    Call,
+    Begin,
+    If,
+    While,
+};
+
+// One allocation per statement: the payload lives inline, tagged by StatementKind.
+class Statement
+{
+public:
+    variant<Assign, Call, Begin, If, While> stmt;
+
+    Statement() {};
+    Statement(const Statement& state)
+    {
+        this->stmt = state.stmt;
+    }
+    Statement(Assign assign)
+    {
+        this->stmt = assign;
+    }
+    Statement(Call call)
+    {
+        this->stmt = call;
+    }
+    Statement(Begin begin)
+    {
+        this->stmt = begin;
+    }
+    Statement(If _if)
+    {
+        this->stmt = _if;
+    }
+    Statement(While _while)
+    {
+        this->stmt = _while;
+    }
+
+    StatementKind kind() const { return static_cast<StatementKind>(this->stmt.index()); }
+    const Assign& assign() const { return get<Assign>(this->stmt); }
+    const Call& call() const { return get<Call>(this->stmt); }
+    const Begin& begin() const { return get<Begin>(this->stmt); }
+    const If& _if() const { return get<If>(this->stmt); }
+    const While& _while() const { return get<While>(this->stmt); }
+};
+
+class Procedure
+{
+public:
+    int name;
+    Block* body;
+    int index;  // position in Program::procs, set by Resolver
+    uint32_t begin;  // source span from the `procedure` keyword through the closing ';'
+    uint32_t end;
+
+    Procedure() {};
+    Procedure(const Procedure& pro)
+    {
+        this->name = pro.name;
+        this->body = pro.body;
+        this->index = pro.index;
+        this->begin = pro.begin;
+        this->end = pro.end;
+    }
+    Procedure(int name, Block* body)
+    {
+        this->name = name;
+        this->body = body;
+        this->index = -1;
+        this->begin = 0;
+        this->end = 0;
+    }
+};
+
+class Block
+{
+public:
+    vector<Const*> consts;
+    vector<int> vars;
+    vector<Procedure*> procs;
+    Statement* stmt;
+    int level;      // lexical depth, set by Resolver; the frame of vars lives in display[level]
+    int firstSlot;  // static slot of vars[0], set by Resolver
+
+    Block(vector<Const*> consts, vector<int> vars, vector<Procedure*> procs, Statement* stmt)
+    {
+        this->consts = consts;
+        this->vars = vars;
+        this->procs = procs;
+        this->stmt = stmt;
+        this->level = 0;
+        this->firstSlot = 0;
+    }
+
+    Block() {};
+    Block(const Block& block)
+    {
+        this->consts = block.consts;
+        this->vars = block.vars;
+        this->procs = block.procs;
+        this->stmt = block.stmt;
+        this->level = block.level;
+        this->firstSlot = block.firstSlot;
+    }
+};
+
+class Program
+{
+public:
+    Block* block;
+    const SymbolTable* symbols;
+    bool resolved;
+    vector<Procedure*> procs;  // every procedure, by Procedure::index
+    int slotCount;             // static slots over all blocks
+    int maxLevel;              // deepest Block::level
+
+    Program(Block* block, const SymbolTable* symbols)
+    {
+        this->block = block;
+        this->symbols = symbols;
+        this->resolved = false;
+        this->slotCount = 0;
+        this->maxLevel = 0;
+    }
+};
+
+// A syntax error: where it is and what was expected there.
+struct Diagnostic
+{
+    uint32_t offset;
+    uint32_t line;
+    uint32_t column;
+    string message;
+};
+
+ostream& operator<<(ostream& cout, const Diagnostic& d)
+{
+    cout << d.line << ":" << d.column << ": " << d.message;
+    return cout;
+}
+
+// Recursive descent with panic-mode recovery: a syntax error is recorded as a
+// Diagnostic and unwinds to the nearest synchronization point (a statement in a
+// begin, a declaration list, a procedure or the program), which skips tokens up
+// to the next `;`, `end` or `.` and carries on, so one parse reports every
+// error. Lexical errors are recorded the same way and lexing resumes behind
+// them. Only one error is kept per source offset, which silences most cascades.
+class Parser
+{
+public:
+    Lexer* lx;
+    Arena* arena;
+    Token cur;  // one token of lookahead; the lexer is never rewound
+    vector<Diagnostic> diagnostics;
+
+    // Parse statements and expressions on heap work stacks instead of by recursion,
+    // so that nesting is bounded by maxNesting instead of the native stack size.
+    // The tree and the diagnostics are the same either way. Procedures still nest
+    // recursively.
+    bool explicitStack = false;
+    size_t maxNesting = 1 << 24;
+
+    Parser(Lexer* lx, Arena* arena)
+    {
+        this->lx = lx;
+        this->arena = arena;
+        this->cur = this->lex();
+    }
+
+    // Consumes the current token and returns it.
+    Token advance()
+    {
+        Token tk = this->cur;
+        this->cur = this->lex();
+        return tk;
+    }
+
+    bool check(TokenKind kind)
+    {
+        if (this->cur.ty == kind)
+        {
+            this->advance();
+            return true;
+        }
+        return false;
+    }
+
+    Token expect(TokenKind kind)
+    {
+        if (this->cur.ty != kind)
+        {
+            this->fail("'" + string(tokenKindName(kind)) + "' expected, got '" + string(tokenKindName(this->cur.ty)) + "'");
+        }
+        return this->advance();
+    }
+
+    // Parses a whole program and throws every diagnostic, one per line, if there
+    // was a syntax error.
+    Program* program();
+
+    // Parses a whole program and always returns it; syntax errors are left in
+    // `diagnostics`, with an empty statement in place of each unparsable one.
+    Program* parse();
+
+    // Parses one `procedure name; block;` declaration at the current token, as
+    // IncrementalParser does; returns nullptr after a syntax error.
+    Procedure* declaration();
+
+    Block* block();
+    vector<Const*> _const();
+    vector<int> var();
+    Procedure* procedure();
+    Statement* statement();
+    Condition* condition();
+    OddCondition odd_condition();
+    StdCondition std_condition();
+    Expression* expression();
+    Term* term();
+    Factor* factor();
+
+private:
+    struct Panic
+    {
+    };
+
+    // A compound statement waiting for its next sub-statement: an If or While for
+    // its body, or a Begin for the next statement of `body`.
+    struct StatementFrame
+    {
+        StatementKind kind;
+        Condition* cond;
+        vector<Statement*> body;
+    };
+
+    // A parenthesized expression being parsed. Its finished terms, and the factors
+    // of its current term, are on top of `terms` and `factors` from the bases on;
+    // termOp and factorOp are the operators in front of the next ones.
+    struct ExpressionFrame
+    {
+        TokenKind mod;
+        TokenKind termOp;
+        TokenKind factorOp;
+        size_t termBase;
+        size_t factorBase;
+    };
+
+    vector<StatementFrame> statementFrames;
+    vector<ExpressionFrame> expressionFrames;
+    vector<pair<TokenKind, Term*>> terms;
+    vector<pair<TokenKind, Factor*>> factors;
+
+    Statement* statementOnStack();
+    Expression* expressionOnStack();
+    void openExpression();
+    TokenKind comparison();
+
+    // The next token; a lexical error is reported and lexing resumes behind it.
+    Token lex()
+    {
+        Token tk = this->lx->next();
+        while (tk.ty == TokenKind::None)
+        {
+            this->report(tk.offset, this->lx->error);
+            tk = this->lx->next();
+        }
+        return tk;
+    }
+
+    void report(uint32_t offset, const string& message)
+    {
+        if (!this->diagnostics.empty() && this->diagnostics.back().offset == offset)
+        {
+            return;
+        }
+        pair<uint32_t, uint32_t> at = this->lx->location(offset);
+        this->diagnostics.push_back(Diagnostic{offset, at.first, at.second, message});
+    }
+
+    // Reports an error at the current token and unwinds to a synchronization point.
+    [[noreturn]] void fail(const string& message)
+    {
+        this->report(this->cur.offset, message);
+        throw Panic();
+    }
+
+    // Skips to the next `;`, `end` or `.` (or the end of input) without consuming it.
+    void synchronize()
+    {
+        while (this->cur.ty != TokenKind::Semicolon && this->cur.ty != TokenKind::End
+               && this->cur.ty != TokenKind::Period && this->cur.ty != TokenKind::Eof)
+        {
+            this->advance();
+        }
+    }
+
+    // A statement, or an empty Begin in place of one that did not parse.
+    Statement* guardedStatement()
+    {
+        if (this->explicitStack)
+        {
+            return this->statementOnStack();
+        }
+        try
+        {
+            return this->statement();
+        }
+        catch (const Panic&)
+        {
+            this->synchronize();
+            return this->arena->make<Statement>(Begin(vector<Statement*>()));
+        }
+    }
+
+    static bool startsStatement(TokenKind kind)
+    {
+        return kind == TokenKind::Name || kind == TokenKind::Call || kind == TokenKind::Begin
+               || kind == TokenKind::If || kind == TokenKind::While;
+    }
+};
+
+Program* Parser::program()
+{
+    Program* program = this->parse();
+    if (!this->diagnostics.empty())
+    {
+        ostringstream out;
+        for (size_t k = 0; k < this->diagnostics.size(); k++)
+        {
+            out << (k ? "\n" : "") << this->diagnostics[k];
+        }
+        throw out.str();
+    }
+    return program;
+}
+
+Program* Parser::parse()
+{
+    Block* block = this->block();
+    if (!this->check(TokenKind::Period))
+    {
+        this->report(this->cur.offset, "'.' expected, got '" + string(tokenKindName(this->cur.ty)) + "'");
+    }
+    return this->arena->make<Program>(block, this->lx->symbols);
+}
+
+Procedure* Parser::declaration()
+{
+    try
+    {
+        uint32_t begin = this->expect(TokenKind::Procedure).offset;
+        Procedure* proc = this->procedure();
+        proc->begin = begin;
+        return this->diagnostics.empty() ? proc : nullptr;
+    }
+    catch (const Panic&)
+    {
+        return nullptr;
+    }
+}
+
+Block* Parser::block()
+{
+    vector<int> vars;
+    vector<Procedure*> procs;
+    vector<Const*> consts;
+
+    if (this->check(TokenKind::Const))
+    {
+        consts = this->_const();
+    }
+
+    if (this->check(TokenKind::Var))
+    {
+        vars = this->var();
+    }
+
+    while (this->cur.ty == TokenKind::Procedure)
+    {
+        uint32_t begin = this->advance().offset;
+        try
+        {
+            Procedure* proc = this->procedure();
+            proc->begin = begin;
+            procs.push_back(proc);
+        }
+        catch (const Panic&)
+        {
+            // a broken header: the body is still parsed for its own errors
+            this->synchronize();
+            if (this->check(TokenKind::Semicolon))
+            {
+                this->block();
+                this->check(TokenKind::Semicolon);
+            }
+        }
+    }
+
+    Statement* stmt = this->guardedStatement();
+    return this->arena->make<Block>(consts, vars, procs, stmt);
+}
+
+// The declarations parsed before a syntax error are kept.
+vector<Const*> Parser::_const()
+{
+    vector<Const*> ans;
+    try
+    {
+        while (1)
+        {
+            if (this->cur.ty != TokenKind::Name)
+            {
+                this->fail("name expected");
+            }
+            Token name = this->advance();
+
+            this->expect(TokenKind::Eq);
+            if (this->cur.ty != TokenKind::Num)
+            {
+                this->fail("number expected");
+            }
+            Token num = this->advance();
+            ans.push_back(this->arena->make<Const>(name.valInt, num.valInt));
+
+            if (this->check(TokenKind::Semicolon))
+            {
+                return ans;
+            }
+            else
+            {
+                this->expect(TokenKind::Comma);
+            }
+        }
+    }
+    catch (const Panic&)
+    {
+        this->synchronize();
+        this->check(TokenKind::Semicolon);
+        return ans;
+    }
+}
+
+vector<int> Parser::var()
+{
+    vector<int> ans;
+    try
+    {
+        while (1)
+        {
+            if (this->cur.ty != TokenKind::Name)
+            {
+                this->fail("name expected");
+            }
+            ans.push_back(this->advance().valInt);
+
+            if (this->check(TokenKind::Semicolon))
+            {
+                return ans;
+            }
+            else
+            {
+                this->expect(TokenKind::Comma);
+            }
+        }
+    }
+    catch (const Panic&)
+    {
+        this->synchronize();
+        this->check(TokenKind::Semicolon);
+        return ans;
+    }
+}
+
+Procedure* Parser::procedure()
+{
+    if (this->cur.ty != TokenKind::Name)
+    {
+        this->fail("name expected");
+    }
+    Token name = this->advance();
+    this->expect(TokenKind::Semicolon);
+
+    Block* block = this->block();
+    Procedure* proc = this->arena->make<Procedure>(name.valInt, block);
+    proc->end = this->cur.offset + this->cur.length;
+    if (this->cur.ty != TokenKind::Semicolon)
+    {
+        // keep the procedure; the next declaration or statement resynchronizes
+        this->report(this->cur.offset, "';' expected, got '" + string(tokenKindName(this->cur.ty)) + "'");
+        return proc;
+    }
+    this->advance();
+    return proc;
+}
+
+Statement* Parser::statement()
+{
+    if (this->check(TokenKind::Call))
+    {
+        if (this->cur.ty != TokenKind::Name)
+        {
+            this->fail("name expected");
+        }
+        return this->arena->make<Statement>(Call(this->advance().valInt));
+    }
+
+    else if (this->check(TokenKind::Begin))
+    {
+        vector<Statement*> body;
+
+        while (1)
+        {
+            body.push_back(this->guardedStatement());
+
+            if (this->check(TokenKind::End))
+            {
+                break;
+            }
+            else if (this->check(TokenKind::Semicolon))
+            {
+                continue;
+            }
+
+            this->report(this->cur.offset, "';' or 'end' expected, got '" + string(tokenKindName(this->cur.ty)) + "'");
+            if (startsStatement(this->cur.ty))
+            {
+                // a missing ';': go on with the statement
+                continue;
+            }
+            this->synchronize();
+            if (this->check(TokenKind::Semicolon))
+            {
+                continue;
+            }
+            this->check(TokenKind::End);
+            break;
+        }
+
+        return this->arena->make<Statement>(Begin(body));
+    }
+
+    else if (this->check(TokenKind::If))
+    {
+        Condition* cond = this->condition();
+        this->expect(TokenKind::Then);
+        Statement* then = this->statement();
+        return this->arena->make<Statement>(If(cond, then));
+    }
+
+    else if (this->check(TokenKind::While))
+    {
+        Condition* cond = this->condition();
+        this->expect(TokenKind::Do);
+        Statement* then = this->statement();
+        return this->arena->make<Statement>(While(cond, then));
+    }
+
+    else
+    {
+        if (this->cur.ty != TokenKind::Name)
+        {
+            this->fail("name expected");
+        }
+        Token tk = this->advance();
+
+        this->expect(TokenKind::Becomes);
+        Expression* expr = this->expression();
+        return this->arena->make<Statement>(Assign(tk.valInt, expr));
+    }
+}
+
+Condition* Parser::condition()
+{
+    if (this->check(TokenKind::Odd))
+    {
+        return this->arena->make<Condition>(this->odd_condition());
+    }
+    else
+    {
+        return this->arena->make<Condition>(this->std_condition());
+    }
+}
+
+OddCondition Parser::odd_condition()
+{
+    return OddCondition(this->expression());
+}
+
+StdCondition Parser::std_condition()
+{
+    Expression* lhs = this->expression();
+    TokenKind op = this->comparison();
+    Expression* rhs = this->expression();
+    return StdCondition(op, lhs, rhs);
+}
+
+TokenKind Parser::comparison()
+{
+    switch (this->cur.ty)
+    {
+    case TokenKind::Eq:
+    case TokenKind::Ne:
+    case TokenKind::Lt:
+    case TokenKind::Lte:
+    case TokenKind::Gt:
+    case TokenKind::Gte:
+        break;
+    default:
+        this->fail("condition operator expected");
+    }
+    return this->advance().ty;
+}
+
+Expression* Parser::expression()
+{
+    if (this->explicitStack)
+    {
+        return this->expressionOnStack();
+    }
+
+    TokenKind mod = TokenKind::None;
+    if (this->check(TokenKind::Plus))
+    {
+        mod = TokenKind::Plus;
+    }
+    else if (this->check(TokenKind::Minus))
+    {
+        mod = TokenKind::Minus;
+    }
+
+    vector<pair<TokenKind, Term*>> rhs;
+    Term* lhs = this->term();
+
+    while (1)
+    {
+        if (this->check(TokenKind::Plus))
+        {
+            rhs.push_back(pair<TokenKind, Term*>{TokenKind::Plus, this->term()});
+        }
+        else if (this->check(TokenKind::Minus))
+        {
+            rhs.push_back(pair<TokenKind, Term*>{TokenKind::Minus, this->term()});
+        }
+        else
+        {
+            break;
+        }
+    }
+    return this->arena->make<Expression>(mod, lhs, rhs);
+}
+
+Term* Parser::term()
+{
+    vector<pair<TokenKind, Factor*>> rhs;
+    Factor* lhs = this->factor();
+
+    while (1)
+    {
+        if (this->check(TokenKind::Times))
+        {
+            rhs.push_back(pair<TokenKind, Factor*>{TokenKind::Times, this->factor()});
+        }
+        else if (this->check(TokenKind::Slash))
+        {
+            rhs.push_back(pair<TokenKind, Factor*>{TokenKind::Slash, this->factor()});
+        }
+        else
+        {
+            break;
+        }
+    }
+    return this->arena->make<Term>(lhs, rhs);
+}
+
+Factor* Parser::factor()
+{
+    if (this->cur.ty == TokenKind::Num)
+    {
+        return this->arena->make<Factor>(FactorKind::Num, this->advance().valInt);
+    }
+    if (this->cur.ty == TokenKind::Name)
+    {
+        return this->arena->make<Factor>(FactorKind::Name, this->advance().valInt);
+    }
+
+    if (this->cur.ty != TokenKind::LParen)
+    {
+        this->fail("'(' expected");
+    }
+    this->advance();
+
+    Expression* expr = this->expression();
+    this->expect(TokenKind::RParen);
+    return this->arena->make<Factor>(expr);
+}
+
+// statement() and guardedStatement() without recursion. Heads of compound
+// statements push a frame; each finished statement is handed to the frame on top,
+// which either completes in turn or asks for its next sub-statement. A Panic drops
+// the frames above the innermost Begin, whose element becomes an empty Begin,
+// exactly where guardedStatement() would have caught it.
+Statement* Parser::statementOnStack()
+{
+    size_t base = this->statementFrames.size();
+    while (1)
+    {
+        Statement* done;
+        try
+        {
+            while (1)
+            {
+                if (this->statementFrames.size() - base >= this->maxNesting)
+                {
+                    this->fail("statements nested deeper than " + to_string(this->maxNesting));
+                }
+
+                if (this->check(TokenKind::Call))
+                {
+                    if (this->cur.ty != TokenKind::Name)
+                    {
+                        this->fail("name expected");
+                    }
+                    done = this->arena->make<Statement>(Call(this->advance().valInt));
+                    break;
+                }
+                else if (this->check(TokenKind::Begin))
+                {
+                    this->statementFrames.push_back(StatementFrame{StatementKind::Begin, nullptr, {}});
+                }
+                else if (this->check(TokenKind::If))
+                {
+                    Condition* cond = this->condition();
+                    this->expect(TokenKind::Then);
+                    this->statementFrames.push_back(StatementFrame{StatementKind::If, cond, {}});
+                }
+                else if (this->check(TokenKind::While))
+                {
+                    Condition* cond = this->condition();
+                    this->expect(TokenKind::Do);
+                    this->statementFrames.push_back(StatementFrame{StatementKind::While, cond, {}});
+                }
+                else
+                {
+                    if (this->cur.ty != TokenKind::Name)
+                    {
+                        this->fail("name expected");
+                    }
+                    Token tk = this->advance();
+
+                    this->expect(TokenKind::Becomes);
+                    Expression* expr = this->expression();
+                    done = this->arena->make<Statement>(Assign(tk.valInt, expr));
+                    break;
+                }
+            }
+        }
+        catch (const Panic&)
+        {
+            while (this->statementFrames.size() > base && this->statementFrames.back().kind != StatementKind::Begin)
+            {
+                this->statementFrames.pop_back();
+            }
+            this->synchronize();
+            done = this->arena->make<Statement>(Begin(vector<Statement*>()));
+        }
+
+        // hand `done` up until a Begin wants another statement
+        while (1)
+        {
+            if (this->statementFrames.size() == base)
+            {
+                return done;
+            }
+
+            StatementFrame& top = this->statementFrames.back();
+            if (top.kind == StatementKind::If)
+            {
+                done = this->arena->make<Statement>(If(top.cond, done));
+                this->statementFrames.pop_back();
+                continue;
+            }
+            if (top.kind == StatementKind::While)
+            {
+                done = this->arena->make<Statement>(While(top.cond, done));
+                this->statementFrames.pop_back();
+                continue;
+            }
+
+            top.body.push_back(done);
+            if (this->check(TokenKind::Semicolon))
+            {
+                break;
+            }
+            if (!this->check(TokenKind::End))
+            {
+                this->report(this->cur.offset, "';' or 'end' expected, got '" + string(tokenKindName(this->cur.ty)) + "'");
+                if (startsStatement(this->cur.ty))
+                {
+                    break;
+                }
+                this->synchronize();
+                if (this->check(TokenKind::Semicolon))
+                {
+                    break;
+                }
+                this->check(TokenKind::End);
+            }
+            done = this->arena->make<Statement>(Begin(move(top.body)));
+            this->statementFrames.pop_back();
+        }
+    }
+}
+
+void Parser::openExpression()
+{
+    if (this->expressionFrames.size() >= this->maxNesting)
+    {
+        this->fail("expressions nested deeper than " + to_string(this->maxNesting));
+    }
+
+    TokenKind mod = TokenKind::None;
+    if (this->check(TokenKind::Plus))
+    {
+        mod = TokenKind::Plus;
+    }
+    else if (this->check(TokenKind::Minus))
+    {
+        mod = TokenKind::Minus;
+    }
+    this->expressionFrames.push_back(ExpressionFrame{mod, TokenKind::None, TokenKind::None, this->terms.size(), this->factors.size()});
+}
+
+// expression() by precedence climbing over two levels, + - over * /, with an
+// explicit frame for each open parenthesis instead of a recursive call.
+Expression* Parser::expressionOnStack()
+{
+    this->expressionFrames.clear();
+    this->terms.clear();
+    this->factors.clear();
+    this->openExpression();
+
+    while (1)
+    {
+        Factor* factor;
+        if (this->cur.ty == TokenKind::Num)
+        {
+            factor = this->arena->make<Factor>(FactorKind::Num, this->advance().valInt);
+        }
+        else if (this->cur.ty == TokenKind::Name)
+        {
+            factor = this->arena->make<Factor>(FactorKind::Name, this->advance().valInt);
+        }
+        else
+        {
+            if (this->cur.ty != TokenKind::LParen)
+            {
+                this->fail("'(' expected");
+            }
+            this->advance();
+            this->openExpression();
+            continue;
+        }
+
+        // close as many terms and parenthesized expressions as `factor` completes
+        while (1)
+        {
+            ExpressionFrame& top = this->expressionFrames.back();
+            this->factors.push_back(pair<TokenKind, Factor*>{top.factorOp, factor});
+            if (this->cur.ty == TokenKind::Times || this->cur.ty == TokenKind::Slash)
+            {
+                top.factorOp = this->advance().ty;
+                break;
+            }
+
+            Term* term = this->arena->make<Term>(this->factors[top.factorBase].second,
+                vector<pair<TokenKind, Factor*>>(this->factors.begin() + top.factorBase + 1, this->factors.end()));
+            this->factors.resize(top.factorBase);
+            this->terms.push_back(pair<TokenKind, Term*>{top.termOp, term});
+            if (this->cur.ty == TokenKind::Plus || this->cur.ty == TokenKind::Minus)
+            {
+                top.termOp = this->advance().ty;
+                top.factorOp = TokenKind::None;
+                break;
+            }
+
+            Expression* expr = this->arena->make<Expression>(top.mod, this->terms[top.termBase].second,
+                vector<pair<TokenKind, Term*>>(this->terms.begin() + top.termBase + 1, this->terms.end()));
+            this->terms.resize(top.termBase);
+            this->expressionFrames.pop_back();
+            if (this->expressionFrames.empty())
+            {
+                return expr;
+            }
+            this->expect(TokenKind::RParen);
+            factor = this->arena->make<Factor>(expr);
+        }
+    }
+}
+
+// Keeps the AST of a source that is being edited. An edit that falls inside one
+// procedure's span reparses only the innermost such procedure, from its
+// `procedure` keyword, into the same Arena and SymbolTable. The new Block is
+// spliced into the old Procedure node, and the spans behind the edit are shifted.
+// Any other edit, or one that changes where the procedure ends, falls back to a
+// full parse. That also happens once replaced subtrees make up most of the arena.
+// The Program is left unresolved after every edit.
+class IncrementalParser
+{
+public:
+    int incremental = 0;  // edits handled by reparsing one procedure
+    int full = 0;         // full parses, the first one included
+
+    IncrementalParser(string source)
+    {
+        this->src = move(source);
+        this->prog = nullptr;
+        this->parseAll();
+    }
+
+    Program* program() const
+    {
+        return this->prog;
+    }
+
+    const string& source() const
+    {
+        return this->src;
+    }
+
+    // Replaces `removed` bytes at `offset` with `text` and updates the AST. Returns
+    // true when a single procedure was reparsed. Syntax errors of the edited source
+    // are thrown as by Parser; the next edit then parses the whole source again.
+    bool edit(size_t offset, size_t removed, string_view text)
+    {
+        this->src.replace(offset, removed, text.data(), text.size());
+        if (this->prog != nullptr && this->arena->bytes() < 2 * this->liveBytes + Arena::CHUNK_SIZE
+            && this->reparse(offset, removed, text.size()))
+        {
+            this->prog->resolved = false;
+            this->incremental++;
+            return true;
+        }
+        this->parseAll();
+        return false;
+    }
+
+private:
+    string src;
+    unique_ptr<Arena> arena;
+    unique_ptr<SymbolTable> symbols;
+    Program* prog;
+    size_t liveBytes;  // arena bytes of the last full parse
+
+    void parseAll()
+    {
+        this->prog = nullptr;
+        this->full++;
+        this->arena.reset(new Arena());
+        this->symbols.reset(new SymbolTable());
+        Lexer lx(this->src, this->symbols.get());
+        Parser ps = Parser(&lx, this->arena.get());
+        this->prog = ps.program();
+        this->liveBytes = this->arena->bytes();
+    }
+
+    // The innermost procedure whose span contains [offset, offset + removed).
+    static Procedure* enclosing(const Block* block, size_t offset, size_t removed)
+    {
+        for (Procedure* proc : block->procs)
+        {
+            if (proc->begin <= offset && offset + removed <= proc->end)
+            {
+                Procedure* inner = enclosing(proc->body, offset, removed);
+                return inner != nullptr ? inner : proc;
+            }
+        }
+        return nullptr;
+    }
+
+    bool reparse(size_t offset, size_t removed, size_t inserted)
+    {
+        Procedure* target = enclosing(this->prog->block, offset, removed);
+        if (target == nullptr)
+        {
+            return false;
+        }
+
+        int64_t delta = int64_t(inserted) - int64_t(removed);
+        uint32_t oldEnd = target->end;
+        Lexer lx(this->src, this->symbols.get());
+        lx.i = target->begin;
+        Parser ps = Parser(&lx, this->arena.get());
+        Procedure* fresh = ps.declaration();
+        if (fresh == nullptr || int64_t(fresh->end) != oldEnd + delta)
+        {
+            return false;
+        }
+
+        target->name = fresh->name;
+        target->body = fresh->body;
+        target->end = fresh->end;
+        this->shift(this->prog->block, target, oldEnd, delta);
+        return true;
+    }
+
+    // Moves the spans behind an edit, which ended at `oldEnd` before it, by
+    // `delta`; the spans of `target`'s reparsed subtree are already current.
+    static void shift(Block* block, const Procedure* target, uint32_t oldEnd, int64_t delta)
+    {
+        for (Procedure* proc : block->procs)
+        {
+            if (proc == target)
+            {
+                continue;
+            }
+            if (proc->begin >= oldEnd)
+            {
+                proc->begin += delta;
+            }
+            if (proc->end >= oldEnd)
+            {
+                proc->end += delta;
+            }
+            shift(proc->body, target, oldEnd, delta);
+        }
+    }
+};
+
+// Output through a fixed buffer that is handed to the stream in large writes,
+// so that emitting many small pieces costs neither a stream call nor an
+// allocation each.
+class OutBuffer
+{
+public:
+    static const size_t SIZE = 64 << 10;
+
+    OutBuffer(ostream* out)
+    {
+        this->out = out;
+        this->buf.resize(SIZE);
+        this->used = 0;
+        this->written = 0;
+    }
+
+    OutBuffer(const OutBuffer&) = delete;
+    OutBuffer& operator=(const OutBuffer&) = delete;
+
+    ~OutBuffer()
+    {
+        this->flush();
+    }
+
+    void put(char ch)
+    {
+        if (this->used == SIZE)
+        {
+            this->flush();
+        }
+        this->buf[this->used++] = ch;
+    }
+
+    void write(string_view text)
+    {
+        if (text.size() > SIZE - this->used)
+        {
+            this->flush();
+            if (text.size() > SIZE)
+            {
+                this->out->write(text.data(), text.size());
+                this->written += text.size();
+                return;
+            }
+        }
+        memcpy(this->buf.data() + this->used, text.data(), text.size());
+        this->used += text.size();
+    }
+
+    template<typename Int>
+    void number(Int value)
+    {
+        char digits[48];
+        char* end = to_chars(digits, digits + sizeof(digits), value).ptr;
+        this->write(string_view(digits, end - digits));
+    }
+
+    // LEB128: seven bits per byte, low bits first.
+    template<typename Int>
+    void varint(Int signedValue)
+    {
+        typename make_unsigned<Int>::type value = signedValue;
+        while (value >= 0x80)
+        {
+            this->put(char(value | 0x80));
+            value >>= 7;
+        }
+        this->put(char(value));
+    }
+
+    void flush()
+    {
+        this->out->write(this->buf.data(), this->used);
+        this->written += this->used;
+        this->used = 0;
+    }
+
+    // Bytes emitted so far, flushed or not.
+    size_t bytes() const
+    {
+        return this->written + this->used;
+    }
+
+private:
+    ostream* out;
+    vector<char> buf;
+    size_t used;
+    size_t written;
+};
+
+enum class AstKind : uint8_t
+{
+    Program,
+    Block,
+    Const,
+    Procedure,
+    Statement,
+    Condition,
+    Expression,
+    Term,
+    Factor,
+};
+
+struct AstNode
+{
+    AstKind kind;
+    const void* node;
+};
+
+// Number of child nodes of a node. A Block's children are its consts, then its
+// procedures, then its statement; variables are names, not nodes.
+uint32_t astChildCount(AstNode n)
+{
+    switch (n.kind)
+    {
+    case AstKind::Program:
+    case AstKind::Procedure:
+        return 1;
+    case AstKind::Block:
+    {
+        const Block* block = static_cast<const Block*>(n.node);
+        return block->consts.size() + block->procs.size() + 1;
+    }
+    case AstKind::Const:
+        return 0;
+    case AstKind::Statement:
+    {
+        const Statement* stmt = static_cast<const Statement*>(n.node);
+        switch (stmt->kind())
+        {
+        case StatementKind::Assign:
+            return 1;
+        case StatementKind::Call:
+            return 0;
+        case StatementKind::Begin:
+            return stmt->begin().body.size();
+        case StatementKind::If:
+        case StatementKind::While:
+            return 2;
+        }
+        return 0;
+    }
+    case AstKind::Condition:
+        return static_cast<const Condition*>(n.node)->kind() == ConditionKind::Odd ? 1 : 2;
+    case AstKind::Expression:
+        return 1 + static_cast<const Expression*>(n.node)->rhs.size();
+    case AstKind::Term:
+        return 1 + static_cast<const Term*>(n.node)->rhs.size();
+    case AstKind::Factor:
+        return static_cast<const Factor*>(n.node)->kind() == FactorKind::Expr ? 1 : 0;
+    }
+    return 0;
+}
+
+AstNode astChild(AstNode n, uint32_t k)
+{
+    switch (n.kind)
+    {
+    case AstKind::Program:
+        return { AstKind::Block, static_cast<const Program*>(n.node)->block };
+    case AstKind::Procedure:
+        return { AstKind::Block, static_cast<const Procedure*>(n.node)->body };
+    case AstKind::Block:
+    {
+        const Block* block = static_cast<const Block*>(n.node);
+        if (k < block->consts.size())
+        {
+            return { AstKind::Const, block->consts[k] };
+        }
+        k -= block->consts.size();
+        if (k < block->procs.size())
+        {
+            return { AstKind::Procedure, block->procs[k] };
+        }
+        return { AstKind::Statement, block->stmt };
+    }
+    case AstKind::Statement:
+    {
+        const Statement* stmt = static_cast<const Statement*>(n.node);
+        switch (stmt->kind())
+        {
+        case StatementKind::Assign:
+            return { AstKind::Expression, stmt->assign().expr };
+        case StatementKind::Begin:
+            return { AstKind::Statement, stmt->begin().body[k] };
+        case StatementKind::If:
+            return k == 0 ? AstNode{ AstKind::Condition, stmt->_if().cond } : AstNode{ AstKind::Statement, stmt->_if().then };
+        case StatementKind::While:
+            return k == 0 ? AstNode{ AstKind::Condition, stmt->_while().cond } : AstNode{ AstKind::Statement, stmt->_while().then };
+        case StatementKind::Call:
+            break;
+        }
+        break;
+    }
+    case AstKind::Condition:
+    {
+        const Condition* cond = static_cast<const Condition*>(n.node);
+        if (cond->kind() == ConditionKind::Odd)
+        {
+            return { AstKind::Expression, cond->odd().expr };
+        }
+        return { AstKind::Expression, k == 0 ? cond->std().lhs : cond->std().rhs };
+    }
+    case AstKind::Expression:
+    {
+        const Expression* expr = static_cast<const Expression*>(n.node);
+        return { AstKind::Term, k == 0 ? expr->lhs : expr->rhs[k - 1].second };
+    }
+    case AstKind::Term:
+    {
+        const Term* term = static_cast<const Term*>(n.node);
+        return { AstKind::Factor, k == 0 ? term->lhs : term->rhs[k - 1].second };
+    }
+    case AstKind::Factor:
+        return { AstKind::Expression, static_cast<const Factor*>(n.node)->expr() };
+    case AstKind::Const:
+        break;
+    }
+    throw "no such AST child";
+}
+
+struct AstFrame
+{
+    AstNode node;
+    uint32_t count;
+    uint32_t next;
+};
+
+// Walks the tree under `root` in source order on an explicit stack, so any depth
+// of nesting fits, and drives `format` through open(node, children), then
+// before(node, k) / after(node, k) around the subtree of each child k, then
+// close(node, children). `stack` is only scratch space, reusable across walks.
+template <class Format>
+void walkAst(AstNode root, Format* format, vector<AstFrame>* stack)
+{
+    stack->clear();
+    uint32_t count = astChildCount(root);
+    format->open(root, count);
+    stack->push_back(AstFrame{ root, count, 0 });
+
+    while (!stack->empty())
+    {
+        AstFrame& top = stack->back();
+        if (top.next == top.count)
+        {
+            format->close(top.node, top.count);
+            stack->pop_back();
+            if (!stack->empty())
+            {
+                format->after(stack->back().node, stack->back().next - 1);
+            }
+            continue;
+        }
+
+        uint32_t k = top.next++;
+        format->before(top.node, k);
+        AstNode child = astChild(top.node, k);
+        count = astChildCount(child);
+        format->open(child, count);
+        stack->push_back(AstFrame{ child, count, 0 });
+    }
+}
+
+// The bracketed debugging dump printed by operator<<.
+class AstText
+{
+public:
+    AstText(OutBuffer* out, const SymbolTable* symbols)
+    {
+        this->out = out;
+        this->symbols = symbols;
+    }
+
+    void open(AstNode n, uint32_t)
+    {
+        switch (n.kind)
+        {
+        case AstKind::Program:
+            this->out->write("[Program | block: ");
+            break;
+        case AstKind::Block:
+            this->out->write("Block| consts: ");
+            break;
+        case AstKind::Const:
+        {
+            const Const* c = static_cast<const Const*>(n.node);
+            this->out->write("[Const | name: ");
+            this->name(c->name);
+            this->out->write(" value: ");
+            this->out->number(c->value);
+            break;
+        }
+        case AstKind::Procedure:
+            this->out->write("Procedure | name : ");
+            this->name(static_cast<const Procedure*>(n.node)->name);
+            this->out->write(" body: ");
+            break;
+        case AstKind::Statement:
+        {
+            const Statement* stmt = static_cast<const Statement*>(n.node);
+            switch (stmt->kind())
+            {
+            case StatementKind::Assign:
+                this->out->write("[Statement | Assign: Assign | name: ");
+                this->name(stmt->assign().name);
+                this->out->write("expr: ");
+                break;
+            case StatementKind::Call:
+                this->out->write("[Statement | Call: [Call | name: ");
+                this->name(stmt->call().name);
+                break;
+            case StatementKind::Begin:
+                this->out->write("[Statement | Begin: [Begin | body: ");
+                break;
+            case StatementKind::If:
+                this->out->write("[Statement | If: [If | Condition: ");
+                break;
+            case StatementKind::While:
+                this->out->write("[Statement | While: [while | Condition: ");
+                break;
+            }
+            break;
+        }
+        case AstKind::Condition:
+        {
+            const Condition* cond = static_cast<const Condition*>(n.node);
+            if (cond->kind() == ConditionKind::Odd)
+            {
+                this->out->write("[Condition | OddCondition: [OddCondition | expr: ");
+            }
+            else
+            {
+                this->out->write("[Condition | StdCondition: [StdCondition | op: ");
+                this->out->write(tokenKindName(cond->std().op));
+                this->out->write(" lhs: ");
+            }
+            break;
+        }
+        case AstKind::Expression:
+            this->out->write("[Expression | mod: ");
+            this->out->write(tokenKindName(static_cast<const Expression*>(n.node)->mod));
+            this->out->write(" lhs: ");
+            break;
+        case AstKind::Term:
+            this->out->write("[Term | lhs: ");
+            break;
+        case AstKind::Factor:
+        {
+            const Factor* factor = static_cast<const Factor*>(n.node);
+            this->out->write("[Factor | ");
+            switch (factor->kind())
+            {
+            case FactorKind::Num:
+                this->out->write("num: ");
+                this->out->number(factor->num());
+                break;
+            case FactorKind::Name:
+                this->out->write("name: ");
+                this->name(factor->name());
+                break;
+            case FactorKind::Expr:
+                this->out->write("expr: ");
+                break;
+            case FactorKind::Var:
+                this->out->write("var: ");
+                this->name(factor->var().name);
+                this->out->put('@');
+                this->out->number(factor->var().depth);
+                this->out->put(':');
+                this->out->number(factor->var().slot);
+                break;
+            }
+            break;
+        }
+        }
+    }
+
+    void before(AstNode n, uint32_t k)
+    {
+        if (n.kind == AstKind::Block)
+        {
+            const Block* block = static_cast<const Block*>(n.node);
+            if (k == block->consts.size())
+            {
+                this->out->write("vars: ");
+                for (int var : block->vars)
+                {
+                    this->name(var);
+                    this->out->put(',');
+                }
+                this->out->write("procs: ");
+            }
+            if (k == block->consts.size() + block->procs.size())
+            {
+                this->out->write("statement: ");
+            }
+        }
+        else if (k > 0 && (n.kind == AstKind::Expression || n.kind == AstKind::Term))
+        {
+            this->out->put('<');
+            this->out->write(tokenKindName(n.kind == AstKind::Expression
+                ? static_cast<const Expression*>(n.node)->rhs[k - 1].first
+                : static_cast<const Term*>(n.node)->rhs[k - 1].first));
+            this->out->put(',');
+        }
+    }
+
+    void after(AstNode n, uint32_t k)
+    {
+        if (n.kind == AstKind::Expression || n.kind == AstKind::Term)
+        {
+            this->out->write(k == 0 ? " rhs: " : ">");
+        }
+        else if (k == 0 && n.kind == AstKind::Condition)
+        {
+            this->out->write(" rhs: ");
+        }
+        else if (k == 0 && n.kind == AstKind::Statement)
+        {
+            StatementKind kind = static_cast<const Statement*>(n.node)->kind();
+            if (kind == StatementKind::If || kind == StatementKind::While)
+            {
+                this->out->write(" Statement: ");
+            }
+        }
+    }
+
+    void close(AstNode n, uint32_t)
+    {
+        bool wrapped = n.kind == AstKind::Condition || n.kind == AstKind::Statement;
+        this->out->write(wrapped ? "]]" : "]");
+    }
+
+private:
+    OutBuffer* out;
+    const SymbolTable* symbols;
+
+    void name(int id)
+    {
+        if (this->symbols != nullptr)
+        {
+            this->out->write(this->symbols->name(id));
+        }
+        else
+        {
+            this->out->put('#');
+            this->out->number(id);
+        }
+    }
+};
+
+// One JSON object per node: {"node": kind, fields..., "children": [...]}, with
+// operators and names spelled out. Children appear in source order.
+class AstJson
+{
+public:
+    AstJson(OutBuffer* out, const SymbolTable* symbols)
+    {
+        this->out = out;
+        this->symbols = symbols;
+    }
+
+    void open(AstNode n, uint32_t children)
+    {
+        switch (n.kind)
+        {
+        case AstKind::Program:
+            this->out->write("{\"node\":\"Program\"");
+            break;
+        case AstKind::Block:
+        {
+            const Block* block = static_cast<const Block*>(n.node);
+            this->out->write("{\"node\":\"Block\",\"vars\":[");
+            for (size_t k = 0; k < block->vars.size(); k++)
+            {
+                if (k > 0)
+                {
+                    this->out->put(',');
+                }
+                this->name(block->vars[k]);
+            }
+            this->out->put(']');
+            break;
+        }
+        case AstKind::Const:
+        {
+            const Const* c = static_cast<const Const*>(n.node);
+            this->out->write("{\"node\":\"Const\",\"name\":");
+            this->name(c->name);
+            this->out->write(",\"value\":");
+            this->out->number(c->value);
+            break;
+        }
+        case AstKind::Procedure:
+        {
+            const Procedure* proc = static_cast<const Procedure*>(n.node);
+            this->out->write("{\"node\":\"Procedure\",\"name\":");
+            this->name(proc->name);
+            this->out->write(",\"begin\":");
+            this->out->number(proc->begin);
+            this->out->write(",\"end\":");
+            this->out->number(proc->end);
+            break;
+        }
+        case AstKind::Statement:
+        {
+            const Statement* stmt = static_cast<const Statement*>(n.node);
+            switch (stmt->kind())
+            {
+            case StatementKind::Assign:
+                this->out->write("{\"node\":\"Assign\",\"name\":");
+                this->name(stmt->assign().name);
+                break;
+            case StatementKind::Call:
+                this->out->write("{\"node\":\"Call\",\"name\":");
+                this->name(stmt->call().name);
+                break;
+            case StatementKind::Begin:
+                this->out->write("{\"node\":\"Begin\"");
+                break;
+            case StatementKind::If:
+                this->out->write("{\"node\":\"If\"");
+                break;
+            case StatementKind::While:
+                this->out->write("{\"node\":\"While\"");
+                break;
+            }
+            break;
+        }
+        case AstKind::Condition:
+        {
+            const Condition* cond = static_cast<const Condition*>(n.node);
+            if (cond->kind() == ConditionKind::Odd)
+            {
+                this->out->write("{\"node\":\"Odd\"");
+            }
+            else
+            {
+                this->out->write("{\"node\":\"Compare\",\"op\":");
+                this->kind(cond->std().op);
+            }
+            break;
+        }
+        case AstKind::Expression:
+        {
+            const Expression* expr = static_cast<const Expression*>(n.node);
+            this->out->write("{\"node\":\"Expression\",\"sign\":");
+            if (expr->mod == TokenKind::None)
+            {
+                this->out->write("null");
+            }
+            else
+            {
+                this->kind(expr->mod);
+            }
+            this->out->write(",\"ops\":[");
+            for (size_t k = 0; k < expr->rhs.size(); k++)
+            {
+                if (k > 0)
+                {
+                    this->out->put(',');
+                }
+                this->kind(expr->rhs[k].first);
+            }
+            this->out->put(']');
+            break;
+        }
+        case AstKind::Term:
+        {
+            const Term* term = static_cast<const Term*>(n.node);
+            this->out->write("{\"node\":\"Term\",\"ops\":[");
+            for (size_t k = 0; k < term->rhs.size(); k++)
+            {
+                if (k > 0)
+                {
+                    this->out->put(',');
+                }
+                this->kind(term->rhs[k].first);
+            }
+            this->out->put(']');
+            break;
+        }
+        case AstKind::Factor:
+        {
+            const Factor* factor = static_cast<const Factor*>(n.node);
+            switch (factor->kind())
+            {
+            case FactorKind::Num:
+                this->out->write("{\"node\":\"Num\",\"value\":");
+                this->out->number(factor->num());
+                break;
+            case FactorKind::Name:
+                this->out->write("{\"node\":\"Name\",\"name\":");
+                this->name(factor->name());
+                break;
+            case FactorKind::Expr:
+                this->out->write("{\"node\":\"Paren\"");
+                break;
+            case FactorKind::Var:
+                this->out->write("{\"node\":\"Var\",\"name\":");
+                this->name(factor->var().name);
+                this->out->write(",\"depth\":");
+                this->out->number(factor->var().depth);
+                this->out->write(",\"slot\":");
+                this->out->number(factor->var().slot);
+                break;
+            }
+            break;
+        }
+        }
+        if (children > 0)
+        {
+            this->out->write(",\"children\":[");
+        }
+    }
+
+    void before(AstNode, uint32_t k)
+    {
+        if (k > 0)
+        {
+            this->out->put(',');
+        }
+    }
+
+    void after(AstNode, uint32_t)
+    {
+    }
+
+    void close(AstNode, uint32_t children)
+    {
+        this->out->write(children > 0 ? "]}" : "}");
+    }
+
+private:
+    OutBuffer* out;
+    const SymbolTable* symbols;
+
+    // Identifiers and token kind names never need escaping.
+    void name(int id)
+    {
+        this->out->put('"');
+        if (this->symbols != nullptr)
+        {
+            this->out->write(this->symbols->name(id));
+        }
+        else
+        {
+            this->out->put('#');
+            this->out->number(id);
+        }
+        this->out->put('"');
+    }
+
+    void kind(TokenKind kind)
+    {
+        this->out->put('"');
+        this->out->write(tokenKindName(kind));
+        this->out->put('"');
+    }
+};
+
+// Compact preorder encoding. A Program starts with the magic "PL0AST", a
+// version byte and its symbol table (count, then length and bytes of each
+// name). Each node is then one tag byte followed by its fields and its child
+// count, all as LEB128 varints (signed values zigzag-encoded), then its
+// children. Tags are AstKind for nodes with one shape; statements, conditions
+// and factors use the tags below. Names are symbol ids and operators TokenKind
+// bytes; an Expression (after its sign) and a Term write their operator count
+// before the operators.
+class AstBinary
+{
+public:
+    static const uint8_t VERSION = 1;
+    enum Tag : uint8_t
+    {
+        Assign = 16, Call, Begin, If, While,  // statements
+        Odd = 32, Compare,                     // conditions
+        Num = 48, Name, Paren, Var,            // factors
+    };
+
+    AstBinary(OutBuffer* out, const SymbolTable* symbols)
+    {
+        this->out = out;
+        this->symbols = symbols;
+    }
+
+    void open(AstNode n, uint32_t children)
+    {
+        switch (n.kind)
+        {
+        case AstKind::Program:
+            this->out->write("PL0AST");
+            this->out->put(char(VERSION));
+            this->out->varint(this->symbols != nullptr ? this->symbols->size() : 0);
+            for (int id = 0; this->symbols != nullptr && id < this->symbols->size(); id++)
+            {
+                this->out->varint(this->symbols->name(id).size());
+                this->out->write(this->symbols->name(id));
+            }
+            this->tag(uint8_t(AstKind::Program));
+            break;
+        case AstKind::Block:
+        {
+            const Block* block = static_cast<const Block*>(n.node);
+            this->tag(uint8_t(AstKind::Block));
+            this->out->varint(block->consts.size());
+            this->out->varint(block->procs.size());
+            this->out->varint(block->vars.size());
+            for (int var : block->vars)
+            {
+                this->out->varint(var);
+            }
+            break;
+        }
+        case AstKind::Const:
+        {
+            const Const* c = static_cast<const Const*>(n.node);
+            this->tag(uint8_t(AstKind::Const));
+            this->out->varint(c->name);
+            this->signedInt(c->value);
+            break;
+        }
+        case AstKind::Procedure:
+        {
+            const Procedure* proc = static_cast<const Procedure*>(n.node);
+            this->tag(uint8_t(AstKind::Procedure));
+            this->out->varint(proc->name);
+            this->out->varint(proc->begin);
+            this->out->varint(proc->end);
+            break;
+        }
+        case AstKind::Statement:
+        {
+            const Statement* stmt = static_cast<const Statement*>(n.node);
+            this->tag(Assign + uint8_t(stmt->kind()));
+            if (stmt->kind() == StatementKind::Assign)
+            {
+                this->out->varint(stmt->assign().name);
+            }
+            else if (stmt->kind() == StatementKind::Call)
+            {
+                this->out->varint(stmt->call().name);
+            }
+            break;
+        }
+        case AstKind::Condition:
+        {
+            const Condition* cond = static_cast<const Condition*>(n.node);
+            this->tag(Odd + uint8_t(cond->kind()));
+            if (cond->kind() == ConditionKind::Std)
+            {
+                this->tag(uint8_t(cond->std().op));
+            }
+            break;
+        }
+        case AstKind::Expression:
+        {
+            const Expression* expr = static_cast<const Expression*>(n.node);
+            this->tag(uint8_t(AstKind::Expression));
+            this->tag(uint8_t(expr->mod));
+            this->out->varint(expr->rhs.size());
+            for (const auto& item : expr->rhs)
+            {
+                this->tag(uint8_t(item.first));
+            }
+            break;
+        }
+        case AstKind::Term:
+        {
+            const Term* term = static_cast<const Term*>(n.node);
+            this->tag(uint8_t(AstKind::Term));
+            this->out->varint(term->rhs.size());
+            for (const auto& item : term->rhs)
+            {
+                this->tag(uint8_t(item.first));
+            }
+            break;
+        }
+        case AstKind::Factor:
+        {
+            const Factor* factor = static_cast<const Factor*>(n.node);
+            this->tag(Num + uint8_t(factor->kind()));
+            switch (factor->kind())
+            {
+            case FactorKind::Num:
+                this->signedInt(factor->num());
+                break;
+            case FactorKind::Name:
+                this->out->varint(factor->name());
+                break;
+            case FactorKind::Expr:
+                break;
+            case FactorKind::Var:
+                this->out->varint(factor->var().name);
+                this->out->varint(factor->var().depth);
+                this->out->varint(factor->var().slot);
+                break;
+            }
+            break;
+        }
+        }
+        this->out->varint(children);
+    }
+
+    void before(AstNode, uint32_t) {}
+    void after(AstNode, uint32_t) {}
+    void close(AstNode, uint32_t) {}
+
+private:
+    OutBuffer* out;
+    const SymbolTable* symbols;
+
+    void tag(uint8_t value)
+    {
+        this->out->put(char(value));
+    }
+
+    // Zigzag, so that literals of any Value width share the encoding.
+    void signedInt(Value value)
+    {
+        this->out->varint((ValueBits(value) << 1) ^ ValueBits(value >> (sizeof(Value) * 8 - 1)));
+    }
+};
+
+enum class AstFormat
+{
+    None,
+    Text,
+    Json,
+    Binary,
+};
+
+// Writes trees through one OutBuffer, reusing its walk stack, so dumping a large
+// tree allocates nothing per node.
+class AstDumper
+{
+public:
+    AstDumper(ostream* out, const SymbolTable* symbols)
+        : out(out)
+    {
+        this->symbols = symbols;
+    }
+
+    void dump(AstNode root, AstFormat format)
+    {
+        switch (format)
+        {
+        case AstFormat::Text:
+        {
+            AstText text(&this->out, this->symbols);
+            walkAst(root, &text, &this->stack);
+            break;
+        }
+        case AstFormat::Json:
+        {
+            AstJson json(&this->out, this->symbols);
+            walkAst(root, &json, &this->stack);
+            break;
+        }
+        case AstFormat::Binary:
+        {
+            AstBinary binary(&this->out, this->symbols);
+            walkAst(root, &binary, &this->stack);
+            break;
+        }
+        case AstFormat::None:
+            break;
+        }
+    }
+
+    void program(const Program* program, AstFormat format)
+    {
+        this->dump(AstNode{ AstKind::Program, program }, format);
+    }
+
+    size_t bytes() const
+    {
+        return this->out.bytes();
+    }
+
+    void flush()
+    {
+        this->out.flush();
+    }
+
+private:
+    OutBuffer out;
+    const SymbolTable* symbols;
+    vector<AstFrame> stack;
+};
+
+// Nodes print as AstText; names are symbol ids ("#3") below the Program level,
+// where no SymbolTable is at hand.
+ostream& printAst(ostream& cout, AstNode node, const SymbolTable* symbols)
+{
+    AstDumper(&cout, symbols).dump(node, AstFormat::Text);
+    return cout;
+}
+
+ostream& operator<<(ostream& cout, const Program& program)
+{
+    return printAst(cout, AstNode{ AstKind::Program, &program }, program.symbols);
+}
+
+ostream& operator<<(ostream& cout, const Block& block)
+{
+    return printAst(cout, AstNode{ AstKind::Block, &block }, nullptr);
+}
+
+ostream& operator<<(ostream& cout, const Const& _const)
+{
+    return printAst(cout, AstNode{ AstKind::Const, &_const }, nullptr);
+}
+
+ostream& operator<<(ostream& cout, const Procedure& procedure)
+{
+    return printAst(cout, AstNode{ AstKind::Procedure, &procedure }, nullptr);
+}
+
+ostream& operator<<(ostream& cout, const Statement& statement)
+{
+    return printAst(cout, AstNode{ AstKind::Statement, &statement }, nullptr);
+}
+
+ostream& operator<<(ostream& cout, const Condition& condition)
+{
+    return printAst(cout, AstNode{ AstKind::Condition, &condition }, nullptr);
+}
+
+ostream& operator<<(ostream& cout, const Expression& expression)
+{
+    return printAst(cout, AstNode{ AstKind::Expression, &expression }, nullptr);
+}
+
+ostream& operator<<(ostream& cout, const Term& term)
+{
+    return printAst(cout, AstNode{ AstKind::Term, &term }, nullptr);
+}
+
+ostream& operator<<(ostream& cout, const Factor& factor)
+{
+    return printAst(cout, AstNode{ AstKind::Factor, &factor }, nullptr);
+}
+
+// Arithmetic as every backend performs it. Results wrap around, or with
+// PL0_CHECKED throw "integer overflow"; the *Overflows variants report overflow
+// instead, for callers such as the folder that must not throw.
+inline bool addOverflows(Value a, Value b, Value* out)
+{
+    *out = static_cast<Value>(ValueBits(a) + ValueBits(b));
+    return VALUE_CHECKED && __builtin_add_overflow(a, b, out);
+}
+
+inline bool subOverflows(Value a, Value b, Value* out)
+{
+    *out = static_cast<Value>(ValueBits(a) - ValueBits(b));
+    return VALUE_CHECKED && __builtin_sub_overflow(a, b, out);
+}
+
+inline bool mulOverflows(Value a, Value b, Value* out)
+{
+    *out = static_cast<Value>(ValueBits(a) * ValueBits(b));
+    return VALUE_CHECKED && __builtin_mul_overflow(a, b, out);
+}
+
+[[noreturn]] inline void overflow()
+{
+    throw "integer overflow";
+}
+
+inline Value addValue(Value a, Value b)
+{
+    Value out;
+    if (addOverflows(a, b, &out))
+    {
+        overflow();
+    }
+    return out;
+}
+
+inline Value subValue(Value a, Value b)
+{
+    Value out;
+    if (subOverflows(a, b, &out))
+    {
+        overflow();
+    }
+    return out;
+}
+
+inline Value mulValue(Value a, Value b)
+{
+    Value out;
+    if (mulOverflows(a, b, &out))
+    {
+        overflow();
+    }
+    return out;
+}
+
+inline Value negValue(Value a)
+{
+    return subValue(0, a);
+}
+
+// Division: truncating, with x / -1 computed as a negation so that MIN / -1
+// yields MIN (or overflows when checked) instead of trapping. The divisor must be
+// non-zero.
+inline Value divide(Value a, Value b)
+{
+    return b == -1 ? negValue(a) : a / b;
+}
+
+// Applies a binary operator to two literals with the semantics of the VM.
+// Returns false when the result must be left to run time (division by zero, or
+// a checked overflow), so folding never hides a runtime error.
+bool foldBinary(TokenKind op, Value a, Value b, Value* out)
+{
+    switch (op)
+    {
+    case TokenKind::Plus: return !addOverflows(a, b, out);
+    case TokenKind::Minus: return !subOverflows(a, b, out);
+    case TokenKind::Times: return !mulOverflows(a, b, out);
+    case TokenKind::Slash:
+        if (b == 0 || (b == -1 && VALUE_CHECKED && a == numeric_limits<Value>::min()))
+        {
+            return false;
+        }
+        *out = divide(a, b);
+        return true;
+    case TokenKind::Eq: *out = a == b; return true;
+    case TokenKind::Ne: *out = a != b; return true;
+    case TokenKind::Lt: *out = a < b; return true;
+    case TokenKind::Lte: *out = a <= b; return true;
+    case TokenKind::Gt: *out = a > b; return true;
+    case TokenKind::Gte: *out = a >= b; return true;
+    default: return false;
+    }
+}
+
+struct FoldStats
+{
+    int constants = 0;   // names replaced by their constant value
+    int folds = 0;       // operators evaluated at compile time
+    int identities = 0;  // x*1, x/1, x+0, x*0 and 1*x simplifications
+    int branches = 0;    // if/while statements whose condition was decided
+};
+
+// Rewrites the AST in place before compilation: substitutes constants, folds
+// literal operands of Term and Expression chains, applies the identities counted in
+// FoldStats, and removes if/while statements whose condition is statically known.
+// Removed statements become an empty Begin, which Begin bodies then drop, and a
+// Begin left with a single statement is replaced by it.
+// Names are resolved with the same block scoping as Compiler.
+class ConstantFolder
+{
+public:
+    FoldStats stats;
+
+    void program(Program* program)
+    {
+        this->block(program->block);
+    }
+
+private:
+    struct Binding
+    {
+        bool isConst;
+        Value value;
+    };
+
+    vector<unordered_map<int, Binding>> scopes;
+
+    static bool literal(const Factor* factor, Value* value)
+    {
+        if (factor->kind() != FactorKind::Num)
+        {
+            return false;
+        }
+        *value = factor->num();
+        return true;
+    }
+
+    static bool literal(const Term* term, Value* value)
+    {
+        return term->rhs.empty() && literal(term->lhs, value);
+    }
+
+    static bool literal(const Expression* expr, Value* value)
+    {
+        return expr->mod != TokenKind::Minus && expr->rhs.empty() && literal(expr->lhs, value);
+    }
+
+    void block(Block* block)
+    {
+        this->scopes.emplace_back();
+        for (const Const* c : block->consts)
+        {
+            this->scopes.back()[c->name] = Binding{true, c->value};
+        }
+        for (int var : block->vars)
+        {
+            this->scopes.back()[var] = Binding{false, 0};
+        }
+        for (const Procedure* proc : block->procs)
+        {
+            this->scopes.back()[proc->name] = Binding{false, 0};
+        }
+
+        for (Procedure* proc : block->procs)
+        {
+            this->block(proc->body);
+        }
+        this->statement(block->stmt);
+        this->scopes.pop_back();
+    }
+
+    void statement(Statement* stmt)
+    {
+        switch (stmt->kind())
+        {
+        case StatementKind::Assign:
+            this->expression(get<Assign>(stmt->stmt).expr);
+            break;
+        case StatementKind::Call:
+            break;
+        case StatementKind::Begin:
+        {
+            vector<Statement*>& body = get<Begin>(stmt->stmt).body;
+            vector<Statement*> flat;
+            for (Statement* s : body)
+            {
+                this->statement(s);
+                if (s->kind() == StatementKind::Begin)
+                {
+                    const vector<Statement*>& inner = s->begin().body;
+                    flat.insert(flat.end(), inner.begin(), inner.end());
+                }
+                else
+                {
+                    flat.push_back(s);
+                }
+            }
+            body = flat;
+            if (flat.size() == 1)
+            {
+                auto only = flat[0]->stmt;
+                stmt->stmt = only;
+            }
+            break;
+        }
+        case StatementKind::If:
+        {
+            If& _if = get<If>(stmt->stmt);
+            int decided = this->condition(_if.cond);
+            this->statement(_if.then);
+            if (decided == 1)
+            {
+                this->stats.branches++;
+                auto then = _if.then->stmt;
+                stmt->stmt = then;
+            }
+            else if (decided == 0)
+            {
+                this->stats.branches++;
+                stmt->stmt = Begin();
+            }
+            break;
+        }
+        case StatementKind::While:
+        {
+            While& _while = get<While>(stmt->stmt);
+            int decided = this->condition(_while.cond);
+            this->statement(_while.then);
+            if (decided == 0)
+            {
+                this->stats.branches++;
+                stmt->stmt = Begin();
+            }
+            break;
+        }
+        }
+    }
+
+    // Returns 1 or 0 when the condition is statically true or false, -1 otherwise.
+    int condition(Condition* cond)
+    {
+        Value lhs, rhs, result;
+        switch (cond->kind())
+        {
+        case ConditionKind::Odd:
+            this->expression(cond->odd().expr);
+            if (literal(cond->odd().expr, &lhs))
+            {
+                return lhs & 1;
+            }
+            return -1;
+        case ConditionKind::Std:
+        {
+            const StdCondition& std = cond->std();
+            this->expression(std.lhs);
+            this->expression(std.rhs);
+            if (literal(std.lhs, &lhs) && literal(std.rhs, &rhs) && foldBinary(std.op, lhs, rhs, &result))
+            {
+                return result;
+            }
+            return -1;
+        }
+        }
+        return -1;
+    }
+
+    // Literal terms are summed into one constant that ends the chain, so
+    // `1 + x - 3` becomes `x + -2`. A non-literal term moved to the front takes
+    // its operator as the expression's sign. Checked builds only fold all-literal
+    // chains, since reassociating around a variable can move an overflow.
+    void expression(Expression* expr)
+    {
+        this->term(expr->lhs);
+        for (auto& item : expr->rhs)
+        {
+            this->term(item.second);
+        }
+
+        Value sum = 0;
+        Value value;
+        Term* litTerm = nullptr;
+        int literals = 0;
+        bool exact = true;
+        TokenKind mod = TokenKind::None;
+        Term* lhs = nullptr;
+        vector<pair<TokenKind, Term*>> rhs;
+
+        auto add = [&](TokenKind op, Term* term)
+        {
+            if (literal(term, &value))
+            {
+                exact = foldBinary(op, sum, value, &sum) && exact;
+                litTerm = litTerm != nullptr ? litTerm : term;
+                literals++;
+            }
+            else if (lhs == nullptr)
+            {
+                lhs = term;
+                mod = op == TokenKind::Minus ? TokenKind::Minus : TokenKind::None;
+            }
+            else
+            {
+                rhs.push_back(pair<TokenKind, Term*>{op, term});
+            }
+        };
+
+        add(expr->mod == TokenKind::Minus ? TokenKind::Minus : TokenKind::Plus, expr->lhs);
+        for (auto& item : expr->rhs)
+        {
+            add(item.first, item.second);
+        }
+
+        if (literals == 0 || (literals == 1 && litTerm == expr->lhs && expr->mod != TokenKind::Minus && sum != 0 && lhs == nullptr))
+        {
+            return;
+        }
+        if (!exact || (VALUE_CHECKED && lhs != nullptr))
+        {
+            return;
+        }
+
+        if (lhs == nullptr)
+        {
+            this->stats.folds += literals - 1 + (expr->mod == TokenKind::Minus);
+            litTerm->lhs->value.emplace<0>(sum);
+            expr->mod = TokenKind::None;
+            expr->lhs = litTerm;
+            expr->rhs.clear();
+            return;
+        }
+
+        if (sum == 0)
+        {
+            this->stats.folds += literals - 1;
+            this->stats.identities++;
+        }
+        else
+        {
+            this->stats.folds += literals - 1;
+            bool negate = sum < 0 && sum != numeric_limits<Value>::min();
+            litTerm->lhs->value.emplace<0>(negate ? -sum : sum);
+            rhs.push_back(pair<TokenKind, Term*>{negate ? TokenKind::Minus : TokenKind::Plus, litTerm});
+        }
+        expr->mod = mod;
+        expr->lhs = lhs;
+        expr->rhs = rhs;
+    }
+
+    // Folds a literal prefix (`2 * 3 * x`), runs of literal multipliers
+    // (`x * 2 * 3`), drops `* 1` and `/ 1`, and turns the whole term into 0 when it
+    // multiplies by 0, every divisor is a non-zero literal and no factor is
+    // parenthesized.
+    void term(Term* term)
+    {
+        this->factor(term->lhs);
+        for (auto& item : term->rhs)
+        {
+            this->factor(item.second);
+        }
+
+        Factor* lhs = term->lhs;
+        vector<pair<TokenKind, Factor*>> rhs;
+        Value a, b, result;
+
+        for (auto& item : term->rhs)
+        {
+            if (literal(item.second, &b))
+            {
+                if (b == 1)
+                {
+                    this->stats.identities++;
+                    continue;
+                }
+                if (rhs.empty() && literal(lhs, &a) && foldBinary(item.first, a, b, &result))
+                {
+                    this->stats.folds++;
+                    lhs->value.emplace<0>(result);
+                    continue;
+                }
+                // checked builds keep `x * -1 * -1`, whose first product can overflow
+                if (item.first == TokenKind::Times && !rhs.empty() && rhs.back().first == TokenKind::Times && literal(rhs.back().second, &a)
+                    && (!VALUE_CHECKED || (a > 0 && b > 0)) && foldBinary(TokenKind::Times, a, b, &result))
+                {
+                    this->stats.folds++;
+                    rhs.back().second->value.emplace<0>(result);
+                    continue;
+                }
+            }
+            else if (rhs.empty() && item.first == TokenKind::Times && literal(lhs, &a) && a == 1)
+            {
+                this->stats.identities++;
+                lhs = item.second;
+                continue;
+            }
+            rhs.push_back(item);
+        }
+
+        // a parenthesized factor may divide by zero, and in checked builds any
+        // product but a single one may overflow
+        bool zero = literal(lhs, &a) && a == 0;
+        bool safe = lhs->kind() != FactorKind::Expr && (!VALUE_CHECKED || rhs.size() == 1);
+        for (auto& item : rhs)
+        {
+            bool lit = literal(item.second, &b);
+            zero = zero || (item.first == TokenKind::Times && lit && b == 0);
+            safe = safe && item.second->kind() != FactorKind::Expr && (item.first == TokenKind::Times || (lit && b != 0));
+        }
+
+        if (zero && safe && !rhs.empty())
+        {
+            this->stats.identities++;
+            lhs->value.emplace<0>(0);
+            rhs.clear();
+        }
+
+        term->lhs = lhs;
+        term->rhs = rhs;
+    }
+
+    void factor(Factor* factor)
+    {
+        switch (factor->kind())
+        {
+        case FactorKind::Num:
+            break;
+        case FactorKind::Name:
+            for (auto scope = this->scopes.rbegin(); scope != this->scopes.rend(); scope++)
+            {
+                auto it = scope->find(factor->name());
+                if (it != scope->end())
+                {
+                    if (it->second.isConst)
+                    {
+                        this->stats.constants++;
+                        factor->value.emplace<0>(it->second.value);
+                    }
+                    break;
+                }
+            }
+            break;
+        case FactorKind::Var:
+            break;
+        case FactorKind::Expr:
+        {
+            Expression* expr = factor->expr();
+            this->expression(expr);
+            if (expr->mod != TokenKind::Minus && expr->rhs.empty() && expr->lhs->rhs.empty())
+            {
+                // a parenthesized single factor, literal or not
+                factor->value = expr->lhs->lhs->value;
+            }
+            break;
+        }
+        }
+    }
+};
+
+// Resolves every name of a Program once, after folding and before any backend
+// runs. Constants are inlined as literals, variable factors and assignment targets
+// become a VarRef, calls get their procedure index, and each Block records its
+// lexical level. Variables and procedures are numbered in the order Compiler
+// visits them: a block's variables, then its procedures, then their bodies.
+class Resolver
+{
+public:
+    void program(Program* program)
+    {
+        this->symbols = program->symbols;
+        this->out = program;
+        program->procs.clear();
+        program->slotCount = 0;
+        program->maxLevel = 0;
+        this->block(program->block, 0);
+        program->resolved = true;
+    }
+
+private:
+    enum class BindingKind
+    {
+        Const,
+        Var,
+        Proc,
+    };
+
+    struct Binding
+    {
+        BindingKind kind;
+        Value value;  // constant value or procedure index
+        VarRef ref;
+    };
+
+    const SymbolTable* symbols;
+    Program* out;
+    vector<unordered_map<int, Binding>> scopes;
+
+    void declare(int name, const Binding& binding)
+    {
+        if (!this->scopes.back().emplace(name, binding).second)
+        {
+            throw "redefinition of " + string(this->symbols->name(name));
+        }
+    }
+
+    const Binding& lookup(int name)
+    {
+        for (auto scope = this->scopes.rbegin(); scope != this->scopes.rend(); scope++)
+        {
+            auto it = scope->find(name);
+            if (it != scope->end())
+            {
+                return it->second;
+            }
+        }
+        throw "undefined symbol: " + string(this->symbols->name(name));
+    }
+
+    void block(Block* block, int level)
+    {
+        this->scopes.emplace_back();
+        block->level = level;
+        block->firstSlot = this->out->slotCount;
+        this->out->maxLevel = max(this->out->maxLevel, level);
+
+        for (const Const* c : block->consts)
+        {
+            this->declare(c->name, Binding{BindingKind::Const, c->value, VarRef{}});
+        }
+        for (size_t k = 0; k < block->vars.size(); k++)
+        {
+            VarRef ref{block->vars[k], uint32_t(level), uint32_t(k), uint32_t(this->out->slotCount++)};
+            this->declare(block->vars[k], Binding{BindingKind::Var, 0, ref});
+        }
+        for (Procedure* proc : block->procs)
+        {
+            proc->index = this->out->procs.size();
+            this->out->procs.push_back(proc);
+            this->declare(proc->name, Binding{BindingKind::Proc, proc->index, VarRef{}});
+        }
+
+        this->statement(block->stmt);
+        for (Procedure* proc : block->procs)
+        {
+            this->block(proc->body, level + 1);
+        }
+        this->scopes.pop_back();
+    }
+
+    void statement(Statement* stmt)
+    {
+        switch (stmt->kind())
+        {
+        case StatementKind::Assign:
+        {
+            Assign& assign = get<Assign>(stmt->stmt);
+            const Binding& target = this->lookup(assign.name);
+            if (target.kind != BindingKind::Var)
+            {
+                throw "cannot assign to " + string(this->symbols->name(assign.name));
+            }
+            assign.target = target.ref;
+            this->expression(assign.expr);
+            break;
+        }
+        case StatementKind::Call:
+        {
+            Call& call = get<Call>(stmt->stmt);
+            const Binding& target = this->lookup(call.name);
+            if (target.kind != BindingKind::Proc)
+            {
+                throw string(this->symbols->name(call.name)) + " is not a procedure";
+            }
+            call.proc = static_cast<int>(target.value);
+            break;
+        }
+        case StatementKind::Begin:
+            for (Statement* s : get<Begin>(stmt->stmt).body)
+            {
+                this->statement(s);
+            }
+            break;
+        case StatementKind::If:
+            this->condition(get<If>(stmt->stmt).cond);
+            this->statement(get<If>(stmt->stmt).then);
+            break;
+        case StatementKind::While:
+            this->condition(get<While>(stmt->stmt).cond);
+            this->statement(get<While>(stmt->stmt).then);
+            break;
+        }
+    }
+
+    void condition(Condition* cond)
+    {
+        if (cond->kind() == ConditionKind::Odd)
+        {
+            this->expression(cond->odd().expr);
+        }
+        else
+        {
+            this->expression(cond->std().lhs);
+            this->expression(cond->std().rhs);
+        }
+    }
+
+    void expression(Expression* expr)
+    {
+        this->term(expr->lhs);
+        for (auto& item : expr->rhs)
+        {
+            this->term(item.second);
+        }
+    }
+
+    void term(Term* term)
+    {
+        this->factor(term->lhs);
+        for (auto& item : term->rhs)
+        {
+            this->factor(item.second);
+        }
+    }
+
+    void factor(Factor* factor)
+    {
+        switch (factor->kind())
+        {
+        case FactorKind::Num:
+            break;
+        case FactorKind::Name:
+        case FactorKind::Var:
+        {
+            // a Var is looked up again, since slots move when an edited program is resolved anew
+            int name = factor->kind() == FactorKind::Name ? factor->name() : factor->var().name;
+            const Binding& b = this->lookup(name);
+            if (b.kind == BindingKind::Const)
+            {
+                factor->value.emplace<0>(b.value);
+            }
+            else if (b.kind == BindingKind::Var)
+            {
+                factor->value.emplace<3>(b.ref);
+            }
+            else
+            {
+                throw "procedure " + string(this->symbols->name(name)) + " used as a value";
+            }
+            break;
+        }
+        case FactorKind::Expr:
+            this->expression(factor->expr());
+            break;
+        }
+    }
+};
+
+// Walks a resolved AST directly and is the reference semantics for every other
+// backend. Each call pushes a fresh frame for the callee's variables, and
+// display[level] holds the base of the innermost active frame of each lexical
+// level, so a VarRef is read at display[depth] + slot and recursive activations
+// keep their own locals. The caller's display entry is restored on return.
+// Arithmetic and limits match the VM.
+class AstInterpreter
+{
+public:
+    static const int FRAME_DEPTH = 4096;
+
+    vector<Value> frames;  // frames[0 .. vars of main) is the main program's frame
+    long long executed = 0;  // statements executed
+
+    AstInterpreter(const Program* program, int frameDepth = FRAME_DEPTH)
+    {
+        if (!program->resolved)
+        {
+            throw "program is not resolved";
+        }
+        this->prog = program;
+        this->frameDepth = frameDepth;
+    }
+
+    void reset()
+    {
+        this->frames.assign(this->prog->block->vars.size(), 0);
+        this->display.assign(this->prog->maxLevel + 1, 0);
+        this->depth = 0;
+        this->executed = 0;
+    }
+
+    void run()
+    {
+        this->reset();
+        this->statement(this->prog->block->stmt);
+    }
+
+    const Program* program() const { return this->prog; }
+
+private:
+    const Program* prog;
+    vector<size_t> display;
+    int frameDepth;
+    int depth;
+
+    Value& slot(const VarRef& ref)
+    {
+        return this->frames[this->display[ref.depth] + ref.slot];
+    }
+
+    void call(const Procedure* proc)
+    {
+        if (++this->depth > this->frameDepth)
+        {
+            throw "call stack overflow";
+        }
+        const Block* body = proc->body;
+        size_t saved = this->display[body->level];
+        size_t base = this->frames.size();
+        this->frames.resize(base + body->vars.size(), 0);
+        this->display[body->level] = base;
+
+        this->statement(body->stmt);
+
+        this->display[body->level] = saved;
+        this->frames.resize(base);
+        this->depth--;
+    }
+
+    void statement(const Statement* stmt)
+    {
+        this->executed++;
+        switch (stmt->kind())
+        {
+        case StatementKind::Assign:
+        {
+            const Assign& assign = stmt->assign();
+            Value v = this->expression(assign.expr);
+            this->slot(assign.target) = v;
+            break;
+        }
+        case StatementKind::Call:
+            this->call(this->prog->procs[stmt->call().proc]);
+            break;
+        case StatementKind::Begin:
+            for (const Statement* s : stmt->begin().body)
+            {
+                this->statement(s);
+            }
+            break;
+        case StatementKind::If:
+            if (this->condition(stmt->_if().cond))
+            {
+                this->statement(stmt->_if().then);
+            }
+            break;
+        case StatementKind::While:
+            while (this->condition(stmt->_while().cond))
+            {
+                this->statement(stmt->_while().then);
+            }
+            break;
+        }
+    }
+
+    bool condition(const Condition* cond)
+    {
+        if (cond->kind() == ConditionKind::Odd)
+        {
+            return this->expression(cond->odd().expr) & 1;
+        }
+        const StdCondition& std = cond->std();
+        Value lhs = this->expression(std.lhs);  // before rhs, so a checked build traps in source order
+        Value out;
+        foldBinary(std.op, lhs, this->expression(std.rhs), &out);
+        return out;
+    }
+
+    Value apply(TokenKind op, Value a, Value b)
+    {
+        Value out;
+        if (!foldBinary(op, a, b, &out))
+        {
+            if (op == TokenKind::Slash && b == 0)
+            {
+                throw "division by zero";
+            }
+            overflow();
+        }
+        return out;
+    }
+
+    Value expression(const Expression* expr)
+    {
+        Value v = this->term(expr->lhs);
+        if (expr->mod == TokenKind::Minus)
+        {
+            v = this->apply(TokenKind::Minus, 0, v);
+        }
+        for (auto& item : expr->rhs)
+        {
+            v = this->apply(item.first, v, this->term(item.second));
+        }
+        return v;
+    }
+
+    Value term(const Term* term)
+    {
+        Value v = this->factor(term->lhs);
+        for (auto& item : term->rhs)
+        {
+            v = this->apply(item.first, v, this->factor(item.second));
+        }
+        return v;
+    }
+
+    Value factor(const Factor* factor)
+    {
+        switch (factor->kind())
+        {
+        case FactorKind::Num:
+            return factor->num();
+        case FactorKind::Var:
+            return this->slot(factor->var());
+        case FactorKind::Expr:
+            return this->expression(factor->expr());
+        case FactorKind::Name:
+            break;
+        }
+        throw "unresolved name: " + string(this->prog->symbols->name(factor->name()));
+    }
+};
+
+ostream& operator<<(ostream& cout, const AstInterpreter& interp)
+{
+    const Program* program = interp.program();
+    const vector<int>& vars = program->block->vars;
+    for (size_t k = 0; k < vars.size(); k++)
+    {
+        cout << (k ? ", " : "") << program->symbols->name(vars[k]) << " = " << interp.frames[k];
+    }
+    cout << " (" << interp.executed << " statements)";
+    return cout;
+}
+
+class ClosureInterpreter;
+
+// A compiled expression or condition: `eval` is chosen for the node's exact shape
+// when the program is compiled and finds everything it needs in the node itself,
+// so evaluating it is one indirect call with no dispatch on AST kinds.
+struct ClosureExpr
+{
+    Value (*eval)(const ClosureExpr* self, ClosureInterpreter* vm);
+    const ClosureExpr* a;
+    const ClosureExpr* b;
+    Value k;       // a literal operand
+    Value* ptr;    // a main-program variable, bound once
+    uint32_t depth;
+    uint32_t slot;
+};
+
+struct ClosureStmt;
+
+// A compiled procedure. Calls point at it before its body is compiled, which lets
+// procedures call themselves.
+struct ClosureProc
+{
+    const ClosureStmt* body;
+    uint32_t level;
+    uint32_t size;
+};
+
+struct ClosureStmt
+{
+    void (*exec)(const ClosureStmt* self, ClosureInterpreter* vm);
+    const ClosureExpr* expr;       // assigned value, or the condition
+    const ClosureStmt* body;       // of an If or While
+    const ClosureStmt* const* list;  // of a Begin
+    const ClosureProc* proc;       // called
+    uint32_t count;
+    Value* ptr;
+    uint32_t depth;
+    uint32_t slot;
+};
+
+// Runs a resolved Program by first converting its AST into a tree of closures in
+// its own Arena: variables of the main program become pointers into a frame that
+// never moves, and the rest are display-relative slots. Each call gets the frame
+// kept for its call depth, so the display only ever holds stable pointers.
+// Arithmetic wraps, or traps, as in every other backend.
+class ClosureInterpreter
+{
+public:
+    static const int FRAME_DEPTH = 4096;
+
+    vector<vector<Value>> frames;  // frames[d]: the frame of the call at depth d; frames[0] is the main program's
+    vector<Value*> display;
+    int depth;
+    int frameDepth;
+    size_t nodes = 0;  // closures built
+
+    ClosureInterpreter(const Program* program, int frameDepth = FRAME_DEPTH)
+    {
+        if (!program->resolved)
+        {
+            throw "program is not resolved";
+        }
+        this->prog = program;
+        this->frameDepth = frameDepth;
+        this->frames.resize(frameDepth + 1);
+        this->frames[0].assign(program->block->vars.size(), 0);
+        this->display.assign(program->maxLevel + 1, nullptr);
+
+        this->procs.resize(program->procs.size());
+        for (size_t k = 0; k < program->procs.size(); k++)
+        {
+            const Block* body = program->procs[k]->body;
+            this->procs[k] = ClosureProc{nullptr, uint32_t(body->level), uint32_t(body->vars.size())};
+        }
+        for (size_t k = 0; k < program->procs.size(); k++)
+        {
+            this->procs[k].body = this->statement(program->procs[k]->body->stmt);
+        }
+        this->main = this->statement(program->block->stmt);
+    }
+
+    ClosureInterpreter(const ClosureInterpreter&) = delete;
+    ClosureInterpreter& operator=(const ClosureInterpreter&) = delete;
+
+    void reset()
+    {
+        fill(this->frames[0].begin(), this->frames[0].end(), 0);
+        fill(this->display.begin(), this->display.end(), nullptr);
+        this->display[0] = this->frames[0].data();
+        this->depth = 0;
+    }
+
+    void run()
+    {
+        this->reset();
+        this->main->exec(this->main, this);
+    }
+
+    const Program* program() const { return this->prog; }
+
+private:
+    const Program* prog;
+    Arena arena;
+    vector<ClosureProc> procs;
+    const ClosureStmt* main;
+
+    ClosureExpr* expr(Value (*eval)(const ClosureExpr*, ClosureInterpreter*), const ClosureExpr* a = nullptr, const ClosureExpr* b = nullptr)
+    {
+        this->nodes++;
+        return this->arena.make<ClosureExpr>(ClosureExpr{eval, a, b, 0, nullptr, 0, 0});
+    }
+
+    ClosureStmt* stmt(void (*exec)(const ClosureStmt*, ClosureInterpreter*))
+    {
+        this->nodes++;
+        return this->arena.make<ClosureStmt>(ClosureStmt{exec, nullptr, nullptr, nullptr, nullptr, 0, nullptr, 0, 0});
+    }
+
+    static Value literal(const ClosureExpr* self, ClosureInterpreter*)
+    {
+        return self->k;
+    }
+
+    static Value checkedDivide(Value a, Value b)
+    {
+        if (b == 0)
+        {
+            throw "division by zero";
+        }
+        return divide(a, b);
+    }
+
+    const ClosureStmt* statement(const Statement* s)
+    {
+        switch (s->kind())
+        {
+        case StatementKind::Assign:
+        {
+            const VarRef& target = s->assign().target;
+            ClosureStmt* node;
+            if (target.depth == 0)
+            {
+                node = this->stmt([](const ClosureStmt* self, ClosureInterpreter* vm)
+                {
+                    *self->ptr = self->expr->eval(self->expr, vm);
+                });
+                node->ptr = &this->frames[0][target.slot];
+            }
+            else
+            {
+                node = this->stmt([](const ClosureStmt* self, ClosureInterpreter* vm)
+                {
+                    Value v = self->expr->eval(self->expr, vm);
+                    vm->display[self->depth][self->slot] = v;
+                });
+                node->depth = target.depth;
+                node->slot = target.slot;
+            }
+            node->expr = this->expression(s->assign().expr);
+            return node;
+        }
+        case StatementKind::Call:
+        {
+            ClosureStmt* node = this->stmt([](const ClosureStmt* self, ClosureInterpreter* vm)
+            {
+                const ClosureProc* proc = self->proc;
+                if (++vm->depth > vm->frameDepth)
+                {
+                    throw "call stack overflow";
+                }
+                vector<Value>& frame = vm->frames[vm->depth];
+                frame.assign(proc->size, 0);
+                Value* saved = vm->display[proc->level];
+                vm->display[proc->level] = frame.data();
+                proc->body->exec(proc->body, vm);
+                vm->display[proc->level] = saved;
+                vm->depth--;
+            });
+            node->proc = &this->procs[s->call().proc];
+            return node;
+        }
+        case StatementKind::Begin:
+        {
+            const vector<Statement*>& body = s->begin().body;
+            if (body.size() == 1)
+            {
+                return this->statement(body[0]);
+            }
+            ClosureStmt* node = this->stmt([](const ClosureStmt* self, ClosureInterpreter* vm)
+            {
+                for (uint32_t k = 0; k < self->count; k++)
+                {
+                    self->list[k]->exec(self->list[k], vm);
+                }
+            });
+            const ClosureStmt** list = static_cast<const ClosureStmt**>(
+                this->arena.allocate(body.size() * sizeof(ClosureStmt*), alignof(ClosureStmt*)));
+            for (size_t k = 0; k < body.size(); k++)
+            {
+                list[k] = this->statement(body[k]);
+            }
+            node->list = list;
+            node->count = body.size();
+            return node;
+        }
+        case StatementKind::If:
+        {
+            ClosureStmt* node = this->stmt([](const ClosureStmt* self, ClosureInterpreter* vm)
+            {
+                if (self->expr->eval(self->expr, vm))
+                {
+                    self->body->exec(self->body, vm);
+                }
+            });
+            node->expr = this->condition(s->_if().cond);
+            node->body = this->statement(s->_if().then);
+            return node;
+        }
+        case StatementKind::While:
+        {
+            ClosureStmt* node = this->stmt([](const ClosureStmt* self, ClosureInterpreter* vm)
+            {
+                while (self->expr->eval(self->expr, vm))
+                {
+                    self->body->exec(self->body, vm);
+                }
+            });
+            node->expr = this->condition(s->_while().cond);
+            node->body = this->statement(s->_while().then);
+            return node;
+        }
+        }
+        throw "unknown statement";
+    }
+
+    const ClosureExpr* condition(const Condition* cond)
+    {
+        if (cond->kind() == ConditionKind::Odd)
+        {
+            return this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                return self->a->eval(self->a, vm) & 1;
+            }, this->expression(cond->odd().expr));
+        }
+
+        const StdCondition& std = cond->std();
+        const ClosureExpr* lhs = this->expression(std.lhs);
+        const ClosureExpr* rhs = this->expression(std.rhs);
+        switch (std.op)
+        {
+        case TokenKind::Eq:
+            return this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                Value a = self->a->eval(self->a, vm);
+                return a == self->b->eval(self->b, vm);
+            }, lhs, rhs);
+        case TokenKind::Ne:
+            return this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                Value a = self->a->eval(self->a, vm);
+                return a != self->b->eval(self->b, vm);
+            }, lhs, rhs);
+        case TokenKind::Lt:
+            return this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                Value a = self->a->eval(self->a, vm);
+                return a < self->b->eval(self->b, vm);
+            }, lhs, rhs);
+        case TokenKind::Lte:
+            return this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                Value a = self->a->eval(self->a, vm);
+                return a <= self->b->eval(self->b, vm);
+            }, lhs, rhs);
+        case TokenKind::Gt:
+            return this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                Value a = self->a->eval(self->a, vm);
+                return a > self->b->eval(self->b, vm);
+            }, lhs, rhs);
+        case TokenKind::Gte:
+            return this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                Value a = self->a->eval(self->a, vm);
+                return a >= self->b->eval(self->b, vm);
+            }, lhs, rhs);
+        default:
+            throw "unknown condition";
+        }
+    }
+
+    const ClosureExpr* expression(const Expression* e)
+    {
+        const ClosureExpr* v = this->term(e->lhs);
+        if (e->mod == TokenKind::Minus)
+        {
+            v = this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                return negValue(self->a->eval(self->a, vm));
+            }, v);
+        }
+        for (auto& item : e->rhs)
+        {
+            v = this->binary(item.first, v, this->term(item.second));
+        }
+        return v;
+    }
+
+    const ClosureExpr* term(const Term* t)
+    {
+        const ClosureExpr* v = this->factor(t->lhs);
+        for (auto& item : t->rhs)
+        {
+            v = this->binary(item.first, v, this->factor(item.second));
+        }
+        return v;
+    }
+
+    const ClosureExpr* factor(const Factor* f)
+    {
+        switch (f->kind())
+        {
+        case FactorKind::Num:
+        {
+            ClosureExpr* node = this->expr(&ClosureInterpreter::literal);
+            node->k = f->num();
+            return node;
+        }
+        case FactorKind::Var:
+        {
+            const VarRef& ref = f->var();
+            ClosureExpr* node;
+            if (ref.depth == 0)
+            {
+                node = this->expr([](const ClosureExpr* self, ClosureInterpreter*) -> Value
+                {
+                    return *self->ptr;
+                });
+                node->ptr = &this->frames[0][ref.slot];
+            }
+            else
+            {
+                node = this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+                {
+                    return vm->display[self->depth][self->slot];
+                });
+                node->depth = ref.depth;
+                node->slot = ref.slot;
+            }
+            return node;
+        }
+        case FactorKind::Expr:
+            return this->expression(f->expr());
+        case FactorKind::Name:
+            break;
+        }
+        throw "unresolved name: " + string(this->prog->symbols->name(f->name()));
+    }
+
+    // A binary operator, specialized for a literal right operand, which is how
+    // loop counters and scaled values usually look.
+    const ClosureExpr* binary(TokenKind op, const ClosureExpr* lhs, const ClosureExpr* rhs)
+    {
+        bool literal = rhs->eval == &ClosureInterpreter::literal;
+        ClosureExpr* node;
+        switch (op)
+        {
+        case TokenKind::Plus:
+            node = literal ? this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                return addValue(self->a->eval(self->a, vm), self->k);
+            }, lhs) : this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                Value a = self->a->eval(self->a, vm);
+                return addValue(a, self->b->eval(self->b, vm));
+            }, lhs, rhs);
+            break;
+        case TokenKind::Minus:
+            node = literal ? this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                return subValue(self->a->eval(self->a, vm), self->k);
+            }, lhs) : this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                Value a = self->a->eval(self->a, vm);
+                return subValue(a, self->b->eval(self->b, vm));
+            }, lhs, rhs);
+            break;
+        case TokenKind::Times:
+            node = literal ? this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                return mulValue(self->a->eval(self->a, vm), self->k);
+            }, lhs) : this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                Value a = self->a->eval(self->a, vm);
+                return mulValue(a, self->b->eval(self->b, vm));
+            }, lhs, rhs);
+            break;
+        case TokenKind::Slash:
+            node = this->expr([](const ClosureExpr* self, ClosureInterpreter* vm) -> Value
+            {
+                Value a = self->a->eval(self->a, vm);
+                return checkedDivide(a, self->b->eval(self->b, vm));
+            }, lhs, rhs);
+            break;
+        default:
+            throw "unknown operator";
+        }
+        if (literal && op != TokenKind::Slash)
+        {
+            node->k = rhs->k;
+        }
+        return node;
+    }
+};
+
+ostream& operator<<(ostream& cout, const ClosureInterpreter& interp)
+{
+    const Program* program = interp.program();
+    const vector<int>& vars = program->block->vars;
+    for (size_t k = 0; k < vars.size(); k++)
+    {
+        cout << (k ? ", " : "") << program->symbols->name(vars[k]) << " = " << interp.frames[0][k];
+    }
+    cout << " (" << interp.nodes << " closures)";
+    return cout;
+}
+
+// Opcodes of the stack IR. The numbering follows IrOpCode in pl0.py; Call and Ret
+// are added for procedures. DefVar/DefLit/DefProc are kept for parity only: the
+// C++ compiler resolves declarations to slots and literals and never emits them.
+// The superinstructions from IncVar on are only produced by Peephole.
+enum class IrOpCode : uint8_t
+{
+    Add = 0,
+    Sub = 1,
+    Mul = 2,
+    Div = 3,
+    Neg = 4,
+    Eq = 5,
+    Ne = 6,
+    Lt = 7,
+    Lte = 8,
+    Gt = 9,
+    Gte = 10,
+    Odd = 11,
+    LoadVar = 12,
+    LoadLit = 13,
+    Store = 14,
+    Jump = 15,
+    BrFalse = 16,
+    DefVar = 17,
+    DefLit = 18,
+    DefProc = 19,
+    Call = 20,
+    Ret = 21,
+    IncVar = 22,             // var arg += arg2
+    MoveVar = 23,            // var arg = var arg2
+    StoreLit = 24,           // var arg = arg2
+    AddVar = 25,             // top += var arg
+    AddLit = 26,             // top += arg
+    LoadVarLoadVarMul = 27,  // push var arg * var arg2
+    CmpLitBranchEq = 28,     // pop top, jump to arg unless top == arg2
+    CmpLitBranchNe = 29,
+    CmpLitBranchLt = 30,
+    CmpLitBranchLte = 31,
+    CmpLitBranchGt = 32,
+    CmpLitBranchGte = 33,
+    Input = 100,
+    Output = 101,
+    Halt = 255,
+};
+
+string_view irOpCodeName(IrOpCode op)
+{
+    switch (op)
+    {
+    case IrOpCode::Add: return "Add";
+    case IrOpCode::Sub: return "Sub";
+    case IrOpCode::Mul: return "Mul";
+    case IrOpCode::Div: return "Div";
+    case IrOpCode::Neg: return "Neg";
+    case IrOpCode::Eq: return "Eq";
+    case IrOpCode::Ne: return "Ne";
+    case IrOpCode::Lt: return "Lt";
+    case IrOpCode::Lte: return "Lte";
+    case IrOpCode::Gt: return "Gt";
+    case IrOpCode::Gte: return "Gte";
+    case IrOpCode::Odd: return "Odd";
+    case IrOpCode::LoadVar: return "LoadVar";
+    case IrOpCode::LoadLit: return "LoadLit";
+    case IrOpCode::Store: return "Store";
+    case IrOpCode::Jump: return "Jump";
+    case IrOpCode::BrFalse: return "BrFalse";
+    case IrOpCode::DefVar: return "DefVar";
+    case IrOpCode::DefLit: return "DefLit";
+    case IrOpCode::DefProc: return "DefProc";
+    case IrOpCode::Call: return "Call";
+    case IrOpCode::Ret: return "Ret";
+    case IrOpCode::IncVar: return "IncVar";
+    case IrOpCode::MoveVar: return "MoveVar";
+    case IrOpCode::StoreLit: return "StoreLit";
+    case IrOpCode::AddVar: return "AddVar";
+    case IrOpCode::AddLit: return "AddLit";
+    case IrOpCode::LoadVarLoadVarMul: return "LoadVarLoadVarMul";
+    case IrOpCode::CmpLitBranchEq: return "CmpLitBranchEq";
+    case IrOpCode::CmpLitBranchNe: return "CmpLitBranchNe";
+    case IrOpCode::CmpLitBranchLt: return "CmpLitBranchLt";
+    case IrOpCode::CmpLitBranchLte: return "CmpLitBranchLte";
+    case IrOpCode::CmpLitBranchGt: return "CmpLitBranchGt";
+    case IrOpCode::CmpLitBranchGte: return "CmpLitBranchGte";
+    case IrOpCode::Input: return "Input";
+    case IrOpCode::Output: return "Output";
+    case IrOpCode::Halt: return "Halt";
+    }
+    return "?";
+}
+
+// Net change in operand stack depth caused by executing `op`.
+int stackEffect(IrOpCode op)
+{
+    switch (op)
+    {
+    case IrOpCode::LoadVar:
+    case IrOpCode::LoadLit:
+    case IrOpCode::LoadVarLoadVarMul:
+    case IrOpCode::Input:
+        return 1;
+    case IrOpCode::Add:
+    case IrOpCode::Sub:
+    case IrOpCode::Mul:
+    case IrOpCode::Div:
+    case IrOpCode::Eq:
+    case IrOpCode::Ne:
+    case IrOpCode::Lt:
+    case IrOpCode::Lte:
+    case IrOpCode::Gt:
+    case IrOpCode::Gte:
+    case IrOpCode::Store:
+    case IrOpCode::BrFalse:
+    case IrOpCode::CmpLitBranchEq:
+    case IrOpCode::CmpLitBranchNe:
+    case IrOpCode::CmpLitBranchLt:
+    case IrOpCode::CmpLitBranchLte:
+    case IrOpCode::CmpLitBranchGt:
+    case IrOpCode::CmpLitBranchGte:
+    case IrOpCode::Output:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+// One instruction: LoadVar/Store take a variable, slot `arg` of the frame at
+// lexical level `depth`; LoadLit a value; Jump/BrFalse an absolute code index.
+// Call takes the callee's entry in arg, its frame size in arg2 and its level in
+// depth. Superinstructions use arg2, and depth2 when it is a second variable.
+// Plain data, so a code array can be copied or mapped as is.
+struct Ir
+{
+    IrOpCode op;
+    Value arg;
+    Value arg2;
+    uint32_t depth;
+    uint32_t depth2;
+};
+
+inline bool isCmpLitBranch(IrOpCode op)
+{
+    return op >= IrOpCode::CmpLitBranchEq && op <= IrOpCode::CmpLitBranchGte;
+}
+
+// True for instructions whose arg is a code index.
+inline bool isBranch(IrOpCode op)
+{
+    return op == IrOpCode::Jump || op == IrOpCode::BrFalse || op == IrOpCode::Call || isCmpLitBranch(op);
+}
+
+// A procedure's code and frame, indexed by Procedure::index.
+struct ProcInfo
+{
+    int name;
+    int entry;
+    int parent;     // enclosing procedure, or -1 for the main program
+    int level;      // Block::level of the body
+    int firstSlot;  // Block::firstSlot of the body
+    int size;       // variables in the body's frame
+};
+
+// The compiled form of a Program: one contiguous code array whose main body starts
+// at index 0 and ends with Halt, followed by the procedure bodies in preorder, each
+// ending with Ret and followed by the procedures nested in it.
+class Bytecode
+{
+public:
+    vector<Ir> code;
+    vector<ProcInfo> procs;
+    vector<int> slotNames;  // symbol id of the variable with each static slot
+    const SymbolTable* symbols;
+    int globals;   // variables in the main program's frame, static slots 0 .. globals
+    int maxStack;  // deepest operand stack any instruction sequence can reach
+
+    Bytecode()
+    {
+        this->symbols = nullptr;
+        this->globals = 0;
+        this->maxStack = 0;
+    }
+
+    int slotCount() const
+    {
+        return this->slotNames.size();
+    }
+
+    // The static slot of the variable that code in procedure `proc` (-1 for main)
+    // addresses as slot `slot` of the frame at lexical level `depth`.
+    int staticSlot(int proc, uint32_t depth, Value slot) const
+    {
+        while (proc >= 0 && this->procs[proc].level > int(depth))
+        {
+            proc = this->procs[proc].parent;
+        }
+        return (proc < 0 ? 0 : this->procs[proc].firstSlot) + int(slot);
+    }
+};
+
+// Lowers a resolved AST to Bytecode. Variables are addressed relative to the
+// frame of their declaring block, by VarRef::depth and VarRef::slot, so every
+// activation of a procedure gets its own locals; calls go through the
+// Procedure::index entry table.
+class Compiler
+{
+public:
+    Compiler(Bytecode* out)
+    {
+        this->out = out;
+    }
+
+    void program(const Program* program)
+    {
+        if (!program->resolved)
+        {
+            throw "program is not resolved";
+        }
+        this->out->symbols = program->symbols;
+        this->out->slotNames.resize(program->slotCount);
+        this->out->globals = program->block->vars.size();
+        for (const Procedure* proc : program->procs)
+        {
+            const Block* body = proc->body;
+            this->out->procs.push_back(ProcInfo{proc->name, -1, -1, body->level, body->firstSlot, int(body->vars.size())});
+        }
+        this->block(program->block, -1, IrOpCode::Halt);
+
+        for (Ir& ir : this->out->code)
+        {
+            if (ir.op == IrOpCode::Call)
+            {
+                const ProcInfo& callee = this->out->procs[ir.arg];
+                ir = Ir{IrOpCode::Call, callee.entry, callee.size, uint32_t(callee.level), 0};
+            }
+        }
+    }
+
+private:
+    Bytecode* out;
+    int depth = 0;  // operand stack depth after the last emitted instruction
+
+    int emit(IrOpCode op, Value arg = 0, uint32_t depth = 0)
+    {
+        this->depth += stackEffect(op);
+        this->out->maxStack = max(this->out->maxStack, this->depth);
+        this->out->code.push_back(Ir{op, arg, 0, depth, 0});
+        return this->out->code.size() - 1;
+    }
+
+    void block(const Block* block, int index, IrOpCode terminator)
+    {
+        for (size_t k = 0; k < block->vars.size(); k++)
+        {
+            this->out->slotNames[block->firstSlot + k] = block->vars[k];
+        }
+
+        this->statement(block->stmt);
+        this->emit(terminator);
+
+        for (const Procedure* proc : block->procs)
+        {
+            this->out->procs[proc->index].entry = this->out->code.size();
+            this->out->procs[proc->index].parent = index;
+            this->block(proc->body, proc->index, IrOpCode::Ret);
+        }
+    }
+
+    void statement(const Statement* stmt)
+    {
+        switch (stmt->kind())
+        {
+        case StatementKind::Assign:
+        {
+            const Assign& assign = stmt->assign();
+            this->expression(assign.expr);
+            this->emit(IrOpCode::Store, assign.target.slot, assign.target.depth);
+            break;
+        }
+        case StatementKind::Call:
+            this->emit(IrOpCode::Call, stmt->call().proc);
+            break;
+        case StatementKind::Begin:
+            for (const Statement* s : stmt->begin().body)
+            {
+                this->statement(s);
+            }
+            break;
+        case StatementKind::If:
+        {
+            const If& _if = stmt->_if();
+            this->condition(_if.cond);
+            int br = this->emit(IrOpCode::BrFalse);
+            this->statement(_if.then);
+            this->out->code[br].arg = this->out->code.size();
+            break;
+        }
+        case StatementKind::While:
+        {
+            const While& _while = stmt->_while();
+            int head = this->out->code.size();
+            this->condition(_while.cond);
+            int br = this->emit(IrOpCode::BrFalse);
+            this->statement(_while.then);
+            this->emit(IrOpCode::Jump, head);
+            this->out->code[br].arg = this->out->code.size();
+            break;
+        }
+        }
+    }
+
+    void condition(const Condition* cond)
+    {
+        switch (cond->kind())
+        {
+        case ConditionKind::Odd:
+            this->expression(cond->odd().expr);
+            this->emit(IrOpCode::Odd);
+            break;
+        case ConditionKind::Std:
+        {
+            const StdCondition& std = cond->std();
+            this->expression(std.lhs);
+            this->expression(std.rhs);
+            switch (std.op)
+            {
+            case TokenKind::Eq: this->emit(IrOpCode::Eq); break;
+            case TokenKind::Ne: this->emit(IrOpCode::Ne); break;
+            case TokenKind::Lt: this->emit(IrOpCode::Lt); break;
+            case TokenKind::Lte: this->emit(IrOpCode::Lte); break;
+            case TokenKind::Gt: this->emit(IrOpCode::Gt); break;
+            case TokenKind::Gte: this->emit(IrOpCode::Gte); break;
+            default: throw "invalid std condition operator";
+            }
+            break;
+        }
+        }
+    }
+
+    void expression(const Expression* expr)
+    {
+        this->term(expr->lhs);
+
+        if (expr->mod == TokenKind::Minus)
+        {
+            this->emit(IrOpCode::Neg);
+        }
+
+        for (auto& item : expr->rhs)
+        {
+            this->term(item.second);
+            this->emit(item.first == TokenKind::Plus ? IrOpCode::Add : IrOpCode::Sub);
+        }
+    }
+
+    void term(const Term* term)
+    {
+        this->factor(term->lhs);
+
+        for (auto& item : term->rhs)
+        {
+            this->factor(item.second);
+            this->emit(item.first == TokenKind::Times ? IrOpCode::Mul : IrOpCode::Div);
+        }
+    }
+
+    void factor(const Factor* factor)
+    {
+        switch (factor->kind())
+        {
+        case FactorKind::Num:
+            this->emit(IrOpCode::LoadLit, factor->num());
+            break;
+        case FactorKind::Var:
+            this->emit(IrOpCode::LoadVar, factor->var().slot, factor->var().depth);
+            break;
+        case FactorKind::Name:
+            throw "unresolved name: " + string(this->out->symbols->name(factor->name()));
+        case FactorKind::Expr:
+            this->expression(factor->expr());
+            break;
+        }
+    }
+};
+
+ostream& operator<<(ostream& cout, const Bytecode& bc)
+{
+    cout << "slots: " << bc.slotCount() << ", procs: " << bc.procs.size() << ", code: " << bc.code.size()
+         << ", max stack: " << bc.maxStack << endl;
+
+    int owner = -1;
+    for (size_t pc = 0; pc < bc.code.size(); pc++)
+    {
+        for (size_t k = 0; k < bc.procs.size(); k++)
+        {
+            if (bc.procs[k].entry == (int)pc)
+            {
+                cout << bc.symbols->name(bc.procs[k].name) << ":" << endl;
+                owner = k;
+            }
+        }
+
+        // a variable as depth:slot and its name
+        auto var = [&](uint32_t depth, Value slot)
+        {
+            cout << depth << ":" << slot << " (" << bc.symbols->name(bc.slotNames[bc.staticSlot(owner, depth, slot)]) << ")";
+        };
+
+        const Ir& ir = bc.code[pc];
+        cout << "  " << pc << "\t" << irOpCodeName(ir.op);
+        switch (ir.op)
+        {
+        case IrOpCode::LoadVar:
+        case IrOpCode::Store:
+        case IrOpCode::AddVar:
+            cout << "\t";
+            var(ir.depth, ir.arg);
+            break;
+        case IrOpCode::LoadLit:
+        case IrOpCode::Jump:
+        case IrOpCode::BrFalse:
+        case IrOpCode::AddLit:
+            cout << "\t" << ir.arg;
+            break;
+        case IrOpCode::Call:
+            cout << "\t" << ir.arg << ", frame " << ir.arg2;
+            break;
+        case IrOpCode::IncVar:
+        case IrOpCode::StoreLit:
+            cout << "\t";
+            var(ir.depth, ir.arg);
+            cout << ", " << ir.arg2;
+            break;
+        case IrOpCode::MoveVar:
+        case IrOpCode::LoadVarLoadVarMul:
+            cout << "\t";
+            var(ir.depth, ir.arg);
+            cout << ", ";
+            var(ir.depth2, ir.arg2);
+            break;
+        case IrOpCode::CmpLitBranchEq:
+        case IrOpCode::CmpLitBranchNe:
+        case IrOpCode::CmpLitBranchLt:
+        case IrOpCode::CmpLitBranchLte:
+        case IrOpCode::CmpLitBranchGt:
+        case IrOpCode::CmpLitBranchGte:
+            cout << "\t" << ir.arg2 << ", " << ir.arg;
+            break;
+        default:
+            break;
+        }
+        cout << endl;
+    }
+    return cout;
+}
+
+enum class PeepholePattern
+{
+    IncVar,             // LoadVar s; LoadLit k; Add|Sub; Store s
+    CmpLitBranch,       // LoadLit k; <cmp>; BrFalse t
+    LoadVarLoadVarMul,  // LoadVar a; LoadVar b; Mul
+    MoveVar,            // LoadVar a; Store b
+    StoreLit,           // LoadLit k; Store s
+    AddVar,             // LoadVar s; Add
+    AddLit,             // LoadLit k; Add|Sub
+    JumpThreading,      // branch to a Jump, or Jump to Ret/Halt
+    JumpToNext,         // Jump to the next live instruction
+    DeadCode,           // instruction unreachable from main or any procedure entry
+    Count,
+};
+
+constexpr string_view PEEPHOLE_PATTERN_NAMES[] =
+{
+    "IncVar",
+    "CmpLitBranch",
+    "LoadVarLoadVarMul",
+    "MoveVar",
+    "StoreLit",
+    "AddVar",
+    "AddLit",
+    "JumpThreading",
+    "JumpToNext",
+    "DeadCode",
+};
+
+static_assert(sizeof(PEEPHOLE_PATTERN_NAMES) / sizeof(PEEPHOLE_PATTERN_NAMES[0]) == static_cast<int>(PeepholePattern::Count),
+              "PEEPHOLE_PATTERN_NAMES out of sync with PeepholePattern");
+
+// Optimizes Bytecode in place: threads jumps, removes unreachable code and jumps to
+// the next instruction, then fuses common sequences into superinstructions. A
+// sequence is only fused when none of its instructions but the first is a branch
+// target. hits counts how often each pattern applied.
+class Peephole
+{
+public:
+    array<int, static_cast<int>(PeepholePattern::Count)> hits{};
+
+    Peephole(Bytecode* bc)
+    {
+        this->bc = bc;
+    }
+
+    void run()
+    {
+        this->threadJumps();
+        this->removeDeadCode();
+        this->fuse();
+    }
+
+private:
+    Bytecode* bc;
+
+    void hit(PeepholePattern pattern)
+    {
+        this->hits[static_cast<int>(pattern)]++;
+    }
+
+    void threadJumps()
+    {
+        vector<Ir>& code = this->bc->code;
+        for (Ir& ir : code)
+        {
+            if (ir.op != IrOpCode::Jump && ir.op != IrOpCode::BrFalse)
+            {
+                continue;
+            }
+
+            int target = ir.arg;
+            for (size_t steps = 0; code[target].op == IrOpCode::Jump && steps < code.size(); steps++)
+            {
+                target = code[target].arg;
+            }
+            if (target != ir.arg)
+            {
+                this->hit(PeepholePattern::JumpThreading);
+                ir.arg = target;
+            }
+
+            if (ir.op == IrOpCode::Jump && (code[target].op == IrOpCode::Ret || code[target].op == IrOpCode::Halt))
+            {
+                this->hit(PeepholePattern::JumpThreading);
+                ir = code[target];
+            }
+        }
+    }
+
+    void removeDeadCode()
+    {
+        const vector<Ir>& code = this->bc->code;
+        vector<bool> keep(code.size(), false);
+        vector<int> work = { 0 };
+        for (const ProcInfo& proc : this->bc->procs)
+        {
+            work.push_back(proc.entry);
+        }
+
+        while (!work.empty())
+        {
+            int pc = work.back();
+            work.pop_back();
+
+            for (; pc < (int)code.size() && !keep[pc]; pc++)
+            {
+                keep[pc] = true;
+                IrOpCode op = code[pc].op;
+                if (op == IrOpCode::BrFalse || isCmpLitBranch(op))
+                {
+                    work.push_back(code[pc].arg);
+                }
+                else if (op == IrOpCode::Jump)
+                {
+                    work.push_back(code[pc].arg);
+                    break;
+                }
+                else if (op == IrOpCode::Ret || op == IrOpCode::Halt)
+                {
+                    break;
+                }
+            }
+        }
+
+        for (size_t pc = 0; pc < code.size(); pc++)
+        {
+            if (!keep[pc])
+            {
+                this->hit(PeepholePattern::DeadCode);
+            }
+        }
+
+        for (size_t pc = 0; pc < code.size(); pc++)
+        {
+            if (keep[pc] && code[pc].op == IrOpCode::Jump && code[pc].arg > (int)pc
+                && find(keep.begin() + pc + 1, keep.begin() + code[pc].arg, true) == keep.begin() + code[pc].arg)
+            {
+                this->hit(PeepholePattern::JumpToNext);
+                keep[pc] = false;
+            }
+        }
+
+        vector<int> newIndex(code.size() + 1);
+        vector<Ir> out;
+        for (size_t pc = 0; pc < code.size(); pc++)
+        {
+            newIndex[pc] = out.size();
+            if (keep[pc])
+            {
+                out.push_back(code[pc]);
+            }
+        }
+        newIndex[code.size()] = out.size();
+        this->relocate(out, newIndex);
+    }
+
+    void fuse()
+    {
+        const vector<Ir>& code = this->bc->code;
+        size_t n = code.size();
+
+        vector<bool> target(n + 1, false);
+        for (const Ir& ir : code)
+        {
+            if (isBranch(ir.op))
+            {
+                target[ir.arg] = true;
+            }
+        }
+        for (const ProcInfo& proc : this->bc->procs)
+        {
+            target[proc.entry] = true;
+        }
+
+        // matches `ops` at pc with no branch target inside the sequence
+        auto at = [&](size_t pc, initializer_list<IrOpCode> ops)
+        {
+            if (pc + ops.size() > n)
+            {
+                return false;
+            }
+            size_t k = 0;
+            for (IrOpCode op : ops)
+            {
+                if (code[pc + k].op != op || (k > 0 && target[pc + k]))
+                {
+                    return false;
+                }
+                k++;
+            }
+            return true;
+        };
+        auto negate = [](Value k)
+        {
+            return static_cast<Value>(ValueBits(0) - ValueBits(k));
+        };
+        // x - k is x + -k unless checked arithmetic cannot negate k
+        auto negatable = [](Value k)
+        {
+            return !VALUE_CHECKED || k != numeric_limits<Value>::min();
+        };
+
+        vector<int> newIndex(n + 1);
+        vector<Ir> out;
+        size_t pc = 0;
+
+        while (pc < n)
+        {
+            size_t len = 1;
+            Ir fused = code[pc];
+            IrOpCode op1 = pc + 1 < n ? code[pc + 1].op : IrOpCode::Halt;
+            IrOpCode op2 = pc + 2 < n ? code[pc + 2].op : IrOpCode::Halt;
+
+            if ((at(pc, { IrOpCode::LoadVar, IrOpCode::LoadLit, IrOpCode::Add, IrOpCode::Store })
+                 || (at(pc, { IrOpCode::LoadVar, IrOpCode::LoadLit, IrOpCode::Sub, IrOpCode::Store }) && negatable(code[pc + 1].arg)))
+                && code[pc].arg == code[pc + 3].arg && code[pc].depth == code[pc + 3].depth)
+            {
+                Value k = code[pc + 1].arg;
+                fused = Ir{IrOpCode::IncVar, code[pc].arg, op2 == IrOpCode::Add ? k : negate(k), code[pc].depth, 0};
+                len = 4;
+                this->hit(PeepholePattern::IncVar);
+            }
+            else if (code[pc].op == IrOpCode::LoadLit && op1 >= IrOpCode::Eq && op1 <= IrOpCode::Gte
+                     && at(pc, { IrOpCode::LoadLit, op1, IrOpCode::BrFalse }))
+            {
+                int offset = static_cast<int>(op1) - static_cast<int>(IrOpCode::Eq);
+                fused = Ir{static_cast<IrOpCode>(static_cast<int>(IrOpCode::CmpLitBranchEq) + offset), code[pc + 2].arg, code[pc].arg, 0, 0};
+                len = 3;
+                this->hit(PeepholePattern::CmpLitBranch);
+            }
+            else if (at(pc, { IrOpCode::LoadVar, IrOpCode::LoadVar, IrOpCode::Mul }))
+            {
+                fused = Ir{IrOpCode::LoadVarLoadVarMul, code[pc].arg, code[pc + 1].arg, code[pc].depth, code[pc + 1].depth};
+                len = 3;
+                this->hit(PeepholePattern::LoadVarLoadVarMul);
+            }
+            else if (at(pc, { IrOpCode::LoadVar, IrOpCode::Store }))
+            {
+                fused = Ir{IrOpCode::MoveVar, code[pc + 1].arg, code[pc].arg, code[pc + 1].depth, code[pc].depth};
+                len = 2;
+                this->hit(PeepholePattern::MoveVar);
+            }
+            else if (at(pc, { IrOpCode::LoadLit, IrOpCode::Store }))
+            {
+                fused = Ir{IrOpCode::StoreLit, code[pc + 1].arg, code[pc].arg, code[pc + 1].depth, 0};
+                len = 2;
+                this->hit(PeepholePattern::StoreLit);
+            }
+            else if (at(pc, { IrOpCode::LoadVar, IrOpCode::Add }))
+            {
+                fused = Ir{IrOpCode::AddVar, code[pc].arg, 0, code[pc].depth, 0};
+                len = 2;
+                this->hit(PeepholePattern::AddVar);
+            }
+            else if (at(pc, { IrOpCode::LoadLit, IrOpCode::Add }) || (at(pc, { IrOpCode::LoadLit, IrOpCode::Sub }) && negatable(code[pc].arg)))
+            {
+                Value k = code[pc].arg;
+                fused = Ir{IrOpCode::AddLit, op1 == IrOpCode::Add ? k : negate(k), 0, 0, 0};
+                len = 2;
+                this->hit(PeepholePattern::AddLit);
+            }
+
+            for (size_t k = 0; k < len; k++)
+            {
+                newIndex[pc + k] = out.size();
+            }
+            out.push_back(fused);
+            pc += len;
+        }
+        newIndex[n] = out.size();
+        this->relocate(out, newIndex);
+    }
+
+    // Installs `out` as the new code, mapping every branch target and procedure
+    // entry through `newIndex` (old index -> new index).
+    void relocate(vector<Ir>& out, const vector<int>& newIndex)
+    {
+        for (Ir& ir : out)
+        {
+            if (isBranch(ir.op))
+            {
+                ir.arg = newIndex[ir.arg];
+            }
+        }
+        for (ProcInfo& proc : this->bc->procs)
+        {
+            proc.entry = newIndex[proc.entry];
+        }
+        this->bc->code.swap(out);
+    }
+};
+
+ostream& operator<<(ostream& cout, const Peephole& peephole)
+{
+    bool first = true;
+    for (int p = 0; p < static_cast<int>(PeepholePattern::Count); p++)
+    {
+        if (peephole.hits[p] > 0)
+        {
+            cout << (first ? "" : ", ") << PEEPHOLE_PATTERN_NAMES[p] << " " << peephole.hits[p];
+            first = false;
+        }
+    }
+    if (first)
+    {
+        cout << "no patterns applied";
+    }
+    return cout;
+}
+
+// The VM dispatches with GCC/Clang labels-as-values (direct threading) unless
+// built with -DPL0_SWITCH_DISPATCH, which selects the portable switch loop.
+#if defined(__GNUC__) && !defined(PL0_SWITCH_DISPATCH)
+#define PL0_THREADED_DISPATCH 1
+#endif
+
+// Executes Bytecode. Variables live in frames stacked in `slots`, the main
+// program's first; each Call pushes a zeroed frame for the callee and points
+// display[level] at it, saving the caller's entry with the return address, and
+// Ret pops both, so a variable is display[depth][slot]. The operand stack is sized
+// from Bytecode::maxStack and at most `frameDepth` calls can be active; frame
+// memory only grows when a deeper call needs it, so a warm run() never allocates.
+class VM
+{
+public:
+    static const int FRAME_DEPTH = 4096;
+
+    vector<Value> slots;  // slots[0 .. globals) is the main program's frame
+    long long executed;   // instructions dispatched by the last run()
+
+    VM(const Bytecode* bc, int frameDepth = FRAME_DEPTH)
+    {
+        this->bc = bc;
+        this->slots.assign(bc->globals + bc->slotCount(), 0);
+        this->stack.assign(bc->maxStack + 1, 0);
+        this->frames.assign(frameDepth, Frame{nullptr, nullptr});
+        int maxLevel = 0;
+        for (const ProcInfo& proc : bc->procs)
+        {
+            maxLevel = max(maxLevel, proc.level);
+        }
+        this->display.assign(maxLevel + 1, nullptr);
+        this->executed = 0;
+    }
+
+    VM(const VM&) = delete;
+    VM& operator=(const VM&) = delete;
+
+    // Runs from index 0 to Halt. The main frame keeps its values between runs unless reset.
+    void run();
+
+    const Bytecode* bytecode() const
+    {
+        return this->bc;
+    }
+
+    void reset()
+    {
+        fill(this->slots.begin(), this->slots.begin() + this->bc->globals, 0);
+    }
+
+    static string_view dispatchName()
+    {
+#ifdef PL0_THREADED_DISPATCH
+        return "threaded";
+#else
+        return "switch";
+#endif
+    }
+
+private:
+#ifdef PL0_THREADED_DISPATCH
+    // Ir with the opcode replaced by the address of its handler.
+    struct Instr
+    {
+        const void* handler;
+        Value arg;
+        Value arg2;
+        uint32_t depth;
+        uint32_t depth2;
+    };
+    vector<Instr> threaded;
+#else
+    typedef Ir Instr;
+#endif
+
+    // A call in progress: where to return and the caller's display entry for the callee's level.
+    struct Frame
+    {
+        const Instr* ret;
+        Value* saved;
+    };
+
+    const Bytecode* bc;
+    vector<Value> stack;
+    vector<Frame> frames;
+    vector<Value*> display;
+
+    // Grows `slots` to hold `more` values past `top`, moving every frame pointer
+    // along, and returns the new `top`.
+    Value* grow(Value* top, size_t more, Frame* fp)
+    {
+        Value* old = this->slots.data();
+        auto offset = [&](Value* p) { return p == nullptr ? -1 : p - old; };
+        auto rebase = [&](ptrdiff_t k) { return k < 0 ? nullptr : this->slots.data() + k; };
+        vector<ptrdiff_t> display, saved;
+        for (Value* p : this->display)
+        {
+            display.push_back(offset(p));
+        }
+        for (Frame* f = this->frames.data(); f != fp; f++)
+        {
+            saved.push_back(offset(f->saved));
+        }
+        ptrdiff_t used = top - old;
+
+        this->slots.resize(max(this->slots.size() * 2, used + more));
+
+        for (size_t k = 0; k < display.size(); k++)
+        {
+            this->display[k] = rebase(display[k]);
+        }
+        for (size_t k = 0; k < saved.size(); k++)
+        {
+            this->frames[k].saved = rebase(saved[k]);
+        }
+        return this->slots.data() + used;
+    }
+};
+
+void VM::run()
+{
+#ifdef PL0_THREADED_DISPATCH
+    static const void* const HANDLERS[] =
+    {
+        &&op_Add, &&op_Sub, &&op_Mul, &&op_Div, &&op_Neg,
+        &&op_Eq, &&op_Ne, &&op_Lt, &&op_Lte, &&op_Gt, &&op_Gte, &&op_Odd,
+        &&op_LoadVar, &&op_LoadLit, &&op_Store, &&op_Jump, &&op_BrFalse,
+        &&op_DefVar, &&op_DefLit, &&op_DefProc, &&op_Call, &&op_Ret,
+        &&op_IncVar, &&op_MoveVar, &&op_StoreLit, &&op_AddVar, &&op_AddLit, &&op_LoadVarLoadVarMul,
+        &&op_CmpLitBranchEq, &&op_CmpLitBranchNe, &&op_CmpLitBranchLt,
+        &&op_CmpLitBranchLte, &&op_CmpLitBranchGt, &&op_CmpLitBranchGte,
+    };
+
+    if (this->threaded.size() != this->bc->code.size())
+    {
+        this->threaded.clear();
+        for (const Ir& ir : this->bc->code)
+        {
+            const void* handler;
+            switch (ir.op)
+            {
+            case IrOpCode::Input: handler = &&op_Input; break;
+            case IrOpCode::Output: handler = &&op_Output; break;
+            case IrOpCode::Halt: handler = &&op_Halt; break;
+            default: handler = HANDLERS[static_cast<int>(ir.op)]; break;
+            }
+            this->threaded.push_back(Instr{handler, ir.arg, ir.arg2, ir.depth, ir.depth2});
+        }
+    }
+
+    const Instr* code = this->threaded.data();
+#define VM_CASE(name) op_##name:
+#define VM_DISPATCH() do { steps++; goto *ip->handler; } while (0)
+#else
+    const Instr* code = this->bc->code.data();
+#define VM_CASE(name) case IrOpCode::name:
+#define VM_DISPATCH() do { steps++; goto dispatch; } while (0)
+#endif
+
+    const Instr* ip = code;
+    Value** display = this->display.data();
+    display[0] = this->slots.data();
+    Value* top = display[0] + this->bc->globals;  // the first free frame slot
+    Value* sp = this->stack.data();  // sp[0] is a dummy; the top of stack is *sp
+    Frame* fp = this->frames.data();
+    Frame* const fpEnd = fp + this->frames.size();
+    long long steps = 0;
+
+#define VM_VAR(depth, slot) display[depth][slot]
+
+#define VM_BINARY(name, expr) VM_CASE(name) { Value b = *sp--; Value a = *sp; *sp = (expr); ip++; VM_DISPATCH(); }
+#define VM_CMP_LIT_BRANCH(name, expr) VM_CASE(name) { Value a = *sp--; Value b = ip->arg2; ip = (expr) ? ip + 1 : code + ip->arg; VM_DISPATCH(); }
+
+    VM_DISPATCH();
+
+#ifndef PL0_THREADED_DISPATCH
+dispatch:
+    switch (ip->op)
+    {
+#endif
+    VM_BINARY(Add, addValue(a, b))
+    VM_BINARY(Sub, subValue(a, b))
+    VM_BINARY(Mul, mulValue(a, b))
+    VM_BINARY(Eq, a == b)
+    VM_BINARY(Ne, a != b)
+    VM_BINARY(Lt, a < b)
+    VM_BINARY(Lte, a <= b)
+    VM_BINARY(Gt, a > b)
+    VM_BINARY(Gte, a >= b)
+
+    VM_CMP_LIT_BRANCH(CmpLitBranchEq, a == b)
+    VM_CMP_LIT_BRANCH(CmpLitBranchNe, a != b)
+    VM_CMP_LIT_BRANCH(CmpLitBranchLt, a < b)
+    VM_CMP_LIT_BRANCH(CmpLitBranchLte, a <= b)
+    VM_CMP_LIT_BRANCH(CmpLitBranchGt, a > b)
+    VM_CMP_LIT_BRANCH(CmpLitBranchGte, a >= b)
+
+    VM_CASE(Div)
+    {
+        Value b = *sp--;
+        if (b == 0)
+        {
+            this->executed = steps;
+            throw "division by zero";
+        }
+        *sp = divide(*sp, b);
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Neg)
+    {
+        *sp = negValue(*sp);
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Odd)
+    {
+        *sp = *sp & 1;
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(LoadVar)
+    {
+        *++sp = VM_VAR(ip->depth, ip->arg);
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(LoadLit)
+    {
+        *++sp = ip->arg;
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Store)
+    {
+        VM_VAR(ip->depth, ip->arg) = *sp--;
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Jump)
+    {
+        ip = code + ip->arg;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(BrFalse)
+    {
+        ip = *sp-- ? ip + 1 : code + ip->arg;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Call)
+    {
+        if (fp == fpEnd)
+        {
+            this->executed = steps;
+            throw "call stack overflow";
+        }
+        size_t size = ip->arg2;
+        if (size > size_t(this->slots.data() + this->slots.size() - top))
+        {
+            top = this->grow(top, size, fp);
+        }
+        fill(top, top + size, 0);
+        *fp++ = Frame{ip + 1, display[ip->depth]};
+        display[ip->depth] = top;
+        top += size;
+        ip = code + ip->arg;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Ret)
+    {
+        if (fp == this->frames.data())
+        {
+            this->executed = steps;
+            throw "return without call";
+        }
+        --fp;
+        const Instr* call = fp->ret - 1;
+        top = display[call->depth];
+        display[call->depth] = fp->saved;
+        ip = fp->ret;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(IncVar)
+    {
+        VM_VAR(ip->depth, ip->arg) = addValue(VM_VAR(ip->depth, ip->arg), ip->arg2);
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(MoveVar)
+    {
+        VM_VAR(ip->depth, ip->arg) = VM_VAR(ip->depth2, ip->arg2);
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(StoreLit)
+    {
+        VM_VAR(ip->depth, ip->arg) = ip->arg2;
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(AddVar)
+    {
+        *sp = addValue(*sp, VM_VAR(ip->depth, ip->arg));
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(AddLit)
+    {
+        *sp = addValue(*sp, ip->arg);
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(LoadVarLoadVarMul)
+    {
+        *++sp = mulValue(VM_VAR(ip->depth, ip->arg), VM_VAR(ip->depth2, ip->arg2));
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Input)
+    {
+        Value v;
+        cin >> v;
+        *++sp = v;
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Output)
+    {
+        cout << *sp-- << endl;
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(DefVar)
+    VM_CASE(DefLit)
+    VM_CASE(DefProc)
+    {
+        this->executed = steps;
+        throw "unexpected declaration opcode";
+    }
+
+    VM_CASE(Halt)
+    {
+        this->executed = steps;
+        return;
+    }
+#ifndef PL0_THREADED_DISPATCH
+    }
+    throw "invalid opcode";
+#endif
+
+#undef VM_CMP_LIT_BRANCH
+#undef VM_BINARY
+#undef VM_VAR
+#undef VM_DISPATCH
+#undef VM_CASE
+}
+
+ostream& operator<<(ostream& cout, const VM& vm)
+{
+    const Bytecode* bc = vm.bytecode();
+    for (int slot = 0; slot < bc->globals; slot++)
+    {
+        cout << (slot ? ", " : "") << bc->symbols->name(bc->slotNames[slot]) << " = " << vm.slots[slot];
+    }
+    cout << " (" << vm.executed << " instructions)";
+    return cout;
+}
+
+// Opcodes of the three-address register IR. Arithmetic and comparisons write
+// `dst` from `lhs` and `rhs`; BrFalse jumps to `dst` when `lhs` is zero, and each
+// BrFalse<cmp> jumps to `dst` when `lhs <cmp> rhs` does not hold.
+enum class RegOpCode : uint8_t
+{
+    Move,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Neg,
+    Odd,
+    Eq,
+    Ne,
+    Lt,
+    Lte,
+    Gt,
+    Gte,
+    Jump,
+    BrFalse,
+    BrFalseEq,
+    BrFalseNe,
+    BrFalseLt,
+    BrFalseLte,
+    BrFalseGt,
+    BrFalseGte,
+    Call,
+    Ret,
+    Input,
+    Output,
+    Halt,
+};
+
+string_view regOpCodeName(RegOpCode op)
+{
+    switch (op)
+    {
+    case RegOpCode::Move: return "Move";
+    case RegOpCode::Add: return "Add";
+    case RegOpCode::Sub: return "Sub";
+    case RegOpCode::Mul: return "Mul";
+    case RegOpCode::Div: return "Div";
+    case RegOpCode::Neg: return "Neg";
+    case RegOpCode::Odd: return "Odd";
+    case RegOpCode::Eq: return "Eq";
+    case RegOpCode::Ne: return "Ne";
+    case RegOpCode::Lt: return "Lt";
+    case RegOpCode::Lte: return "Lte";
+    case RegOpCode::Gt: return "Gt";
+    case RegOpCode::Gte: return "Gte";
+    case RegOpCode::Jump: return "Jump";
+    case RegOpCode::BrFalse: return "BrFalse";
+    case RegOpCode::BrFalseEq: return "BrFalseEq";
+    case RegOpCode::BrFalseNe: return "BrFalseNe";
+    case RegOpCode::BrFalseLt: return "BrFalseLt";
+    case RegOpCode::BrFalseLte: return "BrFalseLte";
+    case RegOpCode::BrFalseGt: return "BrFalseGt";
+    case RegOpCode::BrFalseGte: return "BrFalseGte";
+    case RegOpCode::Call: return "Call";
+    case RegOpCode::Ret: return "Ret";
+    case RegOpCode::Input: return "Input";
+    case RegOpCode::Output: return "Output";
+    case RegOpCode::Halt: return "Halt";
+    }
+    return "?";
+}
+
+// Call jumps to code index `dst` and gives the callee a fresh frame in the `rhs`
+// registers from `lhs`.
+struct RegIr
+{
+    RegOpCode op;
+    int32_t dst;  // destination register, or code index for jumps and calls
+    int32_t lhs;
+    int32_t rhs;
+};
+
+// The register form of a Bytecode. Its register file is laid out as
+// [variable slots | temporaries | constants]: each variable has the home register
+// of its static slot, temporary k stands for operand stack depth k of the stack
+// code, and every distinct literal gets a register that is preloaded with its
+// value. A procedure's variables hold its innermost activation: Call saves them
+// and clears them for the callee, and Ret restores them. Code only reaches the
+// variables of its own block and enclosing ones, and the innermost activation of
+// those is exactly what a display would point at, so this matches Bytecode frames.
+class RegBytecode
+{
+public:
+    vector<RegIr> code;
+    vector<ProcInfo> procs;
+    vector<Value> constants;
+    int slots;
+    int temps;
+    int globals;  // the main program's variables, registers 0 .. globals
+    const Bytecode* source;
+
+    RegBytecode()
+    {
+        this->slots = 0;
+        this->temps = 0;
+        this->globals = 0;
+        this->source = nullptr;
+    }
+
+    int constBase() const
+    {
+        return this->slots + this->temps;
+    }
+
+    int registerCount() const
+    {
+        return this->constBase() + this->constants.size();
+    }
+};
+
+// Lowers stack Bytecode to RegBytecode by running the operand stack symbolically:
+// loads push a register instead of emitting code, operators read their operands'
+// registers and write the temporary of the stack depth they leave their result at.
+// A Store retargets the instruction that computed its value, and a comparison
+// followed by BrFalse becomes one compare-and-branch. The compiler only branches
+// between statements, where the operand stack is empty, so no register operand
+// is ever live across a jump target.
+class RegCompiler
+{
+public:
+    RegCompiler(RegBytecode* out)
+    {
+        this->out = out;
+    }
+
+    void program(const Bytecode* bc)
+    {
+        this->out->source = bc;
+        this->out->slots = bc->slotCount();
+        this->out->temps = bc->maxStack;
+        this->out->globals = bc->globals;
+
+        vector<int> procAt(bc->code.size() + 1, -1);  // the procedure entered at each code index
+        for (size_t k = 0; k < bc->procs.size(); k++)
+        {
+            procAt[bc->procs[k].entry] = k;
+        }
+
+        vector<int> newIndex(bc->code.size() + 1);
+        vector<int> stack;
+        int owner = -1;  // procedures follow each other in code order
+
+        for (size_t pc = 0; pc < bc->code.size(); pc++)
+        {
+            newIndex[pc] = this->out->code.size();
+            const Ir& ir = bc->code[pc];
+            if (procAt[pc] >= 0)
+            {
+                owner = procAt[pc];
+            }
+
+            switch (ir.op)
+            {
+            case IrOpCode::LoadVar:
+                stack.push_back(bc->staticSlot(owner, ir.depth, ir.arg));
+                break;
+            case IrOpCode::LoadLit:
+                stack.push_back(this->constant(ir.arg));
+                break;
+            case IrOpCode::Neg:
+            case IrOpCode::Odd:
+            {
+                int a = stack.back();
+                stack.back() = this->temp(stack.size() - 1);
+                this->emit(ir.op == IrOpCode::Neg ? RegOpCode::Neg : RegOpCode::Odd, stack.back(), a);
+                break;
+            }
+            case IrOpCode::Store:
+            {
+                int value = stack.back();
+                int target = bc->staticSlot(owner, ir.depth, ir.arg);
+                stack.pop_back();
+
+                RegIr* last = this->out->code.empty() ? nullptr : &this->out->code.back();
+                if (value >= this->out->slots && value < this->out->constBase() && last != nullptr && last->dst == value)
+                {
+                    last->dst = target;
+                }
+                else
+                {
+                    this->emit(RegOpCode::Move, target, value);
+                }
+                break;
+            }
+            case IrOpCode::Jump:
+                this->emit(RegOpCode::Jump, ir.arg);
+                break;
+            case IrOpCode::BrFalse:
+            {
+                int cond = stack.back();
+                stack.pop_back();
+
+                RegIr* last = this->out->code.empty() ? nullptr : &this->out->code.back();
+                if (last != nullptr && last->dst == cond && last->op >= RegOpCode::Eq && last->op <= RegOpCode::Gte)
+                {
+                    int offset = static_cast<int>(last->op) - static_cast<int>(RegOpCode::Eq);
+                    last->op = static_cast<RegOpCode>(static_cast<int>(RegOpCode::BrFalseEq) + offset);
+                    last->dst = ir.arg;
+                }
+                else
+                {
+                    this->emit(RegOpCode::BrFalse, ir.arg, cond);
+                }
+                break;
+            }
+            case IrOpCode::Call:
+            {
+                const ProcInfo& callee = bc->procs[procAt[ir.arg]];
+                this->emit(RegOpCode::Call, ir.arg, callee.firstSlot, callee.size);
+                break;
+            }
+            case IrOpCode::Ret:
+                this->emit(RegOpCode::Ret);
+                break;
+            case IrOpCode::Halt:
+                this->emit(RegOpCode::Halt);
+                break;
+            case IrOpCode::Input:
+                stack.push_back(this->temp(stack.size()));
+                this->emit(RegOpCode::Input, stack.back());
+                break;
+            case IrOpCode::Output:
+                this->emit(RegOpCode::Output, 0, stack.back());
+                stack.pop_back();
+                break;
+            case IrOpCode::Add:
+            case IrOpCode::Sub:
+            case IrOpCode::Mul:
+            case IrOpCode::Div:
+            case IrOpCode::Eq:
+            case IrOpCode::Ne:
+            case IrOpCode::Lt:
+            case IrOpCode::Lte:
+            case IrOpCode::Gt:
+            case IrOpCode::Gte:
+            {
+                int b = stack.back();
+                stack.pop_back();
+                int a = stack.back();
+                stack.back() = this->temp(stack.size() - 1);
+                this->emit(BINARY_OPS[static_cast<int>(ir.op)], stack.back(), a, b);
+                break;
+            }
+            case IrOpCode::DefVar:
+            case IrOpCode::DefLit:
+            case IrOpCode::DefProc:
+                throw "unexpected declaration opcode";
+            default:
+                throw "register lowering expects bytecode without superinstructions";
+            }
+        }
+        newIndex[bc->code.size()] = this->out->code.size();
+
+        for (RegIr& ir : this->out->code)
+        {
+            if (ir.op == RegOpCode::Jump || ir.op == RegOpCode::Call || (ir.op >= RegOpCode::BrFalse && ir.op <= RegOpCode::BrFalseGte))
+            {
+                ir.dst = newIndex[ir.dst];
+            }
+        }
+
+        for (ProcInfo proc : bc->procs)
+        {
+            proc.entry = newIndex[proc.entry];
+            this->out->procs.push_back(proc);
+        }
+    }
+
+private:
+    // Register opcode of each binary stack opcode, indexed by IrOpCode (Add..Gte).
+    static constexpr RegOpCode BINARY_OPS[] =
+    {
+        RegOpCode::Add, RegOpCode::Sub, RegOpCode::Mul, RegOpCode::Div, RegOpCode::Neg,
+        RegOpCode::Eq, RegOpCode::Ne, RegOpCode::Lt, RegOpCode::Lte, RegOpCode::Gt, RegOpCode::Gte,
+    };
+
+    RegBytecode* out;
+    unordered_map<Value, int> constIndex;
+
+    void emit(RegOpCode op, int dst = 0, int lhs = 0, int rhs = 0)
+    {
+        this->out->code.push_back(RegIr{op, dst, lhs, rhs});
+    }
+
+    int temp(int depth)
+    {
+        return this->out->slots + depth;
+    }
+
+    // Returns the register preloaded with `value`.
+    int constant(Value value)
+    {
+        auto it = this->constIndex.find(value);
+        if (it == this->constIndex.end())
+        {
+            it = this->constIndex.emplace(value, this->out->constants.size()).first;
+            this->out->constants.push_back(value);
+        }
+        return this->out->constBase() + it->second;
+    }
+};
+
+struct RegName
+{
+    const RegBytecode* rb;
+    int reg;
+};
+
+ostream& operator<<(ostream& cout, const RegName r)
+{
+    const RegBytecode& rb = *r.rb;
+    if (r.reg < rb.slots)
+    {
+        cout << rb.source->symbols->name(rb.source->slotNames[r.reg]);
+    }
+    else if (r.reg < rb.constBase())
+    {
+        cout << "t" << r.reg - rb.slots;
+    }
+    else
+    {
+        cout << "#" << rb.constants[r.reg - rb.constBase()];
+    }
+    return cout;
+}
+
+ostream& operator<<(ostream& cout, const RegBytecode& rb)
+{
+    cout << "registers: " << rb.registerCount() << " (" << rb.slots << " slots, " << rb.temps << " temps, "
+         << rb.constants.size() << " constants), code: " << rb.code.size() << endl;
+
+    for (size_t pc = 0; pc < rb.code.size(); pc++)
+    {
+        for (const ProcInfo& proc : rb.procs)
+        {
+            if (proc.entry == (int)pc)
+            {
+                cout << rb.source->symbols->name(proc.name) << ":" << endl;
+            }
+        }
+
+        const RegIr& ir = rb.code[pc];
+        cout << "  " << pc << "\t" << regOpCodeName(ir.op);
+        switch (ir.op)
+        {
+        case RegOpCode::Move:
+        case RegOpCode::Neg:
+        case RegOpCode::Odd:
+            cout << "\t" << RegName{&rb, ir.dst} << ", " << RegName{&rb, ir.lhs};
+            break;
+        case RegOpCode::Jump:
+            cout << "\t" << ir.dst;
+            break;
+        case RegOpCode::Call:
+            cout << "\t" << ir.dst << ", frame " << ir.rhs;
+            break;
+        case RegOpCode::BrFalse:
+            cout << "\t" << RegName{&rb, ir.lhs} << ", " << ir.dst;
+            break;
+        case RegOpCode::BrFalseEq:
+        case RegOpCode::BrFalseNe:
+        case RegOpCode::BrFalseLt:
+        case RegOpCode::BrFalseLte:
+        case RegOpCode::BrFalseGt:
+        case RegOpCode::BrFalseGte:
+            cout << "\t" << RegName{&rb, ir.lhs} << ", " << RegName{&rb, ir.rhs} << ", " << ir.dst;
+            break;
+        case RegOpCode::Input:
+            cout << "\t" << RegName{&rb, ir.dst};
+            break;
+        case RegOpCode::Output:
+            cout << "\t" << RegName{&rb, ir.lhs};
+            break;
+        case RegOpCode::Ret:
+        case RegOpCode::Halt:
+            break;
+        default:
+            cout << "\t" << RegName{&rb, ir.dst} << ", " << RegName{&rb, ir.lhs} << ", " << RegName{&rb, ir.rhs};
+            break;
+        }
+        cout << endl;
+    }
+    return cout;
+}
+
+// Executes RegBytecode with the same dispatch selection and allocation discipline
+// as VM: the register file and return stack are allocated by the constructor, and
+// the stack of registers saved by calls grows only when a deeper call needs it.
+class RegVM
+{
+public:
+    static const int FRAME_DEPTH = 4096;
+
+    vector<Value> regs;
+    long long executed;  // instructions dispatched by the last run()
+
+    RegVM(const RegBytecode* rb, int frameDepth = FRAME_DEPTH)
+    {
+        this->rb = rb;
+        this->regs.assign(rb->registerCount(), 0);
+        copy(rb->constants.begin(), rb->constants.end(), this->regs.begin() + rb->constBase());
+        this->frames.assign(frameDepth, nullptr);
+        this->saved.assign(rb->slots, 0);
+        this->executed = 0;
+    }
+
+    RegVM(const RegVM&) = delete;
+    RegVM& operator=(const RegVM&) = delete;
+
+    void run();
+
+    const RegBytecode* bytecode() const
+    {
+        return this->rb;
+    }
+
+    void reset()
+    {
+        fill(this->regs.begin(), this->regs.begin() + this->rb->constBase(), 0);
+    }
+
+private:
+#ifdef PL0_THREADED_DISPATCH
+    struct Instr
+    {
+        const void* handler;
+        int32_t dst;
+        int32_t lhs;
+        int32_t rhs;
+    };
+    vector<Instr> threaded;
+#else
+    typedef RegIr Instr;
+#endif
+
+    const RegBytecode* rb;
+    vector<const Instr*> frames;
+    vector<Value> saved;  // the registers each active Call replaced, innermost last
+};
+
+void RegVM::run()
+{
+#ifdef PL0_THREADED_DISPATCH
+    static const void* const HANDLERS[] =
+    {
+        &&op_Move, &&op_Add, &&op_Sub, &&op_Mul, &&op_Div, &&op_Neg, &&op_Odd,
+        &&op_Eq, &&op_Ne, &&op_Lt, &&op_Lte, &&op_Gt, &&op_Gte,
+        &&op_Jump, &&op_BrFalse,
+        &&op_BrFalseEq, &&op_BrFalseNe, &&op_BrFalseLt, &&op_BrFalseLte, &&op_BrFalseGt, &&op_BrFalseGte,
+        &&op_Call, &&op_Ret, &&op_Input, &&op_Output, &&op_Halt,
+    };
+
+    if (this->threaded.size() != this->rb->code.size())
+    {
+        this->threaded.clear();
+        for (const RegIr& ir : this->rb->code)
+        {
+            this->threaded.push_back(Instr{HANDLERS[static_cast<int>(ir.op)], ir.dst, ir.lhs, ir.rhs});
+        }
+    }
+
+    const Instr* code = this->threaded.data();
+#define VM_CASE(name) op_##name:
+#define VM_DISPATCH() do { steps++; goto *ip->handler; } while (0)
+#else
+    const Instr* code = this->rb->code.data();
+#define VM_CASE(name) case RegOpCode::name:
+#define VM_DISPATCH() do { steps++; goto dispatch; } while (0)
+#endif
+
+    const Instr* ip = code;
+    Value* r = this->regs.data();
+    const Instr** fp = this->frames.data();
+    const Instr** const fpEnd = fp + this->frames.size();
+    size_t savedTop = 0;  // values in use on this->saved
+    long long steps = 0;
+
+#define VM_BINARY(name, expr) VM_CASE(name) { Value a = r[ip->lhs]; Value b = r[ip->rhs]; r[ip->dst] = (expr); ip++; VM_DISPATCH(); }
+#define VM_BRANCH(name, expr) VM_CASE(name) { Value a = r[ip->lhs]; Value b = r[ip->rhs]; ip = (expr) ? ip + 1 : code + ip->dst; VM_DISPATCH(); }
+
+    VM_DISPATCH();
+
+#ifndef PL0_THREADED_DISPATCH
+dispatch:
+    switch (ip->op)
+    {
+#endif
+    VM_BINARY(Add, addValue(a, b))
+    VM_BINARY(Sub, subValue(a, b))
+    VM_BINARY(Mul, mulValue(a, b))
+    VM_BINARY(Eq, a == b)
+    VM_BINARY(Ne, a != b)
+    VM_BINARY(Lt, a < b)
+    VM_BINARY(Lte, a <= b)
+    VM_BINARY(Gt, a > b)
+    VM_BINARY(Gte, a >= b)
+
+    VM_BRANCH(BrFalseEq, a == b)
+    VM_BRANCH(BrFalseNe, a != b)
+    VM_BRANCH(BrFalseLt, a < b)
+    VM_BRANCH(BrFalseLte, a <= b)
+    VM_BRANCH(BrFalseGt, a > b)
+    VM_BRANCH(BrFalseGte, a >= b)
+
+    VM_CASE(Div)
+    {
+        Value b = r[ip->rhs];
+        if (b == 0)
+        {
+            this->executed = steps;
+            throw "division by zero";
+        }
+        r[ip->dst] = divide(r[ip->lhs], b);
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Move)
+    {
+        r[ip->dst] = r[ip->lhs];
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Neg)
+    {
+        r[ip->dst] = negValue(r[ip->lhs]);
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Odd)
+    {
+        r[ip->dst] = r[ip->lhs] & 1;
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Jump)
+    {
+        ip = code + ip->dst;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(BrFalse)
+    {
+        ip = r[ip->lhs] ? ip + 1 : code + ip->dst;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Call)
+    {
+        if (fp == fpEnd)
+        {
+            this->executed = steps;
+            throw "call stack overflow";
+        }
+        Value* frame = r + ip->lhs;
+        size_t size = ip->rhs;
+        if (this->saved.size() - savedTop < size)
+        {
+            this->saved.resize(max(this->saved.size() * 2, savedTop + size));
+        }
+        copy(frame, frame + size, this->saved.data() + savedTop);
+        fill(frame, frame + size, 0);
+        savedTop += size;
+        *fp++ = ip + 1;
+        ip = code + ip->dst;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Ret)
+    {
+        if (fp == this->frames.data())
+        {
+            this->executed = steps;
+            throw "return without call";
+        }
+        ip = *--fp;
+        const Instr* call = ip - 1;
+        savedTop -= call->rhs;
+        copy(this->saved.data() + savedTop, this->saved.data() + savedTop + call->rhs, r + call->lhs);
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Input)
+    {
+        cin >> r[ip->dst];
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Output)
+    {
+        cout << r[ip->lhs] << endl;
+        ip++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Halt)
+    {
+        this->executed = steps;
+        return;
+    }
+#ifndef PL0_THREADED_DISPATCH
+    }
+    throw "invalid opcode";
+#endif
+
+#undef VM_BRANCH
+#undef VM_BINARY
+#undef VM_DISPATCH
+#undef VM_CASE
+}
+
+ostream& operator<<(ostream& cout, const RegVM& vm)
+{
+    const RegBytecode* rb = vm.bytecode();
+    for (int slot = 0; slot < rb->globals; slot++)
+    {
+        cout << (slot ? ", " : "") << RegName{rb, slot} << " = " << vm.regs[slot];
+    }
+    cout << " (" << vm.executed << " instructions)";
+    return cout;
+}
+
+// Native code for RegBytecode on x86-64. The whole program is compiled to one
+// function: procedures become native call/ret, the most used variable slots and
+// temporaries (weighted by loop nesting) live in host registers for the entire run,
+// and constants become immediates. A call pushes the callee's variables on the
+// native stack and clears them, and pops them back after it returns. Programs
+// using Input/Output, procedures with more than MAX_FRAME variables, other hosts
+// and other Value widths are not compiled; compile() returns false and the caller
+// falls back to the interpreter.
+class Jit
+{
+public:
+    static const int FRAME_DEPTH = 4096;
+    static const int MAX_FRAME = 32;  // bounds the native stack to FRAME_DEPTH * (MAX_FRAME + 1) * 8 bytes
+
+    Jit()
+    {
+        this->rb = nullptr;
+        this->entry = nullptr;
+        this->size = 0;
+        this->emitted = 0;
+        this->hostRegisters = 0;
+    }
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    ~Jit()
+    {
+        this->release();
+    }
+
+    bool compile(const RegBytecode* rb);
+    void run();
+
+    void reset()
+    {
+        fill(this->storage.begin(), this->storage.end(), 0);
+    }
+
+    const RegBytecode* bytecode() const { return this->rb; }
+    Value slot(int index) const { return this->storage[HEADER + index]; }
+    size_t codeSize() const { return this->emitted; }
+    int registersAllocated() const { return this->hostRegisters; }
+
+    static bool available()
+    {
+#ifdef PL0_JIT
+        return true;
+#else
+        return false;
+#endif
+    }
+
+private:
+    // The register file is preceded by 8 bytes where the prologue saves the stack
+    // pointer, so error exits can unwind any depth of native calls.
+    static const int HEADER = 8 / sizeof(Value);
+
+    enum Status
+    {
+        OK = 0,
+        DIVISION_BY_ZERO = 1,
+        CALL_STACK_OVERFLOW = 2,
+    };
+
+    const RegBytecode* rb;
+    vector<Value> storage;
+    int (*entry)(Value* regs);
+    size_t size;     // bytes mapped
+    size_t emitted;  // bytes of machine code
+    int hostRegisters;
+
+    void release()
+    {
+#ifdef PL0_JIT
+        if (this->entry != nullptr)
+        {
+            munmap(reinterpret_cast<void*>(this->entry), this->size);
+        }
+#endif
+        this->entry = nullptr;
+        this->size = 0;
+    }
+
+#ifdef PL0_JIT
+    enum HostReg
+    {
+        RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+        R8, R9, R10, R11, R12, R13, R14, R15,
+    };
+
+    // rax/rcx/rdx are scratch, rsi counts the remaining call depth and rdi points
+    // at the register file.
+    static constexpr HostReg ALLOCATABLE[] = { RBX, RBP, R12, R13, R14, R15, R8, R9, R10, R11 };
+    static constexpr HostReg CALLEE_SAVED[] = { RBX, RBP, R12, R13, R14, R15 };
+
+    // Where an IR register lives in native code.
+    struct Loc
+    {
+        enum Kind { Reg, Mem, Imm } kind;
+        int32_t value;  // host register, byte offset from rdi, or immediate
+
+        bool operator==(const Loc& other) const { return this->kind == other.kind && this->value == other.value; }
+    };
+
+    struct Emitter
+    {
+        vector<uint8_t> buf;
+        vector<pair<size_t, int>> fixups;  // rel32 position -> label
+
+        void byte(uint8_t b) { this->buf.push_back(b); }
+
+        void imm32(int32_t v)
+        {
+            uint32_t u = static_cast<uint32_t>(v);
+            for (int k = 0; k < 4; k++)
+            {
+                this->byte(u >> (8 * k));
+            }
+        }
+
+        // Emits `opcode` with a ModRM byte whose reg field is `r` and whose r/m
+        // operand is `rm` (a host register or [rdi + disp32]), plus REX if needed.
+        void op(initializer_list<uint8_t> opcode, int r, Loc rm, bool wide = false)
+        {
+            int base = rm.kind == Loc::Reg ? rm.value : RDI;
+            uint8_t rex = 0x40 | (wide ? 8 : 0) | ((r >> 3) << 2) | (base >> 3);
+            if (rex != 0x40)
+            {
+                this->byte(rex);
+            }
+            for (uint8_t b : opcode)
+            {
+                this->byte(b);
+            }
+            if (rm.kind == Loc::Reg)
+            {
+                this->byte(0xC0 | (r & 7) << 3 | (rm.value & 7));
+            }
+            else
+            {
+                this->byte(0x80 | (r & 7) << 3 | (RDI & 7));
+                this->imm32(rm.value);
+            }
+        }
+
+        void rel32(int label)
+        {
+            this->fixups.push_back({ this->buf.size(), label });
+            this->imm32(0);
+        }
+
+        void push(HostReg r)
+        {
+            if (r >= R8)
+            {
+                this->byte(0x41);
+            }
+            this->byte(0x50 + (r & 7));
+        }
+
+        void pop(HostReg r)
+        {
+            if (r >= R8)
+            {
+                this->byte(0x41);
+            }
+            this->byte(0x58 + (r & 7));
+        }
+    };
+
+    static Loc reg(int r) { return Loc{Loc::Reg, r}; }
+
+    vector<int> hostOf;  // host register of each IR register, or -1
+    Emitter em;
+
+    Loc loc(int r)
+    {
+        if (r >= this->rb->constBase())
+        {
+            // compile() refuses anything but 32-bit values
+            return Loc{Loc::Imm, static_cast<int32_t>(this->rb->constants[r - this->rb->constBase()])};
+        }
+        if (this->hostOf[r] >= 0)
+        {
+            return reg(this->hostOf[r]);
+        }
+        return Loc{Loc::Mem, static_cast<int32_t>(r * sizeof(Value))};
+    }
+
+    void mov(int r, Loc src)
+    {
+        if (src.kind == Loc::Imm)
+        {
+            if (r >= R8)
+            {
+                this->em.byte(0x41);
+            }
+            this->em.byte(0xB8 + (r & 7));
+            this->em.imm32(src.value);
+        }
+        else if (!(src == reg(r)))
+        {
+            this->em.op({ 0x8B }, r, src);
+        }
+    }
+
+    void store(Loc dst, int r)
+    {
+        if (!(dst == reg(r)))
+        {
+            this->em.op({ 0x89 }, r, dst);
+        }
+    }
+
+    // r = r <op> src for add (ext 0), sub (5) and cmp (7); imul has its own forms.
+    void alu(RegOpCode op, int r, Loc src)
+    {
+        if (op == RegOpCode::Mul)
+        {
+            if (src.kind == Loc::Imm)
+            {
+                this->em.op({ 0x69 }, r, reg(r));
+                this->em.imm32(src.value);
+            }
+            else
+            {
+                this->em.op({ 0x0F, 0xAF }, r, src);
+            }
+            return;
+        }
+
+        int ext = op == RegOpCode::Add ? 0 : op == RegOpCode::Sub ? 5 : 7;
+        if (src.kind == Loc::Imm)
+        {
+            this->em.op({ 0x81 }, ext, reg(r));
+            this->em.imm32(src.value);
+        }
+        else
+        {
+            this->em.op({ static_cast<uint8_t>(ext * 8 + 3) }, r, src);
+        }
+    }
+
+    // Condition code of a comparison, in the order Eq, Ne, Lt, Lte, Gt, Gte.
+    static uint8_t conditionCode(int cmp)
+    {
+        static const uint8_t CC[] = { 0x4, 0x5, 0xC, 0xE, 0xF, 0xD };
+        return CC[cmp];
+    }
+
+    void allocate();
+    void instruction(const RegIr& ir);
+#endif
+};
+
+#ifdef PL0_JIT
+void Jit::allocate()
+{
+    const vector<RegIr>& code = this->rb->code;
+    vector<double> weight(code.size(), 1.0);
+    for (size_t pc = 0; pc < code.size(); pc++)
+    {
+        const RegIr& ir = code[pc];
+        bool branch = ir.op == RegOpCode::Jump || (ir.op >= RegOpCode::BrFalse && ir.op <= RegOpCode::BrFalseGte);
+        if (branch && ir.dst <= (int)pc)
+        {
+            for (size_t k = ir.dst; k <= pc; k++)
+            {
+                weight[k] = min(weight[k] * 8, 1e12);
+            }
+        }
+    }
+
+    int count = this->rb->constBase();
+    vector<double> uses(count, 0.0);
+    for (size_t pc = 0; pc < code.size(); pc++)
+    {
+        const RegIr& ir = code[pc];
+        switch (ir.op)
+        {
+        case RegOpCode::Jump:
+        case RegOpCode::Call:
+        case RegOpCode::Ret:
+        case RegOpCode::Halt:
+            continue;
+        case RegOpCode::BrFalse:
+        case RegOpCode::Output:
+            uses[ir.lhs] += ir.lhs < count ? weight[pc] : 0;
+            continue;
+        default:
+            break;
+        }
+
+        bool branch = ir.op >= RegOpCode::BrFalseEq && ir.op <= RegOpCode::BrFalseGte;
+        bool unary = ir.op == RegOpCode::Move || ir.op == RegOpCode::Neg || ir.op == RegOpCode::Odd || ir.op == RegOpCode::Input;
+        if (!branch && ir.dst < count)
+        {
+            uses[ir.dst] += weight[pc];
+        }
+        if (ir.op != RegOpCode::Input && ir.lhs < count)
+        {
+            uses[ir.lhs] += weight[pc];
+        }
+        if (!unary && ir.rhs < count)
+        {
+            uses[ir.rhs] += weight[pc];
+        }
+    }
+
+    vector<int> order(count);
+    for (int r = 0; r < count; r++)
+    {
+        order[r] = r;
+    }
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return uses[a] > uses[b]; });
+
+    this->hostOf.assign(count, -1);
+    this->hostRegisters = 0;
+    for (int r : order)
+    {
+        if (this->hostRegisters == (int)(sizeof(ALLOCATABLE) / sizeof(ALLOCATABLE[0])) || uses[r] == 0)
+        {
+            break;
+        }
+        this->hostOf[r] = ALLOCATABLE[this->hostRegisters++];
+    }
+}
+
+void Jit::instruction(const RegIr& ir)
+{
+    Emitter& em = this->em;
+
+    switch (ir.op)
+    {
+    case RegOpCode::Move:
+    {
+        Loc dst = this->loc(ir.dst);
+        Loc src = this->loc(ir.lhs);
+        if (dst.kind == Loc::Reg)
+        {
+            this->mov(dst.value, src);
+        }
+        else if (src.kind == Loc::Imm)
+        {
+            em.op({ 0xC7 }, 0, dst);
+            em.imm32(src.value);
+        }
+        else
+        {
+            this->mov(RAX, src);
+            this->store(dst, RAX);
+        }
+        break;
+    }
+    case RegOpCode::Add:
+    case RegOpCode::Sub:
+    case RegOpCode::Mul:
+    {
+        // compute in the destination's host register unless that would clobber rhs
+        Loc dst = this->loc(ir.dst);
+        Loc rhs = this->loc(ir.rhs);
+        int work = dst.kind == Loc::Reg && !(dst == rhs) ? dst.value : RAX;
+        this->mov(work, this->loc(ir.lhs));
+        this->alu(ir.op, work, rhs);
+        this->store(dst, work);
+        break;
+    }
+    case RegOpCode::Div:
+        this->mov(RAX, this->loc(ir.lhs));
+        this->mov(RCX, this->loc(ir.rhs));
+        em.op({ 0x85 }, RCX, reg(RCX));            // test ecx, ecx
+        em.byte(0x0F); em.byte(0x84); em.rel32(-1); // jz division by zero
+        em.byte(0x83); em.byte(0xF9); em.byte(0xFF); // cmp ecx, -1
+        em.byte(0x75); em.byte(0x04);               // jne idiv
+        em.byte(0xF7); em.byte(0xD8);               // neg eax (x / -1, wraps for INT_MIN)
+        em.byte(0xEB); em.byte(0x03);               // jmp done
+        em.byte(0x99);                              // cdq
+        em.byte(0xF7); em.byte(0xF9);               // idiv ecx
+        this->store(this->loc(ir.dst), RAX);
+        break;
+    case RegOpCode::Neg:
+    case RegOpCode::Odd:
+    {
+        Loc dst = this->loc(ir.dst);
+        int work = dst.kind == Loc::Reg ? dst.value : RAX;
+        this->mov(work, this->loc(ir.lhs));
+        if (ir.op == RegOpCode::Neg)
+        {
+            em.op({ 0xF7 }, 3, reg(work));
+        }
+        else
+        {
+            em.op({ 0x83 }, 4, reg(work));
+            em.byte(1);
+        }
+        this->store(dst, work);
+        break;
+    }
+    case RegOpCode::Eq:
+    case RegOpCode::Ne:
+    case RegOpCode::Lt:
+    case RegOpCode::Lte:
+    case RegOpCode::Gt:
+    case RegOpCode::Gte:
+        this->mov(RAX, this->loc(ir.lhs));
+        this->alu(RegOpCode::Eq, RAX, this->loc(ir.rhs));
+        em.byte(0x0F); em.byte(0x90 + conditionCode(static_cast<int>(ir.op) - static_cast<int>(RegOpCode::Eq))); em.byte(0xC0);
+        em.byte(0x0F); em.byte(0xB6); em.byte(0xC0);  // movzx eax, al
+        this->store(this->loc(ir.dst), RAX);
+        break;
+    case RegOpCode::Jump:
+        em.byte(0xE9);
+        em.rel32(ir.dst);
+        break;
+    case RegOpCode::BrFalse:
+    {
+        Loc cond = this->loc(ir.lhs);
+        int r = cond.kind == Loc::Reg ? cond.value : RAX;
+        this->mov(r, cond);
+        em.op({ 0x85 }, r, reg(r));  // test r, r
+        em.byte(0x0F); em.byte(0x84);
+        em.rel32(ir.dst);
+        break;
+    }
+    case RegOpCode::BrFalseEq:
+    case RegOpCode::BrFalseNe:
+    case RegOpCode::BrFalseLt:
+    case RegOpCode::BrFalseLte:
+    case RegOpCode::BrFalseGt:
+    case RegOpCode::BrFalseGte:
+    {
+        Loc lhs = this->loc(ir.lhs);
+        int r = lhs.kind == Loc::Reg ? lhs.value : RAX;
+        this->mov(r, lhs);
+        this->alu(RegOpCode::Eq, r, this->loc(ir.rhs));  // cmp
+        em.byte(0x0F); em.byte(0x80 + (conditionCode(static_cast<int>(ir.op) - static_cast<int>(RegOpCode::BrFalseEq)) ^ 1));
+        em.rel32(ir.dst);
+        break;
+    }
+    case RegOpCode::Call:
+        em.byte(0x83); em.byte(0xEE); em.byte(0x01);  // sub esi, 1
+        em.byte(0x0F); em.byte(0x88); em.rel32(-2);   // js call stack overflow
+        for (int r = ir.lhs; r < ir.lhs + ir.rhs; r++)
+        {
+            Loc var = this->loc(r);
+            if (var.kind == Loc::Reg)
+            {
+                em.push(HostReg(var.value));
+                em.op({ 0x31 }, var.value, var);  // xor r, r
+            }
+            else
+            {
+                this->mov(RAX, var);
+                em.push(RAX);
+                em.op({ 0xC7 }, 0, var);  // mov dword [rdi + offset], 0
+                em.imm32(0);
+            }
+        }
+        em.byte(0xE8); em.rel32(ir.dst);
+        for (int r = ir.lhs + ir.rhs - 1; r >= ir.lhs; r--)
+        {
+            Loc var = this->loc(r);
+            if (var.kind == Loc::Reg)
+            {
+                em.pop(HostReg(var.value));
+            }
+            else
+            {
+                em.pop(RAX);
+                this->store(var, RAX);
+            }
+        }
+        em.byte(0x83); em.byte(0xC6); em.byte(0x01);  // add esi, 1
+        break;
+    case RegOpCode::Ret:
+        em.byte(0xC3);
+        break;
+    case RegOpCode::Halt:
+        em.byte(0x31); em.byte(0xC0);  // xor eax, eax
+        em.byte(0xE9); em.rel32(-3);
+        break;
+    case RegOpCode::Input:
+    case RegOpCode::Output:
+        throw "Input/Output are not supported by the JIT";
+    }
+}
+#endif
+
+bool Jit::compile(const RegBytecode* rb)
+{
+    this->release();
+    this->rb = rb;
+    this->storage.assign(HEADER + rb->constBase(), 0);
+
+#ifdef PL0_JIT
+    if (sizeof(Value) != 4)
+    {
+        return false;
+    }
+    for (const RegIr& ir : rb->code)
+    {
+        if (ir.op == RegOpCode::Input || ir.op == RegOpCode::Output || (ir.op == RegOpCode::Call && ir.rhs > MAX_FRAME))
+        {
+            return false;
+        }
+    }
+
+    this->allocate();
+    this->em = Emitter();
+    Emitter& em = this->em;
+
+    for (HostReg r : CALLEE_SAVED)
+    {
+        em.push(r);
+    }
+    em.byte(0x48); em.byte(0x89); em.byte(0x67); em.byte(0xF8);  // mov [rdi - 8], rsp
+    em.byte(0xBE); em.imm32(FRAME_DEPTH);                        // mov esi, FRAME_DEPTH
+    for (size_t r = 0; r < this->hostOf.size(); r++)
+    {
+        if (this->hostOf[r] >= 0)
+        {
+            this->mov(this->hostOf[r], Loc{Loc::Mem, static_cast<int32_t>(r * sizeof(Value))});
+        }
+    }
+
+    vector<size_t> labels(rb->code.size() + 1);
+    for (size_t pc = 0; pc < rb->code.size(); pc++)
+    {
+        labels[pc] = em.buf.size();
+        this->instruction(rb->code[pc]);
+    }
+    labels[rb->code.size()] = em.buf.size();
+
+    // error stubs and the common exit; eax holds the Status
+    size_t divisionByZero = em.buf.size();
+    em.byte(0xB8); em.imm32(DIVISION_BY_ZERO);
+    em.byte(0xE9); em.rel32(-3);
+    size_t callStackOverflow = em.buf.size();
+    em.byte(0xB8); em.imm32(CALL_STACK_OVERFLOW);
+    size_t exit = em.buf.size();
+    for (size_t r = 0; r < this->hostOf.size(); r++)
+    {
+        if (this->hostOf[r] >= 0)
+        {
+            this->store(Loc{Loc::Mem, static_cast<int32_t>(r * sizeof(Value))}, this->hostOf[r]);
+        }
+    }
+    em.byte(0x48); em.byte(0x8B); em.byte(0x67); em.byte(0xF8);  // mov rsp, [rdi - 8]
+    for (int k = sizeof(CALLEE_SAVED) / sizeof(CALLEE_SAVED[0]) - 1; k >= 0; k--)
+    {
+        em.pop(CALLEE_SAVED[k]);
+    }
+    em.byte(0xC3);
+
+    for (auto& fixup : em.fixups)
+    {
+        size_t target = fixup.second == -1 ? divisionByZero
+                      : fixup.second == -2 ? callStackOverflow
+                      : fixup.second == -3 ? exit
+                      : labels[fixup.second];
+        int32_t rel = static_cast<int32_t>(target - (fixup.first + 4));
+        memcpy(&em.buf[fixup.first], &rel, 4);
+    }
+
+    size_t page = 4096;
+    this->emitted = em.buf.size();
+    this->size = (em.buf.size() + page - 1) / page * page;
+    void* mem = mmap(nullptr, this->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        this->size = 0;
+        return false;
+    }
+    memcpy(mem, em.buf.data(), em.buf.size());
+    if (mprotect(mem, this->size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(mem, this->size);
+        this->size = 0;
+        return false;
+    }
+    this->entry = reinterpret_cast<int (*)(Value*)>(mem);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Jit::run()
+{
+    if (this->entry == nullptr)
+    {
+        throw "no JIT code";
+    }
+
+    switch (this->entry(this->storage.data() + HEADER))
+    {
+    case DIVISION_BY_ZERO:
+        throw "division by zero";
+    case CALL_STACK_OVERFLOW:
+        throw "call stack overflow";
+    default:
+        break;
+    }
+}
+
+ostream& operator<<(ostream& cout, const Jit& jit)
+{
+    const RegBytecode* rb = jit.bytecode();
+    for (int slot = 0; slot < rb->globals; slot++)
+    {
+        cout << (slot ? ", " : "") << RegName{rb, slot} << " = " << jit.slot(slot);
+    }
+    cout << " (" << jit.codeSize() << " bytes of native code, " << jit.registersAllocated() << " host registers)";
+    return cout;
+}
+
+// Translates a Program into a standalone C translation unit. The main program's
+// variables become static globals; each Procedure becomes a static function whose
+// variables are a local frame struct `f`, so every activation has its own. A frame
+// links to the frame of the enclosing procedure, which callers pass in as `up`, so
+// enclosing variables are reached as up->...->v. Constants are inlined; If and While
+// become C control flow. Arithmetic goes through small inline helpers that keep
+// the wrap-around and division semantics of the VMs, and calls are limited to the
+// same depth, so the executable behaves like the interpreters. main() runs the
+// program and prints the main program's variables.
+class CEmitter
+{
+public:
+    static const int FRAME_DEPTH = 4096;
+
+    CEmitter(ostream* out)
+    {
+        this->out = out;
+        this->symbols = nullptr;
+    }
+
+    void program(const Program* program)
+    {
+        if (!program->resolved)
+        {
+            throw "program is not resolved";
+        }
+        if (sizeof(Value) > sizeof(long long))
+        {
+            throw "C output needs 32- or 64-bit values";
+        }
+        this->prog = program;
+        this->symbols = program->symbols;
+        this->varNames.resize(program->slotCount);
+        this->procs.resize(program->procs.size());
+        this->declare(program->block, -1);
+
+        bool wide = sizeof(Value) > sizeof(int);
+        bool calls = !program->procs.empty();  // the depth counter would be unused otherwise
+        ostream& out = *this->out;
+        out << "/* generated by pl0 */\n"
+               "#include <stdio.h>\n"
+               "#include <stdlib.h>\n"
+               "\n"
+               "typedef " << (wide ? "long long" : "int") << " pl0_value;\n"
+               "typedef " << (wide ? "unsigned long long" : "unsigned") << " pl0_bits;\n"
+               "\n"
+            << (calls ? "static int pl0_depth;\n\n" : "")
+            << "static void pl0_fail(const char* msg)\n"
+               "{\n"
+               "    fprintf(stderr, \"%s\\n\", msg);\n"
+               "    exit(1);\n"
+               "}\n"
+               "\n";
+        if (VALUE_CHECKED)
+        {
+            out << "#define PL0_CHECKED(op) pl0_value r; if (__builtin_##op##_overflow(a, b, &r)) pl0_fail(\"integer overflow\"); return r\n"
+                   "static inline pl0_value pl0_add(pl0_value a, pl0_value b) { PL0_CHECKED(add); }\n"
+                   "static inline pl0_value pl0_sub(pl0_value a, pl0_value b) { PL0_CHECKED(sub); }\n"
+                   "static inline pl0_value pl0_mul(pl0_value a, pl0_value b) { PL0_CHECKED(mul); }\n";
+        }
+        else
+        {
+            out << "static inline pl0_value pl0_add(pl0_value a, pl0_value b) { return (pl0_value)((pl0_bits)a + (pl0_bits)b); }\n"
+                   "static inline pl0_value pl0_sub(pl0_value a, pl0_value b) { return (pl0_value)((pl0_bits)a - (pl0_bits)b); }\n"
+                   "static inline pl0_value pl0_mul(pl0_value a, pl0_value b) { return (pl0_value)((pl0_bits)a * (pl0_bits)b); }\n";
+        }
+        out << "static inline pl0_value pl0_neg(pl0_value a) { return pl0_sub(0, a); }\n"
+               "static inline pl0_value pl0_div(pl0_value a, pl0_value b)\n"
+               "{\n"
+               "    if (b == 0)\n"
+               "        pl0_fail(\"division by zero\");\n"
+               "    return b == -1 ? pl0_neg(a) : a / b;\n"
+               "}\n"
+               "\n";
+        if (calls)
+        {
+            out << "#define PL0_CALL(call) do { if (++pl0_depth > " << FRAME_DEPTH << ") pl0_fail(\"call stack overflow\"); call; pl0_depth--; } while (0)\n"
+                   "\n";
+        }
+
+        const Block* main = program->block;
+        for (size_t k = 0; k < main->vars.size(); k++)
+        {
+            out << "static pl0_value " << this->varName(main->firstSlot + k) << ";\n";
+        }
+        out << "\n";
+        for (int index : this->preorder)
+        {
+            const ProcFrame& proc = this->procs[index];
+            if (proc.frame)
+            {
+                const Block* body = program->procs[index]->body;
+                out << "struct " << this->frameName(index) << "\n{\n";
+                if (proc.up)
+                {
+                    out << "    struct " << this->frameName(proc.parent) << "* up;\n";
+                }
+                for (size_t k = 0; k < body->vars.size(); k++)
+                {
+                    out << "    pl0_value " << this->varName(body->firstSlot + k) << ";\n";
+                }
+                out << "};\n\n";
+            }
+        }
+        for (int index : this->preorder)
+        {
+            out << "static void " << this->signature(index) << ";\n";
+        }
+        out << "\n";
+
+        this->block(program->block, -1);
+
+        out << "int main(void)\n"
+               "{\n"
+               "    pl0_main();\n";
+        for (size_t slot = main->firstSlot; slot < main->firstSlot + main->vars.size(); slot++)
+        {
+            out << "    printf(\"" << this->symbols->name(this->varNames[slot]) << (wide ? " = %lld\\n\", " : " = %d\\n\", ") << this->varName(slot) << ");\n";
+        }
+        out << "    return 0;\n"
+               "}\n";
+    }
+
+private:
+    // How a procedure keeps its variables.
+    struct ProcFrame
+    {
+        int parent;  // enclosing procedure, or -1 for the main program
+        bool frame;  // has a frame struct: variables of its own, or an up link its procedures need
+        bool up;     // takes the frame of `parent`, whose variables it can reach
+    };
+
+    ostream* out;
+    const Program* prog;
+    const SymbolTable* symbols;
+    vector<int> varNames;      // symbol id of each variable, by static slot
+    vector<ProcFrame> procs;   // by procedure index
+    vector<int> preorder;      // procedure indices, enclosing procedures first
+    int current = -1;          // procedure being emitted, -1 for the main program
+    bool usesFrame = false;    // its body used `f`
+    bool readsFrame = false;   // ... other than by assigning to its variables
+    bool usesUp = false;       // its body used `up`
+
+    string varName(int slot)
+    {
+        return "v" + to_string(slot) + "_" + string(this->symbols->name(this->varNames[slot]));
+    }
+
+    string procName(int index)
+    {
+        return "p" + to_string(index) + "_" + string(this->symbols->name(this->prog->procs[index]->name));
+    }
+
+    string frameName(int index)
+    {
+        return this->procName(index) + "_frame";
+    }
+
+    string signature(int index)
+    {
+        const ProcFrame& proc = this->procs[index];
+        return this->procName(index) + (proc.up ? "(struct " + this->frameName(proc.parent) + "* up)" : "(void)");
+    }
+
+    int level(int index)
+    {
+        return index < 0 ? 0 : this->prog->procs[index]->body->level;
+    }
+
+    // First pass: name every static slot and lay out the frame of every procedure.
+    void declare(const Block* block, int index)
+    {
+        for (size_t k = 0; k < block->vars.size(); k++)
+        {
+            this->varNames[block->firstSlot + k] = block->vars[k];
+        }
+        for (const Procedure* proc : block->procs)
+        {
+            ProcFrame& frame = this->procs[proc->index];
+            frame.parent = index;
+            frame.up = index >= 0 && this->procs[index].frame;
+            frame.frame = !proc->body->vars.empty() || (frame.up && !proc->body->procs.empty());
+            this->preorder.push_back(proc->index);
+            this->declare(proc->body, proc->index);
+        }
+    }
+
+    // The frame of the innermost activation at lexical `level`, seen from the
+    // procedure being emitted, as a pointer.
+    string frame(int level)
+    {
+        int from = this->level(this->current);
+        if (level == from)
+        {
+            this->usesFrame = true;
+            this->readsFrame = true;
+            return "&f";
+        }
+        this->usesUp = true;
+        string c = "up";
+        for (int k = from - 1; k > level; k--)
+        {
+            c += "->up";
+        }
+        return c;
+    }
+
+    string var(const VarRef& ref, bool read)
+    {
+        if (ref.depth == 0)
+        {
+            return this->varName(ref.global);
+        }
+        if (int(ref.depth) == this->level(this->current))
+        {
+            this->usesFrame = true;
+            this->readsFrame = this->readsFrame || read;
+            return "f." + this->varName(ref.global);
+        }
+        return this->frame(ref.depth) + "->" + this->varName(ref.global);
+    }
+
+    // Emits the procedure bodies of `block` first, then its statement as the body
+    // of procedure `index` (-1 is the main program). The body is generated first,
+    // so that `f` is only declared, and `up` only marked used, where needed.
+    void block(const Block* block, int index)
+    {
+        for (const Procedure* proc : block->procs)
+        {
+            this->block(proc->body, proc->index);
+        }
+
+        ostream& out = *this->out;
+        ostringstream body;
+        this->current = index;
+        this->usesFrame = false;
+        this->readsFrame = false;
+        this->usesUp = false;
+        this->out = &body;
+        this->statement(block->stmt, 1);
+        this->out = &out;
+
+        if (index < 0)
+        {
+            out << "static void pl0_main(void)\n{\n" << body.str() << "}\n\n";
+            return;
+        }
+        const ProcFrame& proc = this->procs[index];
+        out << "static void " << this->signature(index) << "\n{\n";
+        if (this->usesFrame)
+        {
+            out << "    struct " << this->frameName(index) << " f = " << (proc.up ? "{ .up = up }" : "{ 0 }") << ";\n";
+            if (!this->readsFrame)
+            {
+                out << "    (void)f;\n";
+            }
+        }
+        else if (proc.up && !this->usesUp)
+        {
+            out << "    (void)up;\n";
+        }
+        out << body.str() << "}\n\n";
+    }
+
+    void statement(const Statement* stmt, int depth)
+    {
+        ostream& out = *this->out;
+        string indent(4 * depth, ' ');
+
+        switch (stmt->kind())
+        {
+        case StatementKind::Assign:
+        {
+            const Assign& assign = stmt->assign();
+            out << indent << this->var(assign.target, false) << " = " << this->expression(assign.expr) << ";\n";
+            break;
+        }
+        case StatementKind::Call:
+        {
+            int callee = stmt->call().proc;
+            string up = this->procs[callee].up ? this->frame(this->level(callee) - 1) : "";
+            out << indent << "PL0_CALL(" << this->procName(callee) << "(" << up << "));\n";
+            break;
+        }
+        case StatementKind::Begin:
+            out << indent << "{\n";
+            for (const Statement* s : stmt->begin().body)
+            {
+                this->statement(s, depth + 1);
+            }
+            out << indent << "}\n";
+            break;
+        case StatementKind::If:
+            out << indent << "if (" << this->condition(stmt->_if().cond) << ")\n";
+            this->body(stmt->_if().then, depth);
+            break;
+        case StatementKind::While:
+            out << indent << "while (" << this->condition(stmt->_while().cond) << ")\n";
+            this->body(stmt->_while().then, depth);
+            break;
+        }
+    }
+
+    // The body of an if or while: braces line up with the keyword, a single
+    // statement is indented one level.
+    void body(const Statement* stmt, int depth)
+    {
+        this->statement(stmt, stmt->kind() == StatementKind::Begin ? depth : depth + 1);
+    }
+
+    string condition(const Condition* cond)
+    {
+        if (cond->kind() == ConditionKind::Odd)
+        {
+            return "(" + this->expression(cond->odd().expr) + ") & 1";
+        }
+
+        const StdCondition& std = cond->std();
+        string op;
+        switch (std.op)
+        {
+        case TokenKind::Eq: op = " == "; break;
+        case TokenKind::Ne: op = " != "; break;
+        case TokenKind::Lt: op = " < "; break;
+        case TokenKind::Lte: op = " <= "; break;
+        case TokenKind::Gt: op = " > "; break;
+        case TokenKind::Gte: op = " >= "; break;
+        default: throw "invalid std condition operator";
+        }
+        return this->expression(std.lhs) + op + this->expression(std.rhs);
+    }
+
+    string expression(const Expression* expr)
+    {
+        string c = this->term(expr->lhs);
+        if (expr->mod == TokenKind::Minus)
+        {
+            c = "pl0_neg(" + c + ")";
+        }
+        for (auto& item : expr->rhs)
+        {
+            c = (item.first == TokenKind::Plus ? "pl0_add(" : "pl0_sub(") + c + ", " + this->term(item.second) + ")";
+        }
+        return c;
+    }
+
+    string term(const Term* term)
+    {
+        string c = this->factor(term->lhs);
+        for (auto& item : term->rhs)
+        {
+            c = (item.first == TokenKind::Times ? "pl0_mul(" : "pl0_div(") + c + ", " + this->factor(item.second) + ")";
+        }
+        return c;
+    }
+
+    string factor(const Factor* factor)
+    {
+        switch (factor->kind())
+        {
+        case FactorKind::Num:
+        {
+            // the minimum value has no literal form in C
+            long long k = static_cast<long long>(factor->num());
+            return k == numeric_limits<Value>::min() ? "(" + to_string(k + 1) + " - 1)" : "(" + to_string(k) + ")";
+        }
+        case FactorKind::Var:
+            return this->var(factor->var(), true);
+        case FactorKind::Name:
+            throw "unresolved name: " + string(this->symbols->name(factor->name()));
+        case FactorKind::Expr:
+            return this->expression(factor->expr());
+        }
+        return "";
+    }
+};
+
+// FNV-1a over a byte range; `h` chains several ranges into one hash.
+uint64_t fnv1a(string_view data, uint64_t h = 0xcbf29ce484222325ull)
+{
+    for (unsigned char ch : data)
+    {
+        h = (h ^ ch) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+// A compiled program on disk. The image is an ImageHeader followed by 8-byte
+// aligned sections in host layout: the RegIr code, the ProcInfo table, the
+// constant pool, the symbol id of each variable slot, and the symbol table as an
+// offset array plus the concatenated names. Loading maps the file, checks the
+// header and checksum, and adopts each section with a single bulk copy; nothing is
+// lexed, parsed or decoded instruction by instruction. The code does not run from
+// the mapping itself: RegBytecode owns its sections in vectors, the mapping is
+// released when load() returns, and an image read from an unmappable file has no
+// mapping at all, so each section is copied once, which costs one memcpy of the
+// image rather than a compile. An image is only valid for
+// the format VERSION and Value mode (width and overflow checking) that wrote it,
+// and for the source it was compiled from.
+class BytecodeImage
 {
 public:
-    string mod;
-    Term* lhs;
-    vector<pair<string, Term*>> rhs;
-    Expression() {};
-    Expression(const Expression& expr)
+    static const uint32_t VERSION = 3;
+
+    // The cache key of a source: its bytes plus everything that changes the image.
+    static uint64_t hash(string_view source)
     {
-        this->mod = expr.mod;
-        this->lhs = expr.lhs;
-        this->rhs = expr.rhs;
+        uint32_t config[] = { VERSION, uint32_t(sizeof(Value)), uint32_t(VALUE_CHECKED), PL0_VALUE_MODE_ID };
+        return fnv1a(source, fnv1a(string_view(reinterpret_cast<const char*>(config), sizeof(config))));
     }
-    Expression(string mod, Term* lhs, vector<pair<string, Term*>> rhs)
+
+    static void write(ostream* out, const RegBytecode& rb, string_view source)
     {
-        this->mod = mod;
-        this->lhs = lhs;
-        this->rhs = rhs;
+        const SymbolTable* symbols = rb.source->symbols;
+        string body;
+        for (const RegIr& ir : rb.code)
+        {
+            RegIr packed;
+            memset(&packed, 0, sizeof(packed));  // no padding garbage in the file
+            packed.op = ir.op;
+            packed.dst = ir.dst;
+            packed.lhs = ir.lhs;
+            packed.rhs = ir.rhs;
+            append(&body, &packed, 1);
+        }
+        append(&body, rb.procs.data(), rb.procs.size());
+        append(&body, rb.constants.data(), rb.constants.size());
+        append(&body, rb.source->slotNames.data(), rb.source->slotNames.size());
+
+        vector<uint32_t> offsets{0};
+        string names;
+        for (int id = 0; id < symbols->size(); id++)
+        {
+            names += symbols->name(id);
+            offsets.push_back(names.size());
+        }
+        append(&body, offsets.data(), offsets.size());
+        append(&body, names.data(), names.size());
+
+        ImageHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MAGIC, sizeof(header.magic));
+        header.version = VERSION;
+        header.valueSize = sizeof(Value);
+        header.valueMode = PL0_VALUE_MODE_ID;
+        header.sourceHash = hash(source);
+        header.sourceSize = source.size();
+        header.checksum = fnv1a(body);
+        header.slots = rb.slots;
+        header.temps = rb.temps;
+        header.globals = rb.globals;
+        header.code = rb.code.size();
+        header.procs = rb.procs.size();
+        header.constants = rb.constants.size();
+        header.names = symbols->size();
+        header.nameBytes = names.size();
+
+        out->write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out->write(body.data(), body.size());
+    }
+
+    // Loads the image at `path` if it was compiled from `source`. Returns false for
+    // a missing, stale or damaged image.
+    bool load(const string& path, string_view source)
+    {
+        SourceFile file(path);
+        string copy;
+        string_view image = file.view();
+        if (!file.mapped())
+        {
+            stringstream buffer;
+            buffer << file.stream()->rdbuf();
+            copy = buffer.str();
+            image = copy;
+        }
+
+        ImageHeader header;
+        if (image.size() < sizeof(header))
+        {
+            return false;
+        }
+        memcpy(&header, image.data(), sizeof(header));
+        if (memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0 || header.version != VERSION
+            || header.valueSize != sizeof(Value) || header.valueMode != PL0_VALUE_MODE_ID || header.sourceHash != hash(source)
+            || header.sourceSize != source.size())
+        {
+            return false;
+        }
+
+        size_t expected = sizeof(header) + padded(header.code * sizeof(RegIr)) + padded(header.procs * sizeof(ProcInfo))
+                          + padded(header.constants * sizeof(Value)) + padded(size_t(header.slots) * sizeof(int))
+                          + padded((header.names + 1) * sizeof(uint32_t)) + padded(header.nameBytes);
+        if (image.size() != expected || fnv1a(image.substr(sizeof(header))) != header.checksum)
+        {
+            return false;
+        }
+
+        const char* p = image.data() + sizeof(header);
+        const RegIr* code = take<RegIr>(&p, header.code);
+        const ProcInfo* procs = take<ProcInfo>(&p, header.procs);
+        const Value* constants = take<Value>(&p, header.constants);
+        const int* slotNames = take<int>(&p, header.slots);
+        const uint32_t* offsets = take<uint32_t>(&p, header.names + 1);
+        if (!valid(header, code, procs, slotNames, offsets))
+        {
+            return false;
+        }
+
+        for (uint32_t id = 0; id < header.names; id++)
+        {
+            if (this->symbols.intern(string_view(p + offsets[id], offsets[id + 1] - offsets[id])) != int(id))
+            {
+                return false;  // a repeated name would renumber the symbols after it
+            }
+        }
+        // copied out of the mapping, which does not outlive this call
+        this->names.symbols = &this->symbols;
+        this->names.slotNames.assign(slotNames, slotNames + header.slots);
+
+        this->rb.code.assign(code, code + header.code);
+        this->rb.procs.assign(procs, procs + header.procs);
+        this->rb.constants.assign(constants, constants + header.constants);
+        this->rb.slots = header.slots;
+        this->rb.temps = header.temps;
+        this->rb.globals = header.globals;
+        this->rb.source = &this->names;
+        return true;
+    }
+
+    const RegBytecode* bytecode() const
+    {
+        return &this->rb;
+    }
+
+private:
+    static constexpr char MAGIC[8] = { 'P', 'L', '0', 'R', 'E', 'G', 'B', 'C' };
+
+    struct ImageHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t valueSize;
+        uint64_t sourceHash;
+        uint64_t sourceSize;
+        uint64_t checksum;  // FNV-1a of everything after the header
+        int32_t slots;
+        int32_t temps;
+        uint32_t code;
+        uint32_t procs;
+        uint32_t constants;
+        uint32_t names;
+        uint32_t nameBytes;
+        uint32_t valueMode;  // PL0_VALUE_MODE_ID: checked and wrapping 64-bit images differ only here
+        int32_t globals;
+    };
+
+    SymbolTable symbols;
+    Bytecode names;  // only symbols and slotNames, for printing
+    RegBytecode rb;
+
+    static size_t padded(size_t bytes)
+    {
+        return (bytes + 7) & ~size_t(7);
+    }
+
+    template<typename T>
+    static void append(string* out, const T* items, size_t count)
+    {
+        out->append(reinterpret_cast<const char*>(items), count * sizeof(T));
+        out->append(padded(out->size()) - out->size(), '\0');
+    }
+
+    template<typename T>
+    static const T* take(const char** p, size_t count)
+    {
+        const T* items = reinterpret_cast<const T*>(*p);
+        *p += padded(count * sizeof(T));
+        return items;
+    }
+
+    // Whether the sections of a checksummed image can be run and printed: every
+    // register, call frame, jump target, procedure entry and symbol id is in
+    // range, names lie inside the name bytes, the code cannot run off its end, and
+    // no Ret is reachable from the main program without a Call. The
+    // checksum only catches damage, not an image written by a broken compiler.
+    static bool valid(const ImageHeader& header, const RegIr* code, const ProcInfo* procs, const int* slotNames,
+                      const uint32_t* offsets)
+    {
+        if (header.slots < 0 || header.temps < 0 || header.globals < 0 || header.globals > header.slots || header.code == 0)
+        {
+            return false;
+        }
+        int64_t writable = int64_t(header.slots) + header.temps;
+        int64_t readable = writable + header.constants;
+        auto write = [&](int32_t reg) { return reg >= 0 && reg < writable; };
+        auto read = [&](int32_t reg) { return reg >= 0 && reg < readable; };
+        auto target = [&](int32_t pc) { return pc >= 0 && uint32_t(pc) < header.code; };
+
+        for (uint32_t pc = 0; pc < header.code; pc++)
+        {
+            const RegIr& ir = code[pc];
+            bool ok;
+            switch (ir.op)
+            {
+            case RegOpCode::Move:
+            case RegOpCode::Neg:
+            case RegOpCode::Odd:
+                ok = write(ir.dst) && read(ir.lhs);
+                break;
+            case RegOpCode::Jump:
+                ok = target(ir.dst);
+                break;
+            case RegOpCode::Call:
+                ok = target(ir.dst) && ir.lhs >= 0 && ir.rhs >= 0 && int64_t(ir.lhs) + ir.rhs <= header.slots;
+                break;
+            case RegOpCode::BrFalse:
+                ok = target(ir.dst) && read(ir.lhs);
+                break;
+            case RegOpCode::BrFalseEq:
+            case RegOpCode::BrFalseNe:
+            case RegOpCode::BrFalseLt:
+            case RegOpCode::BrFalseLte:
+            case RegOpCode::BrFalseGt:
+            case RegOpCode::BrFalseGte:
+                ok = target(ir.dst) && read(ir.lhs) && read(ir.rhs);
+                break;
+            case RegOpCode::Input:
+                ok = write(ir.dst);
+                break;
+            case RegOpCode::Output:
+                ok = read(ir.lhs);
+                break;
+            case RegOpCode::Ret:
+            case RegOpCode::Halt:
+                ok = true;
+                break;
+            case RegOpCode::Add:
+            case RegOpCode::Sub:
+            case RegOpCode::Mul:
+            case RegOpCode::Div:
+            case RegOpCode::Eq:
+            case RegOpCode::Ne:
+            case RegOpCode::Lt:
+            case RegOpCode::Lte:
+            case RegOpCode::Gt:
+            case RegOpCode::Gte:
+                ok = write(ir.dst) && read(ir.lhs) && read(ir.rhs);
+                break;
+            default:
+                ok = false;
+                break;
+            }
+            if (!ok)
+            {
+                return false;
+            }
+        }
+        RegOpCode last = code[header.code - 1].op;
+        if (last != RegOpCode::Ret && last != RegOpCode::Halt)
+        {
+            return false;
+        }
+
+        // the main program must not reach a Ret, which would return to no caller
+        vector<bool> seen(header.code, false);
+        vector<uint32_t> work = { 0 };
+        while (!work.empty())
+        {
+            uint32_t pc = work.back();
+            work.pop_back();
+            for (; pc < header.code && !seen[pc]; pc++)
+            {
+                seen[pc] = true;
+                RegOpCode op = code[pc].op;
+                if (op == RegOpCode::Ret)
+                {
+                    return false;
+                }
+                if (op == RegOpCode::Halt)
+                {
+                    break;
+                }
+                if (op == RegOpCode::Jump || (op >= RegOpCode::BrFalse && op <= RegOpCode::BrFalseGte))
+                {
+                    work.push_back(code[pc].dst);
+                }
+                if (op == RegOpCode::Jump)
+                {
+                    break;
+                }
+            }
+        }
+
+        auto symbol = [&](int id) { return id >= 0 && uint32_t(id) < header.names; };
+        for (uint32_t k = 0; k < header.procs; k++)
+        {
+            if (!target(procs[k].entry) || !symbol(procs[k].name))
+            {
+                return false;
+            }
+        }
+        for (int32_t slot = 0; slot < header.slots; slot++)
+        {
+            if (!symbol(slotNames[slot]))
+            {
+                return false;
+            }
+        }
+        for (uint32_t id = 0; id < header.names; id++)
+        {
+            if (offsets[id] > offsets[id + 1])
+            {
+                return false;
+            }
+        }
+        return offsets[header.names] <= header.nameBytes;
+    }
+};
+
+// A directory of BytecodeImages named by the hash of their source, so a hit skips
+// the whole front end. Images are written to a temporary name and renamed into
+// place, so concurrent compilers never see a partial image.
+class BytecodeCache
+{
+public:
+    int hits = 0;
+    int misses = 0;
+
+    BytecodeCache(const string& dir)
+    {
+        this->dir = dir;
+        error_code ec;
+        filesystem::create_directories(dir, ec);
+    }
+
+    string path(string_view source) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.pl0bc", (unsigned long long)BytecodeImage::hash(source));
+        return (filesystem::path(this->dir) / name).string();
+    }
+
+    bool load(string_view source, BytecodeImage* image)
+    {
+        string path = this->path(source);
+        error_code ec;
+        try
+        {
+            if (filesystem::exists(path, ec) && image->load(path, source))
+            {
+                this->hits++;
+                return true;
+            }
+        }
+        catch (const string&)
+        {
+            // removed since exists(): a miss
+        }
+        this->misses++;
+        return false;
+    }
+
+    // Returns false when the image could not be written; the cache is only an
+    // optimization, so callers carry on.
+    bool store(string_view source, const RegBytecode& rb)
+    {
+        string path = this->path(source);
+        ostringstream unique;
+        unique << path << ".tmp" << this_thread::get_id() << "." << chrono::steady_clock::now().time_since_epoch().count();
+        string tmp = unique.str();
+        {
+            ofstream out(tmp, ios::binary);
+            BytecodeImage::write(&out, rb, source);
+            if (!out.flush())
+            {
+                return false;
+            }
+        }
+        error_code ec;
+        filesystem::rename(tmp, path, ec);
+        if (ec)
+        {
+            filesystem::remove(tmp, ec);
+            return false;
+        }
+        return true;
     }
+
+private:
+    string dir;
 };
 
-class Const
+// Builds roughly `bytes` of PL/0 covering every token class, laid out in indented
+// lines with comments.
+string syntheticSource(size_t bytes)
+{
+    const string chunk = "const k = 42, limit = 1000;\nvar i, s, acc_1, tmp;\n{ squares i into tmp }\nprocedure square;\n"
+                         "\tbegin tmp := i * i end;\nbegin\n\ti := 0; s := 0;\n\twhile i <= limit do\n"
+                         "\tbegin\n\t\tcall square; s := s + tmp / ( k - 1 ); (* odd terms *)\n\t\tif odd i then acc_1 := acc_1 # 7;\n"
+                         "\t\ti := i + 1\n\tend;\n\tif s >= 123456 then s := s - 1\nend.\n";
+    string src;
+    src.reserve(bytes + chunk.size());
+    while (src.size() < bytes)
+    {
+        src += chunk;
+    }
+    return src;
+}
+
+// Lexes `src` `rounds` times with the given scanning path; returns the best time.
+double timeLexer(const string& src, ScanIsa isa, int rounds, long long* tokens)
+{
+    ScanIsa saved = scanIsa;
+    scanIsa = isa;
+    double best = 1e30;
+
+    for (int r = 0; r < rounds; r++)
+    {
+        SymbolTable symbols;
+        Lexer lx(src, &symbols);
+        long long count = 0;
+
+        auto t0 = chrono::steady_clock::now();
+        while (lx.next().ty != TokenKind::Eof)
+        {
+            count++;
+        }
+        auto t1 = chrono::steady_clock::now();
+
+        best = min(best, chrono::duration<double>(t1 - t0).count());
+        *tokens = count;
+    }
+    scanIsa = saved;
+    return best;
+}
+
+// Every scanning path this CPU supports, on the usual synthetic source and on one
+// with the long blank runs and names of generated code.
+int benchLexer(size_t bytes, int rounds)
+{
+    string wide;
+    wide.reserve(bytes + 256);
+    for (int k = 0; wide.size() < bytes; k++)
+    {
+        wide += "var generated_variable_number_" + to_string(k % 64) + ";\n" + string(48, ' ')
+                + to_string(k * 7919ull) + string(16, '\t') + "\n";
+    }
+    for (const string& src : { syntheticSource(bytes), wide })
+    {
+        long long tokens = 0;
+        double scalar = 0;
+        for (int isa = 0; isa <= static_cast<int>(bestScanIsa()); isa++)
+        {
+            double best = timeLexer(src, static_cast<ScanIsa>(isa), rounds, &tokens);
+            scalar = isa == 0 ? best : scalar;
+            cout << "lexer (" << scanIsaName(static_cast<ScanIsa>(isa)) << "): " << src.size() << " bytes, " << tokens
+                 << " tokens, best of " << rounds << ": " << best * 1e3 << " ms, " << tokens / best / 1e6 << " Mtokens/s, "
+                 << src.size() / best / (1 << 20) << " MB/s (" << scalar / best << "x)" << endl;
+        }
+    }
+    return 0;
+}
+
+// Builds a single program of roughly `bytes` made of one long begin ... end block.
+string syntheticProgram(size_t bytes)
+{
+    const string stmt = "a := a + 1; if a > b then b := a * ( 2 - c ) / 3; while odd c do c := c + 1; ";
+    string src = "const k = 7; var a, b, c; procedure p; b := b + k; begin ";
+    src.reserve(bytes + stmt.size() + 32);
+    while (src.size() < bytes)
+    {
+        src += stmt;
+    }
+    src += "call p end.";
+    return src;
+}
+
+int benchParser(size_t bytes, int rounds)
+{
+    string src = syntheticProgram(bytes);
+    double best = 1e30;
+    double ratio = 0;
+    size_t nodes = 0;
+
+    for (int r = 0; r < rounds; r++)
+    {
+        Arena arena;
+        SymbolTable symbols;
+        Lexer lx(src, &symbols);
+
+        auto t0 = chrono::steady_clock::now();
+        Parser ps = Parser(&lx, &arena);
+        ps.program();
+        auto t1 = chrono::steady_clock::now();
+
+        best = min(best, chrono::duration<double>(t1 - t0).count());
+        ratio = lx.scanRatio();
+        nodes = arena.nodes();
+    }
+
+    cout << "parser: " << src.size() << " bytes, " << nodes << " nodes, best of " << rounds << ": "
+         << best * 1e3 << " ms, " << src.size() / best / (1 << 20) << " MB/s, each byte scanned "
+         << ratio << "x" << endl;
+    return 0;
+}
+
+// `depth` nested parentheses around a literal, built directly: the parser would
+// need as deep a native stack to read it back.
+Expression* nestedExpression(Arena* arena, int depth)
+{
+    Factor* factor = arena->make<Factor>(FactorKind::Num, 1);
+    Expression* expr = nullptr;
+    for (int d = 0; d < depth; d++)
+    {
+        Term* term = arena->make<Term>(factor, vector<pair<TokenKind, Factor*>>());
+        expr = arena->make<Expression>(TokenKind::None, term, vector<pair<TokenKind, Term*>>());
+        factor = arena->make<Factor>(expr);
+    }
+    return expr;
+}
+
+int benchDump(size_t bytes, int rounds)
+{
+    string src = syntheticProgram(bytes);
+    Arena arena;
+    SymbolTable symbols;
+    Lexer lx(src, &symbols);
+    Parser ps = Parser(&lx, &arena);
+    Program* program = ps.program();
+    ofstream sink("/dev/null", ios::binary);
+
+    cout << "dump: " << src.size() << " bytes, " << arena.nodes() << " nodes" << endl;
+    for (AstFormat format : { AstFormat::Text, AstFormat::Json, AstFormat::Binary })
+    {
+        double best = 1e30;
+        size_t size = 0;
+        for (int r = 0; r < rounds; r++)
+        {
+            auto t0 = chrono::steady_clock::now();
+            AstDumper dumper(&sink, &symbols);
+            dumper.program(program, format);
+            dumper.flush();
+            auto t1 = chrono::steady_clock::now();
+            best = min(best, chrono::duration<double>(t1 - t0).count());
+            size = dumper.bytes();
+        }
+        const char* name = format == AstFormat::Text ? "text" : format == AstFormat::Json ? "json" : "binary";
+        cout << "  " << name << ": " << size << " bytes, best of " << rounds << ": " << best * 1e3 << " ms, "
+             << arena.nodes() / best / 1e6 << " Mnodes/s, " << size / best / (1 << 20) << " MB/s" << endl;
+    }
+
+    const int depth = 1000000;
+    Arena deep;
+    Expression* nested = nestedExpression(&deep, depth);
+    auto t0 = chrono::steady_clock::now();
+    AstDumper dumper(&sink, nullptr);
+    dumper.dump(AstNode{ AstKind::Expression, nested }, AstFormat::Json);
+    dumper.flush();
+    auto t1 = chrono::steady_clock::now();
+    cout << "  nested: " << depth << " levels, " << dumper.bytes() << " bytes of json in "
+         << chrono::duration<double>(t1 - t0).count() * 1e3 << " ms" << endl;
+    return 0;
+}
+
+// A program whose one statement nests `depth` levels deep: parentheses, begin
+// blocks, or alternating if and while statements.
+string nestedProgram(const string& shape, int depth)
+{
+    string src = "var a; ";
+    if (shape == "paren")
+    {
+        src += "a := " + string(depth, '(') + "a" + string(depth, ')');
+    }
+    else if (shape == "begin")
+    {
+        for (int d = 0; d < depth; d++)
+        {
+            src += "begin ";
+        }
+        src += "a := 1";
+        for (int d = 0; d < depth; d++)
+        {
+            src += " end";
+        }
+    }
+    else
+    {
+        for (int d = 0; d < depth; d++)
+        {
+            src += d % 2 ? "while odd a do " : "if a = 0 then ";
+        }
+        src += "a := 1";
+    }
+    return src + ".";
+}
+
+int benchNesting(int depth, int rounds)
+{
+    for (string shape : { "paren", "begin", "if-while" })
+    {
+        for (int d : { depth / 100, depth / 10, depth })
+        {
+            string src = nestedProgram(shape, d);
+            double best = 1e30;
+            size_t nodes = 0;
+            for (int r = 0; r < rounds; r++)
+            {
+                Arena arena;
+                SymbolTable symbols;
+                Lexer lx(src, &symbols);
+
+                auto t0 = chrono::steady_clock::now();
+                Parser ps = Parser(&lx, &arena);
+                ps.explicitStack = true;
+                ps.program();
+                auto t1 = chrono::steady_clock::now();
+
+                best = min(best, chrono::duration<double>(t1 - t0).count());
+                nodes = arena.nodes();
+            }
+            cout << "nesting: " << shape << " x " << d << ", " << nodes << " nodes, best of " << rounds << ": "
+                 << best * 1e3 << " ms, " << best / d * 1e9 << " ns per level" << endl;
+        }
+    }
+    return 0;
+}
+
+// The TEST_PROGRAM loop, repeated `outer` times so that s stays within 32 bits.
+string loopProgram(int outer)
+{
+    return "var i, j, s; begin j := 0; while j < " + to_string(outer) + " do begin "
+           "i := 0; s := 0; while i < 1000 do begin i := i + 1; s := s + i * i end; "
+           "j := j + 1 end end.";
+}
+
+// The TEST_PROGRAM2 loop: one call per inner iteration.
+string callLoopProgram(int outer)
 {
-public:
-    string name;
-    int value;
+    return "var x, squ, j; procedure square; begin squ := x * x end; begin j := 0; while j < "
+           + to_string(outer) + " do begin x := 1; while x <= 1000 do begin call square; "
+           "x := x + 1 end; j := j + 1 end end.";
+}
 
-    Const();
-    Const(const Const& _const)
-    {
-        this->name = _const.name;
-        this->value = _const.value;
-    }
-    Const(string name, int value)
+// A recursive procedure with a local, entered 100 deep `outer` times; each
+// activation keeps its own m, so every round adds 5050 to s.
+string recursiveProgram(int outer)
+{
+    return "var n, s, j; procedure sum; var m; begin m := n; n := n - 1; if n > 0 then call sum; "
+           "s := s + m end; begin j := 0; s := 0; while j < " + to_string(outer)
+           + " do begin n := 100; call sum; j := j + 1 end end.";
+}
+
+// Best wall time of `rounds` runs of a VM or RegVM from a reset state.
+template<typename Machine>
+double bestRun(Machine& vm, int rounds)
+{
+    double best = 1e30;
+    for (int r = 0; r < rounds; r++)
     {
-        this->name = name;
-        this->value = value;
+        vm.reset();
+        auto t0 = chrono::steady_clock::now();
+        vm.run();
+        auto t1 = chrono::steady_clock::now();
+        best = min(best, chrono::duration<double>(t1 - t0).count());
     }
-};
+    return best;
+}
 
-class Assign
+int benchVM(int outer, int rounds)
 {
-public:
-    string name;
-    Expression* expr;
+    string src = loopProgram(outer);
+    Arena arena;
+    SymbolTable symbols;
+    Lexer lx(src, &symbols);
+    Parser ps = Parser(&lx, &arena);
+    Program* program = ps.program();
+    Resolver().program(program);
+    Bytecode bc;
+    Compiler(&bc).program(program);
+
+    VM vm(&bc);
+    double best = bestRun(vm, rounds);
+
+    cout << "vm (" << VM::dispatchName() << "): " << vm << endl;
+    cout << "vm (" << VM::dispatchName() << "): best of " << rounds << ": " << best * 1e3 << " ms, "
+         << vm.executed / best / 1e6 << " Minstr/s, " << best * 1e9 / vm.executed << " ns/instr" << endl;
+    return 0;
+}
 
-    Assign() {};
-    Assign(const Assign& assign)
-    {
-        this->name = assign.name;
-        this->expr = assign.expr;
-    }
-    Assign(string name, Expression* expr)
+int benchRegisterVM(int outer, int rounds)
+{
+    for (const string& src : { loopProgram(outer), callLoopProgram(outer) })
     {
-        this->name = name;
-        this->expr = expr;
+        Arena arena;
+        SymbolTable symbols;
+        Lexer lx(src, &symbols);
+        Parser ps = Parser(&lx, &arena);
+        Program* program = ps.program();
+        Resolver().program(program);
+        Bytecode bc;
+        Compiler(&bc).program(program);
+        RegBytecode rb;
+        RegCompiler(&rb).program(&bc);
+
+        VM vm(&bc);
+        RegVM rvm(&rb);
+        double stackTime = bestRun(vm, rounds);
+        double regTime = bestRun(rvm, rounds);
+
+        cout << src << endl;
+        cout << "  stack (" << VM::dispatchName() << "): " << bc.code.size() << " static, " << vm.executed
+             << " executed, " << stackTime * 1e3 << " ms, " << vm.executed / stackTime / 1e6 << " Minstr/s" << endl;
+        cout << "  register (" << VM::dispatchName() << "): " << rb.code.size() << " static, " << rvm.executed
+             << " executed, " << regTime * 1e3 << " ms, " << rvm.executed / regTime / 1e6 << " Minstr/s" << endl;
+        cout << "  register/stack: " << double(rvm.executed) / vm.executed << "x instructions, "
+             << regTime / stackTime << "x time" << endl;
     }
-};
+    return 0;
+}
 
-class Call
+// Constant-heavy arithmetic in the style of generated code.
+string constantProgram(int outer)
 {
-public:
-    string name;
-    Call() {};
-    Call(const Call& call)
-    {
-        this->name = call.name;
-    }
-    Call(string name)
-    {
-        this->name = name;
-    }
-};
+    return "const w = 8, h = 4, scale = 100, debug = 0; var x, a, j; begin j := 0; while j < "
+           + to_string(outer) + " do begin x := 0; while x < 1000 do begin "
+           "a := x * (w * h) + scale / 10 - 0 * x + (w - h) * 1; "
+           "if debug = 1 then a := a + 1; "
+           "if w > h then a := a - (scale - 90) + 0; "
+           "x := x + 1 * 1 end; j := j + 1 end end.";
+}
 
-class Begin
+int benchFold(int outer, int rounds)
 {
-public:
-    vector<Statement*> body;
+    string src = constantProgram(outer);
+    cout << src << endl;
 
-    Begin() {};
-    Begin(const Begin& begin)
-    {
-        this->body = begin.body;
-    }
-    Begin(vector<Statement*> body)
+    for (bool fold : { false, true })
     {
-        this->body = body;
+        Arena arena;
+        SymbolTable symbols;
+        Lexer lx(src, &symbols);
+        Parser ps = Parser(&lx, &arena);
+        Program* program = ps.program();
+
+        ConstantFolder folder;
+        if (fold)
+        {
+            folder.program(program);
+        }
+        Resolver().program(program);
+
+        Bytecode bc;
+        Compiler(&bc).program(program);
+        VM vm(&bc);
+        double best = bestRun(vm, rounds);
+
+        cout << (fold ? "  folded:   " : "  unfolded: ") << bc.code.size() << " static, " << vm.executed
+             << " executed, " << best * 1e3 << " ms";
+        if (fold)
+        {
+            cout << " (" << folder.stats.constants << " constants, " << folder.stats.folds << " folds, "
+                 << folder.stats.identities << " identities, " << folder.stats.branches << " branches)";
+        }
+        cout << endl;
     }
-};
+    return 0;
+}
 
-class OddCondition
+// The naive AST walk against the same program compiled to closures, with the
+// stack VM for scale.
+int benchClosure(int outer, int rounds)
 {
-public:
-    Expression* expr;
-    OddCondition() {};
-    OddCondition(const OddCondition& odd_cond)
+    int status = 0;
+    for (const string& src : { loopProgram(outer), callLoopProgram(outer), constantProgram(outer), recursiveProgram(outer) })
     {
-        this->expr = odd_cond.expr;
+        Arena arena;
+        SymbolTable symbols;
+        Lexer lx(src, &symbols);
+        Parser ps = Parser(&lx, &arena);
+        Program* program = ps.program();
+        ConstantFolder().program(program);
+        Resolver().program(program);
+
+        AstInterpreter walk(program);
+        double walkTime = bestRun(walk, rounds);
+
+        auto t0 = chrono::steady_clock::now();
+        ClosureInterpreter closures(program);
+        auto t1 = chrono::steady_clock::now();
+        double closureTime = bestRun(closures, rounds);
+
+        Bytecode bc;
+        Compiler(&bc).program(program);
+        VM vm(&bc);
+        double vmTime = bestRun(vm, rounds);
+
+        cout << src << endl;
+        cout << "  ast walk: " << walkTime * 1e3 << " ms, " << walk.executed << " statements, "
+             << walkTime * 1e9 / walk.executed << " ns/statement" << endl;
+        cout << "  closures: " << closureTime * 1e3 << " ms (" << walkTime / closureTime << "x), " << closures.nodes
+             << " closures built in " << chrono::duration<double>(t1 - t0).count() * 1e6 << " us" << endl;
+        cout << "  stack vm (" << VM::dispatchName() << "): " << vmTime * 1e3 << " ms (" << walkTime / vmTime << "x)" << endl;
+        auto main = [&](const vector<Value>& values)
+        {
+            return vector<Value>(values.begin(), values.begin() + program->block->vars.size());
+        };
+        if (main(walk.frames) != main(vm.slots) || closures.frames[0] != main(vm.slots))
+        {
+            cout << "  MISMATCH: " << walk << " / " << closures << " / " << vm << endl;
+            status = 1;
+        }
     }
-    OddCondition(Expression* expr)
+    return status;
+}
+
+// Times every portable backend on the arithmetic loops in the Value mode this
+// binary was built with; build it once per mode to compare their cost.
+int benchValues(int outer, int rounds)
+{
+    cout << "values: " << PL0_VALUE_MODE << ", " << sizeof(Value) * 8 << " bits" << endl;
+    for (const string& src : { loopProgram(outer), callLoopProgram(outer) })
     {
-        this->expr = expr;
+        Arena arena;
+        SymbolTable symbols;
+        Lexer lx(src, &symbols);
+        Parser ps = Parser(&lx, &arena);
+        Program* program = ps.program();
+        ConstantFolder().program(program);
+        Resolver().program(program);
+
+        AstInterpreter walk(program);
+        double walkTime = bestRun(walk, rounds);
+        ClosureInterpreter closures(program);
+        double closureTime = bestRun(closures, rounds);
+
+        Bytecode bc;
+        Compiler(&bc).program(program);
+        RegBytecode rb;
+        RegCompiler(&rb).program(&bc);
+        VM vm(&bc);
+        double vmTime = bestRun(vm, rounds);
+        RegVM rvm(&rb);
+        double regTime = bestRun(rvm, rounds);
+        Peephole(&bc).run();
+        VM fused(&bc);
+        double fusedTime = bestRun(fused, rounds);
+
+        cout << src << endl;
+        cout << "  ast walk: " << walkTime * 1e3 << " ms" << endl;
+        cout << "  closures: " << closureTime * 1e3 << " ms" << endl;
+        cout << "  stack vm: " << vmTime * 1e3 << " ms, " << vmTime * 1e9 / vm.executed << " ns/instr" << endl;
+        cout << "  peephole vm: " << fusedTime * 1e3 << " ms, " << fusedTime * 1e9 / fused.executed << " ns/instr" << endl;
+        cout << "  register vm: " << regTime * 1e3 << " ms, " << regTime * 1e9 / rvm.executed << " ns/instr" << endl;
     }
-};
+    return 0;
+}
 
-class StdCondition
+// Random programs for checkBackends: expressions over extreme literals, and a
+// recursive procedure with a local that it reads back after the recursive call and
+// that a nested procedure reads, so per-activation frames, access to an enclosing
+// frame, the operators' wrap-around or traps, and division by zero are all
+// exercised.
+class RandomProgram
 {
 public:
-    string op;
-    Expression* lhs;
-    Expression* rhs;
-    StdCondition() {};
-    StdCondition(const StdCondition& std_cond)
-    {
-        this->op = std_cond.op;
-        this->lhs = std_cond.lhs;
-        this->rhs = std_cond.rhs;
-    }
-    StdCondition(string op, Expression* lhs, Expression* rhs)
+    RandomProgram(uint64_t seed) : rng(seed)
     {
-        this->op = op;
-        this->lhs = lhs;
-        this->rhs = rhs;
     }
-};
 
-class Condition
-{
-public:
-    OddCondition* oddCond;
-    StdCondition* stdCond;
-    Condition() {};
-    Condition(const Condition& cond)
+    string next()
     {
-        this->oddCond = cond.oddCond;
-        this->stdCond = cond.stdCond;
+        string src = "var a, b, c, d; procedure p; var m; procedure q; var k; begin k := " + this->expr(0, "m")
+                     + "; b := " + this->expr(0, "k") + " end; begin m := " + this->expr(0, "d") + "; d := d - 1; ";
+        src += this->pick(2) ? "if d > 0 then call p; " : "while d > 0 do call p; ";
+        src += "if " + this->expr(1, "m") + (this->pick(2) ? " < " : " # ") + this->expr(1, "m") + " then call q; "
+               "a := a + " + this->expr(0, "m") + " end; "
+               "begin a := " + this->literal() + "; b := " + this->literal() + "; c := " + this->expr(0, "c")
+               + "; d := " + to_string(this->pick(6)) + "; call p; c := c - " + this->literal() + " end.";
+        return src;
     }
-    Condition(OddCondition* odd_ptr, StdCondition* std_ptr)
+
+private:
+    mt19937_64 rng;
+
+    unsigned pick(unsigned n)
     {
-        this->oddCond = odd_ptr;
-        this->stdCond = std_ptr;
+        return this->rng() % n;
     }
-};
 
-class If
-{
-public:
-    Condition* cond;
-    Statement* then;
-    If() {};
-    If(const If& _if)
+    // Small values mostly, so that most programs run to the end.
+    string literal(bool divisor = false)
     {
-        this->cond = _if.cond;
-        this->then = _if.then;
+        const Value top = numeric_limits<Value>::max();
+        const Value picks[] = { 0, 1, 2, 3, 7, 10, 46341, 65536, top, top - 1, top / 2, top / 3, top / 46341 + 1 };
+        unsigned k = this->pick(8) ? this->pick(6) : this->pick(sizeof(picks) / sizeof(picks[0]));
+        ostringstream out;
+        out << picks[divisor && k == 0 ? 1 : k];
+        return out.str();
     }
-    If(Condition* cond, Statement* then)
+
+    string factor(int depth, const string& local)
     {
-        this->cond = cond;
-        this->then = then;
+        unsigned r = this->pick(6);
+        if (depth > 1 || r < 2)
+        {
+            return this->literal();
+        }
+        if (r < 4)
+        {
+            const string names[] = { "a", "b", "c", local };
+            return names[this->pick(4)];
+        }
+        return "(" + this->expr(depth + 1, local) + ")";
     }
-};
 
-class While
-{
-public:
-    Condition* cond;
-    Statement* then;
-    While() {};
-    While(const While& _while)
+    string term(int depth, const string& local)
     {
-        this->cond = _while.cond;
-        this->then = _while.then;
+        string s = this->factor(depth, local);
+        for (unsigned k = this->pick(3); k > 0; k--)
+        {
+            // Divisors are mostly nonzero literals; the rest may well be zero.
+            bool divide = this->pick(4) == 0;
+            s += divide ? " / " + (this->pick(8) ? this->literal(true) : this->factor(depth, local))
+                        : " * " + this->factor(depth, local);
+        }
+        return s;
     }
-    While(Condition* cond, Statement* then)
+
+    string expr(int depth, const string& local)
     {
-        this->cond = cond;
-        this->then = then;
+        string s = (this->pick(4) ? "" : "-") + this->term(depth, local);
+        for (unsigned k = this->pick(4); k > 0; k--)
+        {
+            s += (this->pick(2) ? " + " : " - ") + this->term(depth, local);
+        }
+        return s;
     }
 };
 
-class Statement
+// Runs `src` on one backend, with or without constant folding, and returns the
+// main program's variables, or the error it stopped with.
+string runBackend(const string& src, int backend, bool fold)
 {
-public:
-    Assign* stmtA;
-    Begin* stmtB;
-    Call* stmtC;
-    If* stmtI;
-    While* stmtW;
+    ostringstream out;
+    try
+    {
+        Arena arena;
+        SymbolTable symbols;
+        Lexer lx(src, &symbols);
+        Parser ps = Parser(&lx, &arena);
+        Program* program = ps.program();
+        if (fold)
+        {
+            ConstantFolder().program(program);
+        }
+        Resolver().program(program);
 
-    Statement() {};
-    Statement(const Statement& state)
+        if (backend == 0)
+        {
+            AstInterpreter walk(program);
+            walk.run();
+            out << walk;
+        }
+        else if (backend == 1)
+        {
+            ClosureInterpreter closures(program);
+            closures.run();
+            out << closures;
+        }
+        else
+        {
+            Bytecode bc;
+            Compiler(&bc).program(program);
+            if (backend == 3)
+            {
+                Peephole(&bc).run();
+            }
+            if (backend <= 3)
+            {
+                VM vm(&bc);
+                vm.run();
+                out << vm;
+            }
+            else
+            {
+                RegBytecode rb;
+                RegCompiler(&rb).program(&bc);
+                Jit jit;
+                if (backend == 5 && jit.compile(&rb))
+                {
+                    jit.run();
+                    out << jit;
+                }
+                else if (backend == 5)
+                {
+                    out << "not compiled by the JIT";
+                }
+                else
+                {
+                    RegVM rvm(&rb);
+                    rvm.run();
+                    out << rvm;
+                }
+            }
+        }
+    }
+    catch (const char* msg)
     {
-        this->stmtA = state.stmtA;
-        this->stmtB = state.stmtB;
-        this->stmtC = state.stmtC;
-        this->stmtI = state.stmtI;
-        this->stmtW = state.stmtW;
+        out << msg;
     }
-    Statement(Assign* stmtA, Begin* stmtB, Call* stmtC, If* stmtI, While* stmtW)
+    catch (const string& msg)
     {
-        this->stmtA = stmtA;
-        this->stmtB = stmtB;
-        this->stmtC = stmtC;
-        this->stmtI = stmtI;
-        this->stmtW = stmtW;
+        out << msg;
     }
-};
+    string result = out.str();
+    return result.substr(0, result.rfind(" ("));  // without the backend's work count
+}
 
-class Procedure
+// Runs recursive programs with known results, then `programs` random programs, on
+// the AST walk, the closures, the stack VM with and without superinstructions, the
+// register VM and, where it can compile them, the JIT, each with and without
+// constant folding, and reports every program where a backend disagrees with the
+// expected result. The AST walk defines the expected result of a random program.
+int checkBackends(int programs)
 {
-public:
-    string name;
-    Block* body;
+    const char* names[] = { "ast walk", "closures", "stack vm", "peephole vm", "register vm", "jit" };
+    int backends = Jit::available() && sizeof(Value) == 4 ? 6 : 5;
+    int mismatches = 0;
+    auto check = [&](const string& src, const string& expected)
+    {
+        for (int backend = 0; backend < backends; backend++)
+        {
+            for (bool fold : { false, true })
+            {
+                string got = runBackend(src, backend, fold);
+                if (got != expected && mismatches++ < 10)
+                {
+                    cout << names[backend] << (fold ? " (folded)" : "") << " differs on " << src << endl
+                         << "  expected: " << expected << endl << "  got:      " << got << endl;
+                }
+            }
+        }
+    };
 
-    Procedure() {};
-    Procedure(const Procedure& pro)
+    check(TEST_PROGRAM3, "n = 0, f = 3628800");
+    check("var a; procedure p; var m; begin m := a; a := a - 1; if a > 0 then call p; a := a + m end; "
+          "begin a := 3; call p end.", "a = 6");
+
+    RandomProgram gen(7);
+    int errors = 0;
+    for (int n = 0; n < programs; n++)
     {
-        this->name = pro.name;
-        this->body = pro.body;
+        string src = gen.next();
+        string expected = runBackend(src, 0, false);
+        errors += expected.find(" = ") == string::npos;
+        check(src, expected);
     }
-    Procedure(string name, Block* body)
+    cout << PL0_VALUE_MODE << ": " << programs << " programs, " << errors << " stopped with an error, "
+         << mismatches << " mismatches" << endl;
+    return mismatches != 0;
+}
+
+int benchPeephole(int outer, int rounds)
+{
+    Peephole total(nullptr);
+
+    for (const string& src : { loopProgram(outer), callLoopProgram(outer), constantProgram(outer) })
     {
-        this->name = name;
-        this->body = body;
+        Arena arena;
+        SymbolTable symbols;
+        Lexer lx(src, &symbols);
+        Parser ps = Parser(&lx, &arena);
+        Program* program = ps.program();
+        ConstantFolder().program(program);
+        Resolver().program(program);
+
+        Bytecode bc;
+        Compiler(&bc).program(program);
+        Bytecode opt = bc;
+        Peephole peephole(&opt);
+        peephole.run();
+
+        VM vm(&bc);
+        VM ovm(&opt);
+        double plainTime = bestRun(vm, rounds);
+        double optTime = bestRun(ovm, rounds);
+
+        cout << src << endl;
+        cout << "  plain:     " << bc.code.size() << " static, " << vm.executed << " executed, " << plainTime * 1e3 << " ms" << endl;
+        cout << "  peephole:  " << opt.code.size() << " static, " << ovm.executed << " executed, " << optTime * 1e3 << " ms" << endl;
+        cout << "  patterns:  " << peephole << endl;
+
+        for (size_t p = 0; p < total.hits.size(); p++)
+        {
+            total.hits[p] += peephole.hits[p];
+        }
     }
-};
 
-class Block
-{
-public:
-    vector<Const*> consts;
-    vector<string> vars;
-    vector<Procedure*> procs;
-    Statement* stmt;
+    cout << "all patterns: " << total << endl;
+    return 0;
+}
 
-    Block(vector<Const*> consts, vector<string> vars, vector<Procedure*> procs, Statement* stmt)
+int benchJit(int outer, int rounds)
+{
+    for (const string& src : { loopProgram(outer), callLoopProgram(outer), constantProgram(outer) })
     {
-        this->consts = consts;
-        this->vars = vars;
-        this->procs = procs;
-        this->stmt = stmt;
+        Arena arena;
+        SymbolTable symbols;
+        Lexer lx(src, &symbols);
+        Parser ps = Parser(&lx, &arena);
+        Program* program = ps.program();
+        ConstantFolder().program(program);
+        Resolver().program(program);
+
+        Bytecode bc;
+        Compiler(&bc).program(program);
+        RegBytecode rb;
+        RegCompiler(&rb).program(&bc);
+        Peephole(&bc).run();
+
+        VM vm(&bc);
+        RegVM rvm(&rb);
+        double stackTime = bestRun(vm, rounds);
+        double regTime = bestRun(rvm, rounds);
+
+        cout << src << endl;
+        cout << "  stack vm (peephole): " << stackTime * 1e3 << " ms" << endl;
+        cout << "  register vm:         " << regTime * 1e3 << " ms" << endl;
+
+        Jit jit;
+        if (!jit.compile(&rb))
+        {
+            cout << "  jit: not available for this program or host" << endl;
+            continue;
+        }
+        double jitTime = bestRun(jit, rounds);
+
+        bool same = true;
+        for (int slot = 0; slot < rb.globals; slot++)
+        {
+            same = same && jit.slot(slot) == rvm.regs[slot];
+        }
+        cout << "  jit:                 " << jitTime * 1e3 << " ms (" << regTime / jitTime << "x register vm, "
+             << jit.codeSize() << " bytes, " << jit.registersAllocated() << " host registers, "
+             << (same ? "results match" : "RESULTS DIFFER") << ")" << endl;
     }
+    return 0;
+}
 
-    Block() {};
-    Block(const Block& block)
+// Compiles each benchmark loop to C with CEmitter, builds it with $CC (default cc)
+// at -O2, and times the executable, process start included, against the VMs.
+int benchAot(int outer, int rounds)
+{
+    const char* cc = getenv("CC") != nullptr ? getenv("CC") : "cc";
+    string base = string(getenv("TMPDIR") != nullptr ? getenv("TMPDIR") : "/tmp") + "/pl0_aot";
+
+    for (const string& src : { loopProgram(outer), callLoopProgram(outer), constantProgram(outer) })
     {
-        this->consts = block.consts;
-        this->vars = block.vars;
-        this->procs = block.procs;
-        this->stmt = block.stmt;
+        Arena arena;
+        SymbolTable symbols;
+        Lexer lx(src, &symbols);
+        Parser ps = Parser(&lx, &arena);
+        Program* program = ps.program();
+        ConstantFolder().program(program);
+        Resolver().program(program);
+
+        Bytecode bc;
+        Compiler(&bc).program(program);
+        RegBytecode rb;
+        RegCompiler(&rb).program(&bc);
+        RegVM rvm(&rb);
+        double regTime = bestRun(rvm, rounds);
+
+        {
+            ofstream file(base + ".c");
+            CEmitter(&file).program(program);
+        }
+        string build = string(cc) + " -O2 -o " + base + " " + base + ".c";
+        if (system(build.c_str()) != 0)
+        {
+            cout << "aot: '" << build << "' failed" << endl;
+            return 1;
+        }
+
+        double best = 1e30;
+        for (int r = 0; r < rounds; r++)
+        {
+            auto t0 = chrono::steady_clock::now();
+            int status = system((base + " > " + base + ".out").c_str());
+            auto t1 = chrono::steady_clock::now();
+            if (status != 0)
+            {
+                cout << "aot: " << base << " exited with " << status << endl;
+                return 1;
+            }
+            best = min(best, chrono::duration<double>(t1 - t0).count());
+        }
+
+        ostringstream expected;
+        for (int slot = 0; slot < rb.globals; slot++)
+        {
+            expected << RegName{&rb, slot} << " = " << rvm.regs[slot] << "\n";
+        }
+        ifstream output(base + ".out");
+        stringstream actual;
+        actual << output.rdbuf();
+
+        cout << src << endl;
+        cout << "  register vm: " << regTime * 1e3 << " ms" << endl;
+        cout << "  native (" << cc << " -O2): " << best * 1e3 << " ms including process start, "
+             << regTime / best << "x register vm, " << (actual.str() == expected.str() ? "results match" : "RESULTS DIFFER") << endl;
     }
-};
+    return 0;
+}
 
-class Program
+// Prints an error message of `path`, which may hold one diagnostic per line, as
+// `path:line:column: message` lines.
+void printError(const string& path, const string& message)
 {
-public:
-    Block* block;
-    Program(Block* block)
+    istringstream lines(message);
+    string line;
+    while (getline(lines, line))
     {
-        this->block = block;
+        cerr << path << ":" << (isDIGIT(line[0]) ? "" : " ") << line << endl;
     }
-};
+}
 
-class Parser
+// A fixed set of worker threads, each with its own deque of task indices. A
+// worker pops from the back of its own deque and, once that is empty, steals from
+// the front of the others', so an unlucky split of large files does not leave
+// cores idle. All tasks are known when run() starts, so the pool is done when
+// every deque is empty.
+class WorkStealingPool
 {
 public:
-    Lexer* lx;
+    long long steals = 0;  // tasks run by a worker other than the one they were dealt to
 
-    Parser(Lexer* lx)
+    WorkStealingPool(int threads)
     {
-        this->lx = lx;
+        this->queues = vector<Queue>(max(threads, 1));
     }
 
-    bool check(int ty, string valString, int valInt)
+    int size() const
     {
-        int p = this->lx->i;
-        Token tk = this->lx->next();
+        return this->queues.size();
+    }
 
-        if (tk.ty == ty && tk.valInt == valInt && tk.valString == valString)
+    // Runs task(worker, index) for every index in [0, count) and returns when all
+    // have finished. Tasks must not throw: they catch their own errors and record them.
+    template<typename Task>
+    void run(size_t count, Task task)
+    {
+        for (size_t k = 0; k < count; k++)
         {
-            return true;
+            this->queues[k % this->queues.size()].tasks.push_back(k);
         }
 
-        this->lx->i = p;
-        return false;
+        atomic<long long> stolen(0);
+        auto work = [&](int self)
+        {
+            size_t index;
+            while (true)
+            {
+                if (this->pop(self, &index))
+                {
+                    task(self, index);
+                }
+                else if (this->steal(self, &index))
+                {
+                    stolen++;
+                    task(self, index);
+                }
+                else
+                {
+                    return;
+                }
+            }
+        };
+
+        vector<thread> threads;
+        for (int w = 1; w < this->size(); w++)
+        {
+            threads.emplace_back(work, w);
+        }
+        work(0);
+        for (thread& t : threads)
+        {
+            t.join();
+        }
+        this->steals += stolen;
     }
 
-    void expect(int ty, string valString, int valInt)
+private:
+    struct Queue
     {
-        Token tk = this->lx->next();
-        int tty = tk.ty;
-        string tvalString = tk.valString;
-        int tvalInt = tk.valInt;
+        mutex lock;
+        deque<size_t> tasks;
+    };
 
-        if (tty != ty)
-        {
-            throw ty + " expected, got " + tty;
-        }
+    vector<Queue> queues;
 
-        if (tty == TokenKindStringToInt["Num"] && valInt != tvalInt)
+    bool pop(int self, size_t* index)
+    {
+        Queue& q = this->queues[self];
+        lock_guard<mutex> guard(q.lock);
+        if (q.tasks.empty())
         {
-            throw intToString(valInt) + " expected, got " + intToString(tvalInt);
+            return false;
         }
+        *index = q.tasks.back();
+        q.tasks.pop_back();
+        return true;
+    }
 
-        if (tty != TokenKindStringToInt["Num"] && valString != tvalString)
+    bool steal(int self, size_t* index)
+    {
+        for (int k = 1; k < this->size(); k++)
         {
-            throw valString + " expected, got " + tvalString;
+            Queue& q = this->queues[(self + k) % this->size()];
+            lock_guard<mutex> guard(q.lock);
+            if (!q.tasks.empty())
+            {
+                *index = q.tasks.front();
+                q.tasks.pop_front();
+                return true;
+            }
         }
+        return false;
     }
-
-    Program program();
-    Block block();
-    vector<Const*> _const();
-    vector<string> var();
-    Procedure procedure();
-    Statement statement();
-    Condition condition();
-    OddCondition odd_condition();
-    StdCondition std_condition();
-    Expression expression();
-    Term term();
-    Factor factor();
 };
 
-Program Parser::program()
+// Front end and bytecode generation for one source, as a deployment compiles it:
+// parse, fold, resolve, compile and peephole-optimize. Returns the code size.
+size_t compileUnit(Lexer* lx, Arena* arena)
 {
-    Block block = this->block();
-    this->expect(TokenKindStringToInt["Op"], ".", 0);
-    return Program(&block);
+    Parser ps = Parser(lx, arena);
+    Program* program = ps.program();
+    ConstantFolder().program(program);
+    Resolver().program(program);
+    Bytecode bc;
+    Compiler(&bc).program(program);
+    Peephole(&bc).run();
+    return bc.code.size();
 }
 
-Block Parser::block()
+// Per-file results of a batch, in input order, and the batch totals.
+struct BatchReport
 {
-    vector<string> vars;
-    vector<Procedure*> procs;
-    vector<Const*> consts;
-
-    if (this->check(TokenKindStringToInt["KeyWord"], "const", 0))
+    vector<double> seconds;
+    vector<size_t> bytes;
+    vector<string> errors;  // empty for a file that compiled
+    double wall = 0;
+    int threads = 0;
+    long long steals = 0;
+
+    void resize(size_t files)
     {
-        consts = this->_const();
+        this->seconds.assign(files, 0);
+        this->bytes.assign(files, 0);
+        this->errors.assign(files, string());
     }
+};
 
-    if (this->check(TokenKindStringToInt["KeyWord"], "var", 0))
+ostream& operator<<(ostream& cout, const BatchReport& report)
+{
+    size_t files = report.seconds.size();
+    size_t bytes = 0;
+    size_t failed = 0;
+    for (size_t k = 0; k < files; k++)
     {
-        vars = this->var();
+        bytes += report.bytes[k];
+        failed += !report.errors[k].empty();
     }
 
-    while (this->check(TokenKindStringToInt["KeyWord"], "procedure", 0))
+    vector<double> sorted = report.seconds;
+    sort(sorted.begin(), sorted.end());
+    auto percentile = [&](double p)
     {
-        auto proc = this->procedure();
-        procs.push_back(&proc);
-    }
-
-    Statement stmt = this->statement();
-    return Block(consts, vars, procs, &stmt);
+        return sorted.empty() ? 0.0 : sorted[min(sorted.size() - 1, size_t(p * sorted.size()))] * 1e6;
+    };
+
+    cout << files << " files (" << failed << " failed), " << bytes << " bytes on " << report.threads
+         << " threads in " << report.wall * 1e3 << " ms: " << files / report.wall << " files/s, "
+         << bytes / report.wall / (1 << 20) << " MB/s, " << report.steals << " steals; latency p50 "
+         << percentile(0.5) << " us, p90 " << percentile(0.9) << " us, p99 " << percentile(0.99)
+         << " us, max " << percentile(1.0) << " us";
+    return cout;
 }
 
-vector<Const*> Parser::_const()
+// Compiles `count` sources on a WorkStealingPool. load(k, symbols) builds the
+// Lexer for source k. Each worker reuses one Arena across its files, and every
+// compilation has its own SymbolTable, Lexer and Parser, so nothing is shared.
+template<typename Load>
+BatchReport batchCompile(size_t count, int threads, Load load)
 {
-    vector<Const*> ans;
-    while (1)
-    {
-        Token name = this->lx->next();
-        int ty = name.ty;
-
-        if (ty != TokenKindStringToInt["Name"])
-        {
-            throw "name expected";
-        }
+    BatchReport report;
+    report.resize(count);
 
-        this->expect(TokenKindStringToInt["Op"], "=", 0);
-        Token num = this->lx->next();
-
-        if (num.ty != TokenKindStringToInt["Num"])
+    WorkStealingPool pool(threads);
+    vector<Arena> arenas(pool.size());
+    auto t0 = chrono::steady_clock::now();
+    pool.run(count, [&](int worker, size_t k)
+    {
+        auto start = chrono::steady_clock::now();
+        Arena& arena = arenas[worker];
+        arena.reset();
+        try
         {
-            throw "number expected";
+            SymbolTable symbols;
+            auto lx = load(k, &symbols);
+            compileUnit(lx.get(), &arena);
+            report.bytes[k] = lx->length();
         }
-        else
+        catch (const char* msg)
         {
-            Const* con = new Const(name.valString, num.valInt);
-            ans.push_back(con);
+            report.errors[k] = msg;
         }
-
-        if (this->check(TokenKindStringToInt["Op"], ";", 0))
+        catch (const string& msg)
         {
-            return ans;
+            report.errors[k] = msg;
         }
-        else
+        catch (const exception& e)
         {
-            this->expect(TokenKindStringToInt["Op"], ",", 0);
+            // e.g. bad_alloc; an escaping exception would terminate the worker thread
+            report.errors[k] = e.what();
         }
-    }
+        report.seconds[k] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    });
+
+    report.wall = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    report.threads = pool.size();
+    report.steals = pool.steals;
+    return report;
 }
 
-vector<string> Parser::var()
+// Expands the arguments of --batch: a directory stands for every *.pl0 file below
+// it, and @list for the paths listed one per line in `list`.
+vector<string> batchPaths(const vector<string>& args)
 {
-    vector<string> ans;
-    while (1)
+    vector<string> paths;
+    for (const string& arg : args)
     {
-        Token name = this->lx->next();
-        int ty = name.ty;
-
-        if (ty != TokenKindStringToInt["Name"])
-        {
-            throw "name expected";
-        }
-        else
+        if (arg.size() > 1 && arg[0] == '@')
         {
-            ans.push_back(name.valString);
+            ifstream list(arg.substr(1));
+            if (!list)
+            {
+                throw "cannot open " + arg.substr(1);
+            }
+            string line;
+            while (getline(list, line))
+            {
+                if (!line.empty())
+                {
+                    paths.push_back(line);
+                }
+            }
         }
-
-        if (this->check(TokenKindStringToInt["Op"], ";", 0))
+        else if (error_code ec; filesystem::is_directory(arg, ec))
         {
-            return ans;
+            // skip unreadable subdirectories rather than let filesystem_error escape
+            vector<string> found;
+            auto options = filesystem::directory_options::skip_permission_denied;
+            filesystem::recursive_directory_iterator it(arg, options, ec), end;
+            for (; !ec && it != end; it.increment(ec))
+            {
+                error_code statusError; // a dangling link is not a source, not a failure
+                if (it->is_regular_file(statusError) && it->path().extension() == ".pl0")
+                {
+                    found.push_back(it->path().string());
+                }
+            }
+            if (ec)
+            {
+                throw "cannot read " + arg + ": " + ec.message();
+            }
+            sort(found.begin(), found.end());
+            paths.insert(paths.end(), found.begin(), found.end());
         }
         else
         {
-            this->expect(TokenKindStringToInt["Op"], ",", 0);
+            paths.push_back(arg);
         }
     }
+    return paths;
 }
 
-Procedure Parser::procedure()
+int runBatch(const vector<string>& args, int threads)
 {
-    Token name = this->lx->next();
-    int ty = name.ty;
+    vector<string> paths = batchPaths(args);
 
-    if (ty != TokenKindStringToInt["Name"])
+    // A mapped SourceFile must outlive its Lexer, so the two are allocated together.
+    BatchReport report = batchCompile(paths.size(), threads, [&](size_t k, SymbolTable* symbols)
     {
-        throw "name expected";
-    }
-    this->expect(TokenKindStringToInt["Op"], ";", 0);
+        struct FileLexer
+        {
+            SourceFile file;
+            Lexer lx;
 
-    Block block = this->block();
-    this->expect(TokenKindStringToInt["Op"], ";", 0);
+            FileLexer(const string& path, SymbolTable* symbols)
+                : file(path), lx(file.mapped() ? Lexer(file.view(), symbols) : Lexer(file.stream(), symbols))
+            {
+            }
+        };
+        auto unit = make_shared<FileLexer>(paths[k], symbols);
+        return shared_ptr<Lexer>(unit, &unit->lx);
+    });
 
-    return Procedure(name.valString, &block);
+    int status = 0;
+    for (size_t k = 0; k < paths.size(); k++)
+    {
+        if (!report.errors[k].empty())
+        {
+            printError(paths[k], report.errors[k]);
+            status = 1;
+        }
+    }
+    cout << "batch: " << report << endl;
+    return status;
 }
 
-Statement Parser::statement()
+// Many small generated programs, compiled on one thread and then on every core.
+int benchBatch(int files, int rounds)
 {
-    Assign* ass = new Assign;
-    Begin* beg = new Begin;
-    Call* cal = new Call;
-    If* _if = new If;
-    While* whi = new While;
-    if (this->check(TokenKindStringToInt["KeyWord"], "call", 0))
+    vector<string> sources;
+    for (int k = 0; k < files; k++)
+    {
+        // vary the sizes so that the round-robin deal leaves work to steal
+        sources.push_back(k % 16 == 0 ? syntheticProgram(64 << 10) : syntheticProgram((1 + k % 8) << 10));
+    }
+
+    int cores = max(1u, thread::hardware_concurrency());
+    for (int threads : { 1, cores })
     {
-        Token ident = this->lx->next();
-        if (ident.ty != TokenKindStringToInt["Name"])
+        BatchReport best;
+        for (int r = 0; r < rounds; r++)
         {
-            throw "name expected";
+            BatchReport report = batchCompile(sources.size(), threads, [&](size_t k, SymbolTable* symbols)
+            {
+                return make_shared<Lexer>(string_view(sources[k]), symbols);
+            });
+            if (r == 0 || report.wall < best.wall)
+            {
+                best = report;
+            }
         }
-        else
+        cout << "batch: " << best << endl;
+        if (threads == cores)
         {
-            cal->name = ident.valString;
-            return Statement(ass, beg, cal, _if, whi);
+            break;
         }
     }
+    return 0;
+}
 
-    else if (this->check(TokenKindStringToInt["KeyWord"], "begin", 0))
+// Compiles and runs one source named on the command line: parse, fold and resolve,
+// then emit C or run the register VM (the JIT with --jit). With a cache, a mapped
+// source whose image is cached skips the front end, and a miss stores its image.
+// The program's variables go to stdout, sizes to stderr.
+void runSource(const SourceFile& file, bool useJit, bool emitC, BytecodeCache* cache, AstFormat dump, bool explicitStack)
+{
+    Arena arena;
+    SymbolTable symbols;
+    Bytecode bc;
+    RegBytecode rb;
+    BytecodeImage image;
+    const RegBytecode* code = &rb;
+    bool cached = cache != nullptr && file.mapped() && !emitC && dump == AstFormat::None;
+
+    if (cached && cache->load(file.view(), &image))
     {
-        vector<Statement*> body;
-
-        while (1)
+        code = image.bytecode();
+        cerr << file.name() << ": " << file.view().size() << " bytes, cached image " << cache->path(file.view()) << endl;
+    }
+    else
+    {
+        Lexer lx = file.mapped() ? Lexer(file.view(), &symbols) : Lexer(file.stream(), &symbols);
+        Parser ps = Parser(&lx, &arena);
+        ps.explicitStack = explicitStack;
+        Program* program = ps.program();
+        if (dump != AstFormat::None)
         {
-            Statement stmt = this->statement();
-            body.push_back(&stmt);
-
-            if (this->check(TokenKindStringToInt["KeyWord"], "end", 0))
-            {
-                break;
-            }
-            else
+            AstDumper(&cout, &symbols).program(program, dump);
+            if (dump != AstFormat::Binary)
             {
-                this->expect(TokenKindStringToInt["Op"], ";", 0);
+                cout << endl;
             }
+            return;
         }
+        ConstantFolder().program(program);
+        Resolver().program(program);
 
-        beg->body = body;
-        return Statement(ass, beg, cal, _if, whi);
-    }
+        cerr << file.name() << ": " << lx.length() << " bytes (" << (file.mapped() ? "mapped" : "streamed") << "), "
+             << arena.nodes() << " nodes, " << arena.bytes() << " bytes of AST" << endl;
 
-    else if (this->check(TokenKindStringToInt["KeyWord"], "if", 0))
-    {
-        Condition cond = this->condition();
-        this->expect(TokenKindStringToInt["KeyWord"], "then", 0);
-        _if->cond = &cond;
-        auto stmt = this->statement();
-        _if->then = &stmt;
-        return Statement(ass, beg, cal, _if, whi);
-    }
+        if (emitC)
+        {
+            CEmitter(&cout).program(program);
+            return;
+        }
 
-    else if (this->check(TokenKindStringToInt["KeyWord"], "while", 0))
-    {
-        Condition cond = this->condition();
-        this->expect(TokenKindStringToInt["KeyWord"], "then", 0);
-        whi->cond = &cond;
-        auto stmt = this->statement();
-        whi->then = &stmt;
-        return Statement(ass, beg, cal, _if, whi);
+        Compiler(&bc).program(program);
+        RegCompiler(&rb).program(&bc);
+        if (cached && !cache->store(file.view(), rb))
+        {
+            cerr << file.name() << ": cannot write " << cache->path(file.view()) << endl;
+        }
     }
 
-    else
+    if (useJit)
     {
-        Token tk = this->lx->next();
-        int ty = tk.ty;
-
-        if (ty != TokenKindStringToInt["Name"])
+        Jit jit;
+        if (jit.compile(code))
         {
-            throw "name expected";
+            jit.run();
+            cout << jit << endl;
+            return;
         }
-
-        this->expect(TokenKindStringToInt["Op"], ":=", 0);
-        ass->name = tk.valString;
-        auto expr = this->expression();
-        ass->expr = &expr;
-        return Statement(ass, beg, cal, _if, whi);
     }
+
+    RegVM rvm(code);
+    rvm.run();
+    cout << rvm << endl;
 }
 
-Condition Parser::condition()
+// `procs` procedures of `lines` statements each, one statement per editor line.
+string proceduralProgram(int procs, int lines)
 {
-    if (this->check(TokenKindStringToInt["KeyWord"], "odd", 0))
-    {
-        auto odd = this->odd_condition();
-        return Condition(&odd, nullptr);
-    }
-    else
+    string src = "var a, b; ";
+    for (int k = 0; k < procs; k++)
     {
-        auto std = this->std_condition();
-        return Condition(nullptr, &std);
+        src += "procedure p" + to_string(k) + ";\nvar x;\nbegin\n    x := a;\n";
+        for (int l = 0; l < lines; l++)
+        {
+            src += "    x := x * 3 + " + to_string(l % 10) + ";\n";
+        }
+        src += "    a := x\nend;\n";
     }
+    src += "begin a := 1; call p0; b := a end.";
+    return src;
 }
 
-OddCondition Parser::odd_condition()
+// Stack code of a program, resolved anew.
+vector<Ir> compiledCode(Program* program)
 {
-    auto expr = this->expression();
-    return OddCondition(&expr);
+    Resolver().program(program);
+    Bytecode bc;
+    Compiler(&bc).program(program);
+    return bc.code;
 }
 
-StdCondition Parser::std_condition()
+bool sameCode(const vector<Ir>& a, const vector<Ir>& b)
 {
-    Expression lhs = this->expression();
-    Token cmp = this->lx->next();
-
-    if (cmp.ty != TokenKindStringToInt["Op"])
-    {
-        throw "operator expected";
-    }
-
-    vector<string> op_list = { "=", "#", "<", ">", "<=", ">=" };
-    if (find(op_list.begin(), op_list.end(), cmp.valString) == op_list.end())
+    return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), [](const Ir& x, const Ir& y)
     {
-        throw "condition operator expected";
-    }
-
-    Expression rhs = this->expression();
-    return StdCondition(cmp.valString, &lhs, &rhs);
+        return x.op == y.op && x.arg == y.arg && x.arg2 == y.arg2 && x.depth == y.depth && x.depth2 == y.depth2;
+    });
 }
 
-Expression Parser::expression()
+// A one-line edit in the middle of a large program: a full parse against an
+// incremental reparse, and the edited AST checked against a fresh parse.
+int benchIncremental(int lines, int rounds)
 {
-    string mod = "";
-    if (this->check(TokenKindStringToInt["Op"], "+", 0))
-    {
-        mod = "+";
-    }
-    else if (this->check(TokenKindStringToInt["Op"], "-", 0))
-    {
-        mod = "-";
-    }
+    int procs = max(1, lines / 50);
+    string src = proceduralProgram(procs, 50);
+    IncrementalParser inc(src);
 
-    vector<pair<string, Term*>> rhs;
-    Term lhs = this->term();
+    // turn `+ 7;` into `+ 71;` in the middle procedure, then back
+    size_t at = src.find("+ 7;", src.find("procedure p" + to_string(procs / 2) + ";")) + 3;
 
-    while (1)
+    double fullTime = 1e30;
+    double editTime = 1e30;
+    for (int r = 0; r < rounds; r++)
     {
-        if (this->check(TokenKindStringToInt["Op"], "+", 0))
+        auto t0 = chrono::steady_clock::now();
         {
-            auto term = this->term();
-            rhs.push_back(pair<string, Term*>{"+", & term});
+            Arena arena;
+            SymbolTable symbols;
+            Lexer lx(inc.source(), &symbols);
+            Parser ps = Parser(&lx, &arena);
+            ps.program();
         }
-        else if (this->check(TokenKindStringToInt["Op"], "-", 0))
-        {
-            auto term = this->term();
-            rhs.push_back(pair<string, Term*>{"-", & term});
-        }
-        else
+        auto t1 = chrono::steady_clock::now();
+        fullTime = min(fullTime, chrono::duration<double>(t1 - t0).count());
+
+        for (bool insert : { true, false })
         {
-            break;
+            t0 = chrono::steady_clock::now();
+            inc.edit(at, insert ? 0 : 1, insert ? "1" : "");
+            t1 = chrono::steady_clock::now();
+            editTime = min(editTime, chrono::duration<double>(t1 - t0).count());
         }
     }
-    return Expression(mod, &lhs, rhs);
+
+    inc.edit(at, 0, "1");
+    Arena arena;
+    SymbolTable symbols;
+    Lexer lx(inc.source(), &symbols);
+    Parser ps = Parser(&lx, &arena);
+    bool same = sameCode(compiledCode(inc.program()), compiledCode(ps.program()));
+
+    cout << "incremental: " << procs * 50 << " lines, " << inc.source().size() << " bytes; full parse "
+         << fullTime * 1e3 << " ms, one-line edit " << editTime * 1e6 << " us (" << fullTime / editTime << "x); "
+         << inc.incremental << " incremental, " << inc.full << " full parses; "
+         << (same ? "code matches a full parse" : "CODE DIFFERS from a full parse") << endl;
+    return same ? 0 : 1;
 }
 
-Term Parser::term()
+// Front end plus register compilation of a generated program against loading its
+// cached image.
+int benchCache(size_t bytes, int rounds)
 {
-    vector<pair<string, Factor*>> rhs;
-    Factor lhs = this->factor();
-
-    while (1)
+    string src = syntheticProgram(bytes);
+    const char* tmp = getenv("TMPDIR");
+    string dir = string(tmp != nullptr ? tmp : "/tmp") + "/pl0-bench-cache";
+    BytecodeCache cache(dir);
+
+    double compileTime = 1e30;
+    double loadTime = 1e30;
+    size_t instructions = 0;
+    for (int r = 0; r < rounds; r++)
     {
-        if (this->check(TokenKindStringToInt["Op"], "*", 0))
+        auto t0 = chrono::steady_clock::now();
+        Arena arena;
+        SymbolTable symbols;
+        Lexer lx(src, &symbols);
+        Parser ps = Parser(&lx, &arena);
+        Program* program = ps.program();
+        ConstantFolder().program(program);
+        Resolver().program(program);
+        Bytecode bc;
+        Compiler(&bc).program(program);
+        RegBytecode rb;
+        RegCompiler(&rb).program(&bc);
+        auto t1 = chrono::steady_clock::now();
+        compileTime = min(compileTime, chrono::duration<double>(t1 - t0).count());
+        instructions = rb.code.size();
+
+        if (r == 0 && !cache.store(src, rb))
         {
-            auto factor = this->factor();
-            rhs.push_back(pair<string, Factor*>{"*", & factor});
+            cout << "cache: cannot write " << cache.path(src) << endl;
+            return 1;
         }
-        else if (this->check(TokenKindStringToInt["Op"], "/", 0))
-        {
-            auto factor = this->factor();
-            rhs.push_back(pair<string, Factor*>{"/", & factor});
-        }
-        else
+
+        t0 = chrono::steady_clock::now();
+        BytecodeImage image;
+        if (!cache.load(src, &image) || image.bytecode()->code.size() != instructions)
         {
-            break;
+            cout << "cache: image did not load" << endl;
+            return 1;
         }
+        t1 = chrono::steady_clock::now();
+        loadTime = min(loadTime, chrono::duration<double>(t1 - t0).count());
     }
-    return Term(&lhs, rhs);
+
+    cout << "cache: " << src.size() << " bytes, " << instructions << " instructions; compile " << compileTime * 1e3
+         << " ms, load " << loadTime * 1e3 << " ms (" << compileTime / loadTime << "x) from " << cache.path(src) << endl;
+    return 0;
 }
 
-Factor Parser::factor()
+int main(int argc, char** argv)
 {
-    Token tk = this->lx->next();
-    int ty = tk.ty;
-    int valInt = tk.valInt;
-    string valString = tk.valString;
-
-    if (ty == TokenKindStringToInt["Num"])
+    if (argc > 1 && strcmp(argv[1], "--bench-lex") == 0)
     {
-        auto expr = new Expression;
-        return Factor("", valInt, expr);
+        size_t mb = argc > 2 ? atoi(argv[2]) : 16;
+        return benchLexer(mb << 20, 5);
     }
-    if (ty == TokenKindStringToInt["Name"])
+
+    if (argc > 1 && strcmp(argv[1], "--bench-parse") == 0)
     {
-        auto expr = new Expression;
-        return Factor(valString, 0, expr);
+        size_t mb = argc > 2 ? atoi(argv[2]) : 16;
+        return benchParser(mb << 20, 5);
     }
 
-    if (ty != TokenKindStringToInt["Op"] || valString != "(")
+    if (argc > 1 && strcmp(argv[1], "--bench-dump") == 0)
     {
-        throw "'(' expected";
+        size_t mb = argc > 2 ? atoi(argv[2]) : 16;
+        return benchDump(mb << 20, 5);
     }
 
-    Expression expr = this->expression();
-    this->expect(TokenKindStringToInt["Op"], ")", 0);
-    return Factor("", 0, &expr);
-}
-
-ostream& operator<<(ostream& cout, const Expression expression)
-{
-    cout << "[Expression | mod: " << expression.mod << " lhs: " << *expression.lhs << " rhs: ";
-    for (auto item : expression.rhs)
+    if (argc > 1 && strcmp(argv[1], "--bench-nesting") == 0)
     {
-        cout << "<" << item.first << "," << *item.second << ">";
+        int depth = argc > 2 ? atoi(argv[2]) : 1000000;
+        return benchNesting(depth, 5);
     }
-    cout << "]";
-    return cout;
-}
-
-ostream& operator<<(ostream& cout, const Const _const)
-{
-    cout << "[Const | name: " << _const.name << " value: " << _const.value << "]";
-    return cout;
-}
-
-ostream& operator<<(ostream& cout, const Assign assign)
-{
-    cout << "Assign | name: " << assign.name << "expr: " << *assign.expr << "]";
-    return cout;
-}
 
-ostream& operator<<(ostream& cout, const Call call)
-{
-    cout << "[Call | name: " << call.name << "]";
-    return cout;
-}
+    if (argc > 1 && strcmp(argv[1], "--bench-vm") == 0)
+    {
+        int outer = argc > 2 ? atoi(argv[2]) : 10000;
+        return benchVM(outer, 5);
+    }
 
-ostream& operator<<(ostream& cout, const Begin begin)
-{
-    cout << "[Begin | body: " << begin.body << "]";
-    return cout;
-}
+    if (argc > 1 && strcmp(argv[1], "--bench-reg") == 0)
+    {
+        int outer = argc > 2 ? atoi(argv[2]) : 10000;
+        return benchRegisterVM(outer, 5);
+    }
 
-ostream& operator<<(ostream& cout, const OddCondition odd_condition)
-{
-    cout << "[OddCondition | expr: " << *odd_condition.expr << "]";
-    return cout;
-}
+    if (argc > 1 && strcmp(argv[1], "--bench-closure") == 0)
+    {
+        int outer = argc > 2 ? atoi(argv[2]) : 10000;
+        return benchClosure(outer, 5);
+    }
 
-ostream& operator<<(ostream& cout, const StdCondition std_condition)
-{
-    cout << "[StdCondition | op: " << std_condition.op << " lhs: " << *std_condition.lhs << " rhs: " << *std_condition.rhs << "]";
-    return cout;
-}
+    if (argc > 1 && strcmp(argv[1], "--bench-values") == 0)
+    {
+        int outer = argc > 2 ? atoi(argv[2]) : 10000;
+        return benchValues(outer, 5);
+    }
 
-ostream& operator<<(ostream& cout, const Factor factor)
-{
-    cout << "[Factor | valString: " << factor.valString << " valInt: " << factor.valInt << " valExpr: " << *factor.valExpr << "]";
-    return cout;
-}
+    if (argc > 1 && strcmp(argv[1], "--check-backends") == 0)
+    {
+        int programs = argc > 2 ? atoi(argv[2]) : 6000;
+        return checkBackends(programs);
+    }
 
-ostream& operator<<(ostream& cout, const Term term)
-{
-    cout << "[Term | lhs: " << *term.lhs << " rhs: ";
-    for (auto item : term.rhs)
+    if (argc > 1 && strcmp(argv[1], "--bench-fold") == 0)
     {
-        cout << "<" << item.first << "," << *item.second << ">";
+        int outer = argc > 2 ? atoi(argv[2]) : 10000;
+        return benchFold(outer, 5);
     }
-    cout << "]";
-    return cout;
-}
 
-ostream& operator<<(ostream& cout, const Condition condition)
-{
-    cout << "[Condition | OddCondition: " << *condition.oddCond << " StdCondition: " << *condition.stdCond << "]";
-    return cout;
-}
+    if (argc > 1 && strcmp(argv[1], "--bench-peephole") == 0)
+    {
+        int outer = argc > 2 ? atoi(argv[2]) : 10000;
+        return benchPeephole(outer, 5);
+    }
 
-ostream& operator<<(ostream& cout, const If _if)
-{
-    cout << "[If | Condition: " << *_if.cond << " Statement: " << *_if.then << "]";
-    return cout;
-}
+    if (argc > 1 && strcmp(argv[1], "--bench-jit") == 0)
+    {
+        int outer = argc > 2 ? atoi(argv[2]) : 10000;
+        return benchJit(outer, 5);
+    }
 
-ostream& operator<<(ostream& cout, const While _while)
-{
-    cout << "[while | Condition: " << *_while.cond << " Statement: " << *_while.then << "]";
-    return cout;
-}
+    if (argc > 1 && strcmp(argv[1], "--bench-aot") == 0)
+    {
+        int outer = argc > 2 ? atoi(argv[2]) : 10000;
+        return benchAot(outer, 5);
+    }
 
-ostream& operator<<(ostream& cout, const Statement statement)
-{
-    cout << "[Statement | Assign: " << *statement.stmtA << " Begin: " << *statement.stmtB << " Call: " << *statement.stmtC << " If: " << *statement.stmtI << " While: " << *statement.stmtW << "]";
-    return cout;
-}
+    if (argc > 1 && strcmp(argv[1], "--bench-cache") == 0)
+    {
+        size_t mb = argc > 2 ? atoi(argv[2]) : 4;
+        return benchCache(mb << 20, 5);
+    }
 
-ostream& operator<<(ostream& cout, const Procedure procedure)
-{
-    cout << "Procedure | name : " << procedure.name << " body: " << *procedure.body << "]";
-    return cout;
-}
+    if (argc > 1 && strcmp(argv[1], "--bench-incremental") == 0)
+    {
+        int lines = argc > 2 ? atoi(argv[2]) : 100000;
+        return benchIncremental(lines, 5);
+    }
 
-ostream& operator<<(ostream& cout, const Program program)
-{
-    cout << "[Program | block: " << program.block << "]";
-    return cout;
-}
+    if (argc > 1 && strcmp(argv[1], "--bench-batch") == 0)
+    {
+        int files = argc > 2 ? atoi(argv[2]) : 2000;
+        return benchBatch(files, 3);
+    }
 
-ostream& operator<<(ostream& cout, const Block block)
-{
-    cout << "Block| consts: ";
-    for (auto const_ptr : block.consts)
+    bool useJit = false;
+    bool emitC = false;
+    bool batch = false;
+    AstFormat dump = AstFormat::None;
+    bool explicitStack = false;
+    string cacheDir;
+    int threads = max(1u, thread::hardware_concurrency());
+    vector<string> paths;
+    for (int k = 1; k < argc; k++)
     {
-        cout << *const_ptr;
+        if (strcmp(argv[k], "--jit") == 0)
+        {
+            useJit = true;
+        }
+        else if (strcmp(argv[k], "--batch") == 0)
+        {
+            batch = true;
+        }
+        else if (strcmp(argv[k], "--threads") == 0 && k + 1 < argc)
+        {
+            threads = atoi(argv[++k]);
+        }
+        else if (strcmp(argv[k], "--cache") == 0 && k + 1 < argc)
+        {
+            cacheDir = argv[++k];
+        }
+        else if (strcmp(argv[k], "--emit-c") == 0)
+        {
+            emitC = true;
+        }
+        else if (strcmp(argv[k], "--explicit-stack") == 0)
+        {
+            explicitStack = true;
+        }
+        else if (strcmp(argv[k], "--dump-ast") == 0 && k + 1 < argc)
+        {
+            string format = argv[++k];
+            if (format != "text" && format != "json" && format != "binary")
+            {
+                cerr << "unknown --dump-ast format '" << format << "' (expected text, json or binary)" << endl;
+                return 1;
+            }
+            dump = format == "json" ? AstFormat::Json : format == "binary" ? AstFormat::Binary : AstFormat::Text;
+        }
+        else
+        {
+            paths.push_back(argv[k]);
+        }
     }
 
-    cout << "vars: ";
-    for (auto var_string : block.vars)
+    // pl0 --batch [--threads N] (file | dir | @list)... compiles without running.
+    if (batch)
     {
-        cout << var_string << ",";
+        try
+        {
+            return runBatch(paths, threads);
+        }
+        catch (const string& msg)
+        {
+            cerr << msg << endl;
+            return 1;
+        }
     }
 
-    cout << "procs: ";
-    for (auto proc_ptr : block.procs)
+    // pl0 [--jit | --emit-c | --dump-ast text|json|binary] [--explicit-stack]
+    // [--cache dir] file... compiles and runs each file ("-" is stdin), or prints
+    // its syntax tree; without files the built-in test programs are run through
+    // every stage.
+    if (!paths.empty())
     {
-        cout << *proc_ptr;
+        unique_ptr<BytecodeCache> cache;
+        if (!cacheDir.empty())
+        {
+            cache.reset(new BytecodeCache(cacheDir));
+        }
+        int status = 0;
+        for (const string& path : paths)
+        {
+            try
+            {
+                SourceFile file(path);
+                runSource(file, useJit, emitC, cache.get(), dump, explicitStack);
+            }
+            catch (const char* msg)
+            {
+                printError(path, msg);
+                status = 1;
+            }
+            catch (const string& msg)
+            {
+                printError(path, msg);
+                status = 1;
+            }
+        }
+        return status;
     }
 
-    cout << "statement: " << *block.stmt << "]";
-    return cout;
-}
+    for (string* test : { &TEST_PROGRAM, &TEST_PROGRAM2, &TEST_PROGRAM3 })
+    {
+        if (!emitC)
+        {
+            cout << *test << endl;
+        }
 
+        Arena arena;
+        SymbolTable symbols;
+        Lexer lx(*test, &symbols);
+        Parser ps = Parser(&lx, &arena);
+        Program* program = ps.program();
 
-int main()
-{
-    cout << TEST_PROGRAM << endl;
+        if (emitC)
+        {
+            Resolver().program(program);
+            CEmitter(&cout).program(program);
+            continue;
+        }
+
+        cout << *program << endl;
+
+        ConstantFolder folder;
+        folder.program(program);
+        cerr << "fold: " << folder.stats.constants << " constants, " << folder.stats.folds << " folds, "
+             << folder.stats.identities << " identities, " << folder.stats.branches << " branches" << endl;
 
-    // Lexer lx(TEST_PROGRAM);
-    // Token tk = lx.next();
-    // while (tk.ty != TokenKindStringToInt["Eof"])
-    // {
-    //     cout << tk << endl;
-    //     tk = lx.next();
-    // }
+        Resolver().program(program);
+        AstInterpreter interp(program);
+        interp.run();
+        cout << interp << endl;
 
-    Lexer* lx = new Lexer(TEST_PROGRAM);
-    Parser ps = Parser(lx);
-    cout << ps.program();
+        ClosureInterpreter closures(program);
+        closures.run();
+        cout << closures << endl;
+
+        Bytecode bc;
+        Compiler(&bc).program(program);
+        cout << bc;
+
+        VM vm(&bc);
+        vm.run();
+        cout << vm << endl;
+
+        RegBytecode rb;
+        RegCompiler(&rb).program(&bc);
+        cout << rb;
+
+        RegVM rvm(&rb);
+        rvm.run();
+        cout << rvm << endl;
+
+        if (useJit)
+        {
+            Jit jit;
+            if (jit.compile(&rb))
+            {
+                jit.run();
+                cout << jit << endl;
+            }
+            else
+            {
+                cout << "jit: not available, interpreted above" << endl;
+            }
+        }
+
+        Bytecode opt = bc;
+        Peephole peephole(&opt);
+        peephole.run();
+        cout << opt;
+        cerr << "peephole: " << peephole << endl;
+
+        VM ovm(&opt);
+        ovm.run();
+        cout << ovm << endl;
+
+        cerr << "arena: " << arena.nodes() << " nodes, " << arena.bytes() << " bytes used, "
+             << arena.reserved() << " bytes reserved in " << arena.chunksInUse() << " chunk(s)" << endl;
+        cerr << "lexer: " << lx.scanned << " bytes scanned for " << lx.length() << " source bytes ("
+             << lx.scanRatio() << "x)" << endl;
+    }
 
     return 0;
 }
\ No newline at end of file